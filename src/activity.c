@@ -0,0 +1,75 @@
+/*
+ * Macroblock activity and scene changes from downscaled luma
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include "activity.h"
+
+int activity_grid(uint8_t *grid, const uint8_t *cur, const uint8_t *prev, int stride,
+	int mb_w, int mb_h)
+{
+	int mb_x, mb_y, x, y, sad, total = 0;
+	const uint8_t *c, *p;
+
+	for (mb_y = 0; mb_y < mb_h; mb_y++)
+		for (mb_x = 0; mb_x < mb_w; mb_x++) {
+			c = cur + mb_y * 8 * stride + mb_x * 8;
+			p = prev + mb_y * 8 * stride + mb_x * 8;
+
+			sad = 0;
+			for (y = 0; y < 8; y++, c += stride, p += stride)
+				for (x = 0; x < 8; x++)
+					sad += abs(c[x] - p[x]);
+
+			grid[mb_y * mb_w + mb_x] = sad / 64;
+			total += sad / 64;
+		}
+
+	return total / (mb_w * mb_h);
+}
+
+void activity_block_means(uint8_t *dst, const uint8_t *luma, int stride, int width, int height)
+{
+	int bx, by, x, y, sum;
+	const uint8_t *p;
+
+	for (by = 0; by < height / 8; by++)
+		for (bx = 0; bx < width / 8; bx++) {
+			p = luma + by * 8 * stride + bx * 8;
+
+			sum = 0;
+			for (y = 0; y < 8; y += 2, p += 2 * stride)
+				for (x = 0; x < 8; x++)
+					sum += p[x];
+
+			*dst++ = sum / 32;
+		}
+}
+
+int activity_diff(const uint8_t *a, const uint8_t *b, int size)
+{
+	int i, sad = 0;
+
+	for (i = 0; i < size; i++)
+		sad += abs(a[i] - b[i]);
+
+	return size > 0 ? sad / size : 0;
+}
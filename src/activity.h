@@ -0,0 +1,43 @@
+/*
+ * Macroblock activity and scene changes from downscaled luma
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __ACTIVITY_H__
+#define __ACTIVITY_H__
+
+#include <stdint.h>
+
+/* mean absolute difference of each 8x8 block of two half resolution
+ * luma pictures, one byte per macroblock. Returns the mean over the
+ * picture.
+ */
+int activity_grid(uint8_t *grid, const uint8_t *cur, const uint8_t *prev, int stride,
+	int mb_w, int mb_h);
+
+/* mean of every 8x8 block of a luma plane into a (width / 8) x
+ * (height / 8) picture, sampling every other row
+ */
+void activity_block_means(uint8_t *dst, const uint8_t *luma, int stride, int width, int height);
+
+/* mean absolute difference of two pictures of size bytes */
+int activity_diff(const uint8_t *a, const uint8_t *b, int size);
+
+#endif
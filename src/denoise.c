@@ -0,0 +1,75 @@
+/*
+ * Temporal denoiser for the encoder input
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* For a change d = cur - prev and threshold t the output is
+ *
+ *   cur - sign(d) * m / 2,  m = min(|d|, 2t - |d|) clamped to 0
+ *
+ * which is (cur + prev) / 2 for small changes and cur for large ones.
+ * Reading the previous frame from the destination keeps this at one
+ * pass over the memory, in place of the plain copy.
+ */
+
+#include <string.h>
+#include "denoise.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+void denoise_copy(uint8_t *dst, const uint8_t *src, int size, int strength)
+{
+	int t = 4 * strength, i = 0, a, m;
+
+	if (strength <= 0) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+#ifdef __ARM_NEON__
+	{
+		uint8x16_t t2 = vdupq_n_u8(2 * t);
+
+		for (; i + 16 <= size; i += 16) {
+			uint8x16_t cur = vld1q_u8(src + i);
+			uint8x16_t prev = vld1q_u8(dst + i);
+			uint8x16_t abs = vabdq_u8(cur, prev);
+			uint8x16_t half = vrshrq_n_u8(vminq_u8(abs, vqsubq_u8(t2, abs)), 1);
+
+			vst1q_u8(dst + i, vbslq_u8(vcgtq_u8(cur, prev),
+				vsubq_u8(cur, half), vaddq_u8(cur, half)));
+		}
+	}
+#endif
+
+	for (; i < size; i++) {
+		a = src[i] > dst[i] ? src[i] - dst[i] : dst[i] - src[i];
+		m = 2 * t - a;
+		if (m > a)
+			m = a;
+		if (m < 0)
+			m = 0;
+
+		dst[i] = src[i] > dst[i] ? src[i] - (m + 1) / 2 : src[i] + (m + 1) / 2;
+	}
+}
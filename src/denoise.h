@@ -0,0 +1,39 @@
+/*
+ * Temporal denoiser for the encoder input
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+
+#include <stdint.h>
+
+#define DENOISE_MAX_STRENGTH	31
+
+/* copy size bytes from src to dst, where dst still holds the previous
+ * (denoised) frame. Bytes that changed by up to 4 * strength are
+ * averaged with the previous value, larger changes fade back to the
+ * new value by 8 * strength, so noise is smoothed out over frames
+ * while motion passes through.
+ */
+void denoise_copy(uint8_t *dst, const uint8_t *src, int size, int strength);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Cedar Plugin
+ * Copyright (C) 2014 Enrico Butera <ebutera@users.sourceforge.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstcedarh264dec.h"
+#include "gstcedarh264enc.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_cedarh264dec_debug);
+GST_DEBUG_CATEGORY_EXTERN (gst_cedarh264enc_debug);
+
+/* entry point to initialize the plug-in */
+static gboolean
+cedar_init (GstPlugin * plugin)
+{
+  // debug categories for fltering log messages
+  GST_DEBUG_CATEGORY_INIT (gst_cedarh264dec_debug, "cedar_h264dec",
+      0, "CedarX H264 Decoder");
+  GST_DEBUG_CATEGORY_INIT (gst_cedarh264enc_debug, "cedar_h264enc",
+      0, "CedarX H264 Encoder");
+
+  if (!gst_element_register (plugin, "cedar_h264dec", GST_RANK_NONE,
+      GST_TYPE_CEDAR_H264DEC))
+    return FALSE;
+
+  return gst_element_register (plugin, "cedar_h264enc", GST_RANK_NONE,
+      GST_TYPE_CEDAR_H264ENC);
+}
+
+/* PACKAGE: this is usually set by autotools depending on some _INIT macro
+ * in configure.ac and then written into and defined in config.h, but we can
+ * just set it ourselves here in case someone doesn't use autotools to
+ * compile this code. GST_PLUGIN_DEFINE needs PACKAGE to be defined.
+ */
+#ifndef PACKAGE
+#define PACKAGE "gst-plugin-cedar"
+#endif
+
+// gstreamer looks for this structure to register the elements
+GST_PLUGIN_DEFINE (
+    GST_VERSION_MAJOR,
+    GST_VERSION_MINOR,
+    "cedar",
+    "CedarX hardware codecs",
+    cedar_init,
+    VERSION,
+    "LGPL",
+    "Sunxi",
+    "http://github.com/ebutera/gst-plugin-cedar"
+)
@@ -0,0 +1,102 @@
+/*
+ * Cedar Plugin, buffers in VE memory
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "gstcedarbuffer.h"
+#include "ve.h"
+
+static GstBufferClass *cedar_buffer_parent_class = NULL;
+
+static void
+gst_cedar_buffer_finalize (GstCedarBuffer * buf)
+{
+	ve_free(buf->mem);
+
+	// every buffer keeps the VE open, it may outlive the element
+	ve_close();
+
+	GST_MINI_OBJECT_CLASS(cedar_buffer_parent_class)->finalize(GST_MINI_OBJECT(buf));
+}
+
+static void
+gst_cedar_buffer_class_init (gpointer g_class, gpointer class_data)
+{
+	GstMiniObjectClass *mini_object_class = GST_MINI_OBJECT_CLASS(g_class);
+
+	cedar_buffer_parent_class = g_type_class_peek_parent(g_class);
+
+	mini_object_class->finalize =
+		(GstMiniObjectFinalizeFunction) gst_cedar_buffer_finalize;
+}
+
+GType
+gst_cedar_buffer_get_type (void)
+{
+	static GType type = 0;
+
+	if (G_UNLIKELY(type == 0)) {
+		static const GTypeInfo info = {
+			sizeof (GstBufferClass),
+			NULL,
+			NULL,
+			gst_cedar_buffer_class_init,
+			NULL,
+			NULL,
+			sizeof (GstCedarBuffer),
+			0,
+			NULL,
+			NULL
+		};
+
+		type = g_type_register_static(GST_TYPE_BUFFER, "GstCedarBuffer", &info, 0);
+	}
+
+	return type;
+}
+
+GstCedarBuffer *
+gst_cedar_buffer_new (int size)
+{
+	GstCedarBuffer *buf;
+
+	if (!ve_open())
+		return NULL;
+
+	buf = (GstCedarBuffer *) gst_mini_object_new(GST_TYPE_CEDAR_BUFFER);
+
+	buf->mem = ve_malloc(size);
+	if (!buf->mem) {
+		gst_buffer_unref(GST_BUFFER(buf));
+		return NULL;
+	}
+
+	buf->mem_size = size;
+	buf->phys = ve_virt2phys(buf->mem);
+
+	GST_BUFFER_DATA(buf) = buf->mem;
+	GST_BUFFER_SIZE(buf) = size;
+
+	return buf;
+}
@@ -0,0 +1,60 @@
+/*
+ * Cedar Plugin, buffers in VE memory
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __GST_CEDAR_BUFFER_H__
+#define __GST_CEDAR_BUFFER_H__
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_CEDAR_BUFFER \
+  (gst_cedar_buffer_get_type())
+#define GST_CEDAR_BUFFER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_CEDAR_BUFFER,GstCedarBuffer))
+#define GST_IS_CEDAR_BUFFER(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_CEDAR_BUFFER))
+
+typedef struct _GstCedarBuffer GstCedarBuffer;
+
+/* a buffer whose data is VE memory, so another cedar element can hand
+ * it to the VE without copying. The producer flushes the CPU cache
+ * before pushing it.
+ */
+struct _GstCedarBuffer
+{
+	GstBuffer buffer;
+
+	void *mem;
+	int mem_size;		// allocated, may be more than GST_BUFFER_SIZE
+	uint32_t phys;
+};
+
+GType gst_cedar_buffer_get_type (void);
+
+/* NULL if the VE can't be opened or its memory is exhausted */
+GstCedarBuffer *gst_cedar_buffer_new (int size);
+
+G_END_DECLS
+
+#endif /* __GST_CEDAR_BUFFER_H__ */
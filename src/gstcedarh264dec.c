@@ -0,0 +1,1126 @@
+/*
+ * Cedar H264 Decoder Plugin
+ *
+ * Gst template code:
+ * Copyright (C) 2005 Thomas Vander Stichele <thomas@apestaart.org>
+ * Copyright (C) 2005 Ronald S. Bultje <rbultje@ronald.bitfreak.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * SECTION:element-cedar_h264dec
+ *
+ * H.264 decoder using the H264 engine of the VE, for transcoding on the
+ * device. Progressive streams with I and P slices are supported, which
+ * covers what IP cameras and cedar_h264enc produce.
+ *
+ * The VE writes MB32 tiled pictures. They are converted to NV12 once, on
+ * the CPU, into VE memory, so cedar_h264enc reads the decoded frames
+ * without another copy.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch -e rtspsrc location=rtsp://camera/stream ! rtph264depay ! h264parse ! \
+ *     video/x-h264,alignment=au ! cedar_h264dec ! cedar_h264enc keyframe-interval=30 ! \
+ *     h264parse ! matroskamux ! filesink location="cedar.mkv"
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <gst/gst.h>
+
+#include "gstcedarh264dec.h"
+#include "gstcedarbuffer.h"
+#include "tiled.h"
+
+GST_DEBUG_CATEGORY (gst_cedarh264dec_debug);
+#define GST_CAT_DEFAULT gst_cedarh264dec_debug
+
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+#define BITSTREAM_BUF_SIZE	(256 * 1024)
+#define EXTRA_BUF_SIZE		0x50000
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (
+		"video/x-h264, "
+			"stream-format = (string) { byte-stream, avc }, "
+			"alignment = (string) au"
+    )
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (
+		"video/x-raw-yuv, "
+			"format = (fourcc) NV12, "
+			"width = (int) [16,4096], "
+			"height = (int) [16,4096], "
+			"framerate = (fraction) [0/1,MAX]"
+    )
+    );
+
+GST_BOILERPLATE (Gstcedarh264dec, gst_cedarh264dec, GstElement,
+    GST_TYPE_ELEMENT);
+
+static void gst_cedarh264dec_finalize (GObject * object);
+
+static gboolean gst_cedarh264dec_set_caps (GstPad * pad, GstCaps * caps);
+static gboolean gst_cedarh264dec_sink_event (GstPad * pad, GstEvent * event);
+static GstFlowReturn gst_cedarh264dec_chain (GstPad * pad, GstBuffer * buf);
+static GstStateChangeReturn
+	gst_cedarh264dec_change_state (GstElement *element, GstStateChange transition);
+
+static void
+gst_cedarh264dec_base_init (gpointer gclass)
+{
+  GstElementClass *element_class = GST_ELEMENT_CLASS (gclass);
+
+  gst_element_class_set_details_simple(element_class,
+    "cedar_h264dec",
+    "Codec/Decoder/Video",
+    "H264 Decoder Plugin for CedarX hardware",
+    "Enrico Butera <ebutera@users.berlios.de>");
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+static void
+gst_cedarh264dec_class_init (Gstcedarh264decClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+
+  gobject_class->finalize = gst_cedarh264dec_finalize;
+
+  gstelement_class->change_state = gst_cedarh264dec_change_state;
+}
+
+static void
+gst_cedarh264dec_init (Gstcedarh264dec * filter,
+    Gstcedarh264decClass * gclass)
+{
+  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_setcaps_function (filter->sinkpad,
+                                GST_DEBUG_FUNCPTR(gst_cedarh264dec_set_caps));
+  gst_pad_set_event_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_cedarh264dec_sink_event));
+  gst_pad_set_chain_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_cedarh264dec_chain));
+
+  filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
+  gst_pad_use_fixed_caps (filter->srcpad);
+
+  gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+
+  filter->fps_den = 1;
+  filter->par_n = filter->par_d = 1;
+  filter->max_long_term_frame_idx = -1;
+  filter->need_idr = TRUE;
+}
+
+static void free_param_sets(Gstcedarh264dec *filter)
+{
+	int i;
+
+	for (i = 0; i < H264_MAX_SPS; i++) {
+		g_free(filter->sps[i]);
+		filter->sps[i] = NULL;
+	}
+
+	for (i = 0; i < H264_MAX_PPS; i++) {
+		g_free(filter->pps[i]);
+		filter->pps[i] = NULL;
+	}
+}
+
+static void
+gst_cedarh264dec_finalize (GObject * object)
+{
+	free_param_sets(GST_CEDAR_H264DEC(object));
+
+	G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+static void reset_refs(Gstcedarh264dec *filter)
+{
+	int i;
+
+	for (i = 0; i < filter->num_frames; i++)
+		filter->frames[i].ref = CEDAR_REF_NONE;
+
+	memset(&filter->poc, 0, sizeof(filter->poc));
+	filter->max_long_term_frame_idx = -1;
+	filter->need_idr = TRUE;
+	filter->discont = TRUE;
+}
+
+static void free_frames(Gstcedarh264dec *filter)
+{
+	int i;
+
+	for (i = 0; i < filter->num_frames; i++) {
+		ve_free(filter->frames[i].buf);
+		filter->frames[i].buf = NULL;
+	}
+
+	filter->num_frames = 0;
+	filter->sps_active = FALSE;
+}
+
+static void free_bufs(Gstcedarh264dec *filter)
+{
+	free_frames(filter);
+
+	ve_free(filter->bitstream_buf);
+	filter->bitstream_buf = NULL;
+	filter->bitstream_buf_size = 0;
+
+	ve_free(filter->extra_buf);
+	filter->extra_buf = NULL;
+}
+
+static void store_sps(Gstcedarh264dec *filter, const uint8_t *nal, int size)
+{
+	struct h264_sps sps;
+	int id;
+
+	if (!h264_parse_sps(&sps, &id, nal, size)) {
+		GST_WARNING_OBJECT(filter, "unsupported or broken SPS");
+		return;
+	}
+
+	if (!filter->sps[id])
+		filter->sps[id] = g_new(struct h264_sps, 1);
+	*filter->sps[id] = sps;
+}
+
+static void store_pps(Gstcedarh264dec *filter, const uint8_t *nal, int size)
+{
+	struct h264_pps pps;
+	int id;
+
+	if (!h264_parse_pps(&pps, &id, filter->sps, nal, size)) {
+		GST_WARNING_OBJECT(filter, "unsupported or broken PPS");
+		return;
+	}
+
+	if (!filter->pps[id])
+		filter->pps[id] = g_new(struct h264_pps, 1);
+	*filter->pps[id] = pps;
+}
+
+/* avcC from the caps, the parameter sets are length prefixed */
+static gboolean parse_codec_data(Gstcedarh264dec *filter, const uint8_t *data, int size)
+{
+	int i, j, count, len, pos;
+
+	if (size < 7 || data[0] != 1)
+		return FALSE;
+
+	filter->nal_length_size = (data[4] & 0x3) + 1;
+
+	pos = 5;
+	for (i = 0; i < 2; i++) {
+		if (pos >= size)
+			return FALSE;
+
+		count = i == 0 ? data[pos] & 0x1f : data[pos];
+		pos++;
+
+		for (j = 0; j < count; j++) {
+			if (pos + 2 > size)
+				return FALSE;
+
+			len = data[pos] << 8 | data[pos + 1];
+			pos += 2;
+			if (len == 0 || pos + len > size)
+				return FALSE;
+
+			if (i == 0)
+				store_sps(filter, data + pos, len);
+			else
+				store_pps(filter, data + pos, len);
+			pos += len;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+gst_cedarh264dec_set_caps (GstPad * pad, GstCaps * caps)
+{
+	Gstcedarh264dec *filter;
+	GstStructure *s;
+	const gchar *format;
+	const GValue *codec_data;
+	gboolean ret = TRUE;
+
+	filter = GST_CEDAR_H264DEC (gst_pad_get_parent (pad));
+	s = gst_caps_get_structure(caps, 0);
+
+	format = gst_structure_get_string(s, "stream-format");
+	filter->avc = format && strcmp(format, "avc") == 0;
+
+	if (filter->avc) {
+		codec_data = gst_structure_get_value(s, "codec_data");
+		if (!codec_data || !parse_codec_data(filter,
+				GST_BUFFER_DATA(gst_value_get_buffer(codec_data)),
+				GST_BUFFER_SIZE(gst_value_get_buffer(codec_data)))) {
+			GST_ERROR_OBJECT(filter, "avc stream without valid codec_data");
+			ret = FALSE;
+		}
+	}
+
+	if (!gst_structure_get_fraction(s, "framerate", &filter->fps_num, &filter->fps_den)) {
+		filter->fps_num = 0;
+		filter->fps_den = 1;
+	}
+
+	if (!gst_structure_get_fraction(s, "pixel-aspect-ratio", &filter->par_n, &filter->par_d))
+		filter->par_n = filter->par_d = 1;
+
+	// output caps follow from the first SPS used
+	filter->sps_active = FALSE;
+
+	gst_object_unref (filter);
+	return ret;
+}
+
+static gboolean
+gst_cedarh264dec_sink_event (GstPad * pad, GstEvent * event)
+{
+	Gstcedarh264dec *filter;
+	gboolean ret;
+
+	filter = GST_CEDAR_H264DEC (gst_pad_get_parent (pad));
+
+	switch (GST_EVENT_TYPE (event)) {
+		case GST_EVENT_FLUSH_STOP:
+			reset_refs(filter);
+			break;
+		default:
+			break;
+	}
+
+	ret = gst_pad_push_event(filter->srcpad, event);
+	gst_object_unref (filter);
+
+	return ret;
+}
+
+/* (re)allocate the frame pool for a new sequence and set the output caps */
+static gboolean activate_sps(Gstcedarh264dec *filter, const struct h264_sps *sps)
+{
+	const struct h264_sps *old = &filter->active_sps;
+	GstCaps *caps;
+	int i, num_frames, width, height, frame_size;
+
+	if (!sps->frame_mbs_only_flag) {
+		GST_ELEMENT_ERROR(filter, STREAM, DECODE, (NULL), ("interlaced streams are not supported"));
+		return FALSE;
+	}
+
+	num_frames = MIN(MAX(sps->max_num_ref_frames, 1) + 1, CEDAR_DEC_MAX_FRAMES - 1);
+
+	if (filter->sps_active && filter->num_frames == num_frames &&
+			old->pic_width_in_mbs == sps->pic_width_in_mbs &&
+			old->pic_height_in_map_units == sps->pic_height_in_map_units &&
+			old->direct_8x8_inference_flag == sps->direct_8x8_inference_flag &&
+			old->crop_left == sps->crop_left && old->crop_right == sps->crop_right &&
+			old->crop_top == sps->crop_top && old->crop_bottom == sps->crop_bottom) {
+		filter->active_sps = *sps;
+		return TRUE;
+	}
+
+	free_frames(filter);
+
+	width = sps->pic_width_in_mbs * 16;
+	height = sps->pic_height_in_map_units * 16;
+
+	filter->tile_w = ALIGN(width, 32);
+	filter->luma_size = filter->tile_w * ALIGN(height, 32);
+	filter->chroma_size = filter->tile_w * ALIGN(height / 2, 32);
+	filter->mv_col_size = sps->pic_width_in_mbs * sps->pic_height_in_map_units * 16;
+	if (!sps->direct_8x8_inference_flag)
+		filter->mv_col_size *= 2;
+
+	frame_size = filter->luma_size + filter->chroma_size + 2 * filter->mv_col_size;
+
+	for (i = 0; i < num_frames; i++) {
+		filter->frames[i].buf = ve_malloc(frame_size);
+		if (!filter->frames[i].buf) {
+			filter->num_frames = i;
+			free_frames(filter);
+			GST_ELEMENT_ERROR(filter, RESOURCE, NO_SPACE_LEFT, (NULL),
+				("cannot allocate %d frames of %d bytes", num_frames, frame_size));
+			return FALSE;
+		}
+		filter->frames[i].phys = ve_virt2phys(filter->frames[i].buf);
+		filter->frames[i].ref = CEDAR_REF_NONE;
+	}
+	filter->num_frames = num_frames;
+
+	filter->width = width - sps->crop_left - sps->crop_right;
+	filter->height = height - sps->crop_top - sps->crop_bottom;
+	filter->active_sps = *sps;
+	filter->sps_active = TRUE;
+
+	GST_INFO_OBJECT(filter, "%dx%d, %d frames of %d bytes", filter->width, filter->height,
+		num_frames, frame_size);
+
+	caps = gst_caps_new_simple("video/x-raw-yuv",
+		"format", GST_TYPE_FOURCC, GST_MAKE_FOURCC('N', 'V', '1', '2'),
+		"width", G_TYPE_INT, filter->width,
+		"height", G_TYPE_INT, filter->height,
+		"framerate", GST_TYPE_FRACTION, filter->fps_num, filter->fps_den,
+		"pixel-aspect-ratio", GST_TYPE_FRACTION, filter->par_n, filter->par_d, NULL);
+
+	if (!gst_pad_set_caps(filter->srcpad, caps)) {
+		gst_caps_unref(caps);
+		GST_ELEMENT_ERROR(filter, CORE, NEGOTIATION, (NULL), ("downstream refused %dx%d NV12",
+			filter->width, filter->height));
+		return FALSE;
+	}
+	gst_caps_unref(caps);
+
+	return TRUE;
+}
+
+/* split the access unit, keeping parameter sets and the slices of the
+ * primary picture. Offsets point to the NAL header byte.
+ */
+static gboolean split_nals(Gstcedarh264dec *filter, const uint8_t *data, int size)
+{
+	int pos = 0, start, end, len, type, i;
+
+	filter->num_slices = 0;
+
+	while (pos < size) {
+		if (filter->avc) {
+			if (pos + filter->nal_length_size > size)
+				return FALSE;
+			for (len = 0, i = 0; i < filter->nal_length_size; i++)
+				len = len << 8 | data[pos + i];
+			start = pos + filter->nal_length_size;
+			end = start + len;
+			if (end > size)
+				return FALSE;
+		} else {
+			// next start code
+			while (pos + 3 <= size && !(data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1))
+				pos++;
+			if (pos + 3 > size)
+				break;
+			start = pos + 3;
+
+			for (end = start; end + 3 <= size; end++)
+				if (data[end] == 0 && data[end + 1] == 0 && data[end + 2] <= 1)
+					break;
+			if (end + 3 > size)
+				end = size;
+			len = end - start;
+		}
+		pos = end;
+
+		if (len < 1)
+			continue;
+
+		type = data[start] & 0x1f;
+		switch (type) {
+			case H264_NAL_SPS:
+				store_sps(filter, data + start, len);
+				break;
+			case H264_NAL_PPS:
+				store_pps(filter, data + start, len);
+				break;
+			case H264_NAL_SLICE:
+			case H264_NAL_IDR_SLICE:
+				if (filter->num_slices == CEDAR_DEC_MAX_SLICES) {
+					GST_WARNING_OBJECT(filter, "more than %d slices, dropping the rest",
+						CEDAR_DEC_MAX_SLICES);
+					break;
+				}
+				filter->nal_offset[filter->num_slices] = start;
+				filter->nal_size[filter->num_slices] = len;
+				filter->num_slices++;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return TRUE;
+}
+
+static Gstcedarh264frame *find_ref(Gstcedarh264dec *filter, int ref, int pic_num)
+{
+	int i;
+
+	for (i = 0; i < filter->num_frames; i++)
+		if (filter->frames[i].ref == ref && filter->frames[i].pic_num == pic_num)
+			return &filter->frames[i];
+
+	return NULL;
+}
+
+/* PicNum of the short-term and LongTermPicNum of the long-term
+ * references for a frame with frame_num (8.2.4.1)
+ */
+static void update_pic_nums(Gstcedarh264dec *filter, int frame_num)
+{
+	int max_frame_num = 1 << filter->active_sps.log2_max_frame_num;
+	Gstcedarh264frame *f;
+	int i;
+
+	for (i = 0; i < filter->num_frames; i++) {
+		f = &filter->frames[i];
+		if (f->ref == CEDAR_REF_SHORT)
+			f->pic_num = f->frame_num > frame_num ? f->frame_num - max_frame_num : f->frame_num;
+		else if (f->ref == CEDAR_REF_LONG)
+			f->pic_num = f->long_term_frame_idx;
+	}
+}
+
+/* RefPicList0 of a P slice, initialised (8.2.4.2.1) and modified
+ * (8.2.4.3), NULL for missing references
+ */
+static void build_ref_list0(Gstcedarh264dec *filter, const struct h264_slice *sh,
+	Gstcedarh264frame **list)
+{
+	int max_pic_num = 1 << filter->active_sps.log2_max_frame_num;
+	int num_active = sh->num_ref_idx_active[0];
+	int num_short = 0, n = 0, pred = sh->frame_num;
+	int i, j, c, pic_num;
+	const struct h264_ref_mod *mod;
+	Gstcedarh264frame *f;
+
+	update_pic_nums(filter, sh->frame_num);
+
+	// short-term by descending PicNum, then long-term by ascending LongTermPicNum
+	for (i = 0; i < filter->num_frames; i++) {
+		f = &filter->frames[i];
+		if (f->ref != CEDAR_REF_SHORT)
+			continue;
+		for (j = num_short; j > 0 && list[j - 1]->pic_num < f->pic_num; j--)
+			list[j] = list[j - 1];
+		list[j] = f;
+		num_short++;
+	}
+
+	n = num_short;
+	for (i = 0; i < filter->num_frames; i++) {
+		f = &filter->frames[i];
+		if (f->ref != CEDAR_REF_LONG)
+			continue;
+		for (j = n; j > num_short && list[j - 1]->pic_num > f->pic_num; j--)
+			list[j] = list[j - 1];
+		list[j] = f;
+		n++;
+	}
+
+	for (i = MIN(n, num_active); i <= H264_MAX_REFS; i++)
+		list[i] = NULL;
+
+	for (i = 0; i < sh->num_ref_mods[0]; i++) {
+		mod = &sh->ref_mods[0][i];
+
+		if (mod->idc < 2) {
+			if (mod->idc == 0) {
+				pred -= mod->value + 1;
+				if (pred < 0)
+					pred += max_pic_num;
+			} else {
+				pred += mod->value + 1;
+				if (pred >= max_pic_num)
+					pred -= max_pic_num;
+			}
+			pic_num = pred > sh->frame_num ? pred - max_pic_num : pred;
+			f = find_ref(filter, CEDAR_REF_SHORT, pic_num);
+		} else {
+			f = find_ref(filter, CEDAR_REF_LONG, mod->value);
+		}
+
+		if (!f) {
+			GST_DEBUG_OBJECT(filter, "reordering to a missing reference");
+			continue;
+		}
+
+		for (c = num_active; c > i; c--)
+			list[c] = list[c - 1];
+		list[i] = f;
+		for (c = j = i + 1; c <= num_active; c++)
+			if (list[c] != f)
+				list[j++] = list[c];
+	}
+
+	list[num_active] = NULL;
+}
+
+static void write_ref_list(void *regs, uint32_t sram, Gstcedarh264frame **list,
+	int count, Gstcedarh264frame *frames)
+{
+	uint32_t word = 0;
+	int i;
+
+	writel(sram, regs + VE_H264_RAM_WRITE_PTR);
+
+	for (i = 0; i < ALIGN(count, 4); i++) {
+		if (i < count && list[i])
+			word |= (uint32_t)((list[i] - frames) << 1) << ((i % 4) * 8);
+
+		if (i % 4 == 3) {
+			writel(word, regs + VE_H264_RAM_WRITE_DATA);
+			word = 0;
+		}
+	}
+}
+
+static void write_pred_weights(void *regs, const struct h264_slice *sh)
+{
+	int i, j, k;
+
+	writel((sh->chroma_log2_weight_denom & 0x7) << 4 | (sh->luma_log2_weight_denom & 0x7),
+		regs + VE_H264_PRED_WEIGHT);
+
+	writel(VE_SRAM_H264_PRED_WEIGHT_TABLE, regs + VE_H264_RAM_WRITE_PTR);
+
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < H264_MAX_REFS; j++) {
+			writel((sh->luma_offset[i][j] & 0x1ff) << 16 | (sh->luma_weight[i][j] & 0x1ff),
+				regs + VE_H264_RAM_WRITE_DATA);
+			for (k = 0; k < 2; k++)
+				writel((sh->chroma_offset[i][j][k] & 0x1ff) << 16 |
+					(sh->chroma_weight[i][j][k] & 0x1ff), regs + VE_H264_RAM_WRITE_DATA);
+		}
+}
+
+static void write_scaling_lists(void *regs, const struct h264_pps *pps)
+{
+	const uint8_t *list;
+	int i, j;
+
+	writel(VE_SRAM_H264_SCALING_LISTS, regs + VE_H264_RAM_WRITE_PTR);
+
+	for (i = 0; i < 2; i++) {
+		list = pps->scaling_list_8x8[i];
+		for (j = 0; j < 64; j += 4)
+			writel(list[j] | list[j + 1] << 8 | list[j + 2] << 16 | list[j + 3] << 24,
+				regs + VE_H264_RAM_WRITE_DATA);
+	}
+
+	for (i = 0; i < 6; i++) {
+		list = pps->scaling_list_4x4[i];
+		for (j = 0; j < 16; j += 4)
+			writel(list[j] | list[j + 1] << 8 | list[j + 2] << 16 | list[j + 3] << 24,
+				regs + VE_H264_RAM_WRITE_DATA);
+	}
+}
+
+/* the VE's list of reference and output pictures, by frame index */
+static void write_frame_list(Gstcedarh264dec *filter, Gstcedarh264frame *cur)
+{
+	void *regs = filter->ve_regs;
+	Gstcedarh264frame *f;
+	uint32_t mv_col;
+	int i, j;
+
+	writel(VE_SRAM_H264_FRAMEBUFFER_LIST, regs + VE_H264_RAM_WRITE_PTR);
+
+	for (i = 0; i < CEDAR_DEC_MAX_FRAMES; i++) {
+		f = &filter->frames[i];
+
+		if (i >= filter->num_frames || (f->ref == CEDAR_REF_NONE && f != cur)) {
+			for (j = 0; j < 8; j++)
+				writel(0x0, regs + VE_H264_RAM_WRITE_DATA);
+			continue;
+		}
+
+		mv_col = f->phys + filter->luma_size + filter->chroma_size;
+
+		writel(f->top_poc, regs + VE_H264_RAM_WRITE_DATA);
+		writel(f->bottom_poc, regs + VE_H264_RAM_WRITE_DATA);
+		writel(0x0, regs + VE_H264_RAM_WRITE_DATA);	// frame, not a field pair
+		writel(f->phys, regs + VE_H264_RAM_WRITE_DATA);
+		writel(f->phys + filter->luma_size, regs + VE_H264_RAM_WRITE_DATA);
+		writel(mv_col, regs + VE_H264_RAM_WRITE_DATA);
+		writel(mv_col + filter->mv_col_size, regs + VE_H264_RAM_WRITE_DATA);
+		writel(0x0, regs + VE_H264_RAM_WRITE_DATA);
+	}
+
+	writel(cur - filter->frames, regs + VE_H264_OUTPUT_FRAME_IDX);
+}
+
+static gboolean decode_slice(Gstcedarh264dec *filter, const struct h264_slice *sh,
+	const struct h264_pps *pps, int index, int au_size)
+{
+	void *regs = filter->ve_regs;
+	const struct h264_sps *sps = &filter->active_sps;
+	Gstcedarh264frame *list[H264_MAX_REFS + 1];
+	uint32_t bitstream = filter->bitstream_phys;
+	int mb_w = sps->pic_width_in_mbs;
+	int skip, n, status;
+
+	// the VE removes emulation prevention bytes itself
+	writel(filter->nal_size[index] * 8, regs + VE_H264_VLD_LEN);
+	writel(filter->nal_offset[index] * 8, regs + VE_H264_VLD_OFFSET);
+	writel(bitstream + au_size - 1, regs + VE_H264_VLD_END);
+	writel((bitstream & 0x0ffffff0) | (bitstream >> 28) | (0x7 << 28), regs + VE_H264_VLD_ADDR);
+
+	writel(0x7, regs + VE_H264_TRIGGER);
+
+	// the header was parsed on the CPU, skip to the slice data
+	for (skip = 8 + sh->header_bits; skip > 0; skip -= n) {
+		n = MIN(skip, 32);
+		writel(0x3 | n << 8, regs + VE_H264_TRIGGER);
+		while (readl(regs + VE_H264_STATUS) & (1 << 8));
+	}
+
+	if (sh->slice_type == H264_SLICE_P || sh->slice_type == H264_SLICE_SP) {
+		build_ref_list0(filter, sh, list);
+		write_ref_list(regs, VE_SRAM_H264_REF_LIST0, list, sh->num_ref_idx_active[0],
+			filter->frames);
+
+		if (pps->weighted_pred_flag)
+			write_pred_weights(regs, sh);
+	}
+
+	writel((pps->num_ref_idx_l0_default_active - 1) << 10 |
+		(pps->num_ref_idx_l1_default_active - 1) << 5 |
+		(pps->weighted_bipred_idc & 0x3) << 2 |
+		pps->entropy_coding_mode_flag << 15 |
+		pps->weighted_pred_flag << 4 |
+		pps->constrained_intra_pred_flag << 1 |
+		pps->transform_8x8_mode_flag << 0,
+		regs + VE_H264_PIC_HDR);
+
+	writel(sps->chroma_format_idc << 19 |
+		(sps->pic_width_in_mbs - 1) << 8 |
+		(sps->pic_height_in_map_units - 1) << 0 |
+		sps->frame_mbs_only_flag << 18 |
+		sps->mb_adaptive_frame_field_flag << 17 |
+		sps->direct_8x8_inference_flag << 16,
+		regs + VE_H264_FRAME_SIZE);
+
+	writel((sh->first_mb_in_slice % mb_w) << 24 |
+		(sh->first_mb_in_slice / mb_w) << 16 |
+		(sh->nal_ref_idc != 0) << 12 |
+		sh->slice_type << 8 |
+		(index == 0) << 5 |
+		sh->direct_spatial_mv_pred_flag << 2 |
+		sh->cabac_init_idc,
+		regs + VE_H264_SLICE_HDR);
+
+	writel(1 << 12 |
+		(MAX(sh->num_ref_idx_active[0], 1) - 1) << 24 |
+		(MAX(sh->num_ref_idx_active[1], 1) - 1) << 16 |
+		sh->disable_deblocking_filter_idc << 8 |
+		(sh->slice_alpha_c0_offset_div2 & 0xf) << 4 |
+		(sh->slice_beta_offset_div2 & 0xf) << 0,
+		regs + VE_H264_SLICE_HDR2);
+
+	writel((pps->second_chroma_qp_index_offset & 0x3f) << 16 |
+		(pps->chroma_qp_index_offset & 0x3f) << 8 |
+		((pps->pic_init_qp + sh->slice_qp_delta) & 0x3f) << 0 |
+		(!sps->seq_scaling_matrix_present_flag && !pps->pic_scaling_matrix_present_flag) << 24,
+		regs + VE_H264_QP_PARAM);
+
+	// clear status and enable interrupts
+	writel(readl(regs + VE_H264_STATUS), regs + VE_H264_STATUS);
+	writel(0x7, regs + VE_H264_CTRL);
+
+	writel(0x8, regs + VE_H264_TRIGGER);
+	ve_wait(1);
+
+	status = readl(regs + VE_H264_STATUS);
+	writel(status, regs + VE_H264_STATUS);
+
+	if (status & 0x2) {
+		GST_WARNING_OBJECT(filter, "slice %d: decode error (status 0x%08x)", index, status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* decoded reference picture marking (8.2.5) */
+static void mark_references(Gstcedarh264dec *filter, Gstcedarh264frame *cur,
+	const struct h264_slice *sh)
+{
+	const struct h264_mmco *mmco;
+	Gstcedarh264frame *f, *oldest;
+	int i, j, num_refs, pic_num;
+
+	if (sh->nal_ref_idc == 0) {
+		cur->ref = CEDAR_REF_NONE;
+		return;
+	}
+
+	if (sh->nal_unit_type == H264_NAL_IDR_SLICE) {
+		for (i = 0; i < filter->num_frames; i++)
+			filter->frames[i].ref = CEDAR_REF_NONE;
+
+		if (sh->long_term_reference_flag) {
+			cur->ref = CEDAR_REF_LONG;
+			cur->long_term_frame_idx = 0;
+			filter->max_long_term_frame_idx = 0;
+		} else {
+			cur->ref = CEDAR_REF_SHORT;
+			filter->max_long_term_frame_idx = -1;
+		}
+		return;
+	}
+
+	cur->ref = CEDAR_REF_NONE;
+	update_pic_nums(filter, sh->frame_num);
+
+	if (!sh->adaptive_ref_pic_marking_mode_flag) {
+		// sliding window
+		num_refs = 0;
+		oldest = NULL;
+		for (i = 0; i < filter->num_frames; i++) {
+			f = &filter->frames[i];
+			if (f->ref == CEDAR_REF_NONE)
+				continue;
+			num_refs++;
+			if (f->ref == CEDAR_REF_SHORT && (!oldest || f->pic_num < oldest->pic_num))
+				oldest = f;
+		}
+
+		if (num_refs >= MAX(filter->active_sps.max_num_ref_frames, 1) && oldest)
+			oldest->ref = CEDAR_REF_NONE;
+	}
+
+	for (i = 0; sh->adaptive_ref_pic_marking_mode_flag && i < sh->num_mmcos; i++) {
+		mmco = &sh->mmcos[i];
+		pic_num = sh->frame_num - (mmco->difference_of_pic_nums_minus1 + 1);
+
+		switch (mmco->op) {
+			case 1:
+				if ((f = find_ref(filter, CEDAR_REF_SHORT, pic_num)))
+					f->ref = CEDAR_REF_NONE;
+				break;
+			case 2:
+				if ((f = find_ref(filter, CEDAR_REF_LONG, mmco->long_term_pic_num)))
+					f->ref = CEDAR_REF_NONE;
+				break;
+			case 3:
+				if ((f = find_ref(filter, CEDAR_REF_LONG, mmco->long_term_frame_idx)))
+					f->ref = CEDAR_REF_NONE;
+				if ((f = find_ref(filter, CEDAR_REF_SHORT, pic_num))) {
+					f->ref = CEDAR_REF_LONG;
+					f->long_term_frame_idx = f->pic_num = mmco->long_term_frame_idx;
+				}
+				break;
+			case 4:
+				filter->max_long_term_frame_idx = mmco->max_long_term_frame_idx_plus1 - 1;
+				for (j = 0; j < filter->num_frames; j++) {
+					f = &filter->frames[j];
+					if (f->ref == CEDAR_REF_LONG &&
+							f->long_term_frame_idx > filter->max_long_term_frame_idx)
+						f->ref = CEDAR_REF_NONE;
+				}
+				break;
+			case 5:
+				for (j = 0; j < filter->num_frames; j++)
+					filter->frames[j].ref = CEDAR_REF_NONE;
+				filter->max_long_term_frame_idx = -1;
+				cur->frame_num = 0;
+				break;
+			case 6:
+				if ((f = find_ref(filter, CEDAR_REF_LONG, mmco->long_term_frame_idx)))
+					f->ref = CEDAR_REF_NONE;
+				cur->ref = CEDAR_REF_LONG;
+				cur->long_term_frame_idx = cur->pic_num = mmco->long_term_frame_idx;
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (cur->ref != CEDAR_REF_LONG)
+		cur->ref = CEDAR_REF_SHORT;
+}
+
+/* detile the cropped picture into an NV12 buffer in VE memory, so it
+ * can go straight into cedar_h264enc
+ */
+static GstFlowReturn output_frame(Gstcedarh264dec *filter, Gstcedarh264frame *cur, GstBuffer *in)
+{
+	const struct h264_sps *sps = &filter->active_sps;
+	GstCedarBuffer *cedar_buf;
+	GstBuffer *out;
+	uint8_t *data;
+	int stride, chroma_offset, size;
+
+	stride = gst_video_format_get_row_stride(GST_VIDEO_FORMAT_NV12, 0, filter->width);
+	chroma_offset = gst_video_format_get_component_offset(GST_VIDEO_FORMAT_NV12, 1,
+		filter->width, filter->height);
+	size = gst_video_format_get_size(GST_VIDEO_FORMAT_NV12, filter->width, filter->height);
+
+	// the encoder reads whole macroblock rows of chroma
+	cedar_buf = gst_cedar_buffer_new(MAX(size, chroma_offset + stride * ALIGN(filter->height, 16) / 2));
+	if (cedar_buf) {
+		out = GST_BUFFER(cedar_buf);
+	} else {
+		GST_DEBUG_OBJECT(filter, "out of VE memory, output in system memory");
+		out = gst_buffer_new_and_alloc(size);
+	}
+	data = GST_BUFFER_DATA(out);
+
+	ve_invalidate_cache(cur->buf, filter->luma_size + filter->chroma_size);
+
+	detile_mb32(data, stride, cur->buf, filter->tile_w,
+		sps->crop_left, sps->crop_top, filter->width, filter->height);
+	detile_mb32(data + chroma_offset, stride, (uint8_t *)cur->buf + filter->luma_size, filter->tile_w,
+		sps->crop_left & ~1, sps->crop_top / 2, ALIGN(filter->width, 2), (filter->height + 1) / 2);
+
+	if (cedar_buf)
+		ve_flush_cache(cedar_buf->mem, cedar_buf->mem_size);
+
+	GST_BUFFER_SIZE(out) = size;
+	gst_buffer_set_caps(out, GST_PAD_CAPS(filter->srcpad));
+	gst_buffer_copy_metadata(out, in, GST_BUFFER_COPY_TIMESTAMPS);
+
+	if (filter->discont) {
+		GST_BUFFER_FLAG_SET(out, GST_BUFFER_FLAG_DISCONT);
+		filter->discont = FALSE;
+	}
+
+	return gst_pad_push(filter->srcpad, out);
+}
+
+static GstFlowReturn decode_picture(Gstcedarh264dec *filter, GstBuffer *buf)
+{
+	const uint8_t *data = GST_BUFFER_DATA(buf);
+	struct h264_slice first, sh;
+	const struct h264_pps *pps;
+	Gstcedarh264frame *cur = NULL;
+	GstClockTime start;
+	int i, has_mmco5 = 0, failed = 0;
+
+	if (!h264_parse_slice_header(&first, filter->sps, filter->pps,
+			data + filter->nal_offset[0], filter->nal_size[0])) {
+		GST_WARNING_OBJECT(filter, "broken slice header or missing parameter sets, skipping");
+		return GST_FLOW_OK;
+	}
+
+	if (first.slice_type == H264_SLICE_B) {
+		GST_ELEMENT_ERROR(filter, STREAM, DECODE, (NULL), ("B slices are not supported"));
+		return GST_FLOW_ERROR;
+	}
+
+	if (filter->need_idr) {
+		if (first.nal_unit_type != H264_NAL_IDR_SLICE && first.slice_type != H264_SLICE_I) {
+			GST_DEBUG_OBJECT(filter, "waiting for a key frame");
+			return GST_FLOW_OK;
+		}
+		filter->need_idr = FALSE;
+	}
+
+	pps = filter->pps[first.pps_id];
+	if (!activate_sps(filter, filter->sps[pps->sps_id]))
+		return GST_FLOW_ERROR;
+
+	if (first.nal_unit_type == H264_NAL_IDR_SLICE)
+		for (i = 0; i < filter->num_frames; i++)
+			filter->frames[i].ref = CEDAR_REF_NONE;
+
+	for (i = 0; i < filter->num_frames && !cur; i++)
+		if (filter->frames[i].ref == CEDAR_REF_NONE)
+			cur = &filter->frames[i];
+
+	if (!cur) {
+		GST_WARNING_OBJECT(filter, "no free frame, dropping the references");
+		reset_refs(filter);
+		return GST_FLOW_OK;
+	}
+
+	for (i = 0; i < first.num_mmcos; i++)
+		if (first.adaptive_ref_pic_marking_mode_flag && first.mmcos[i].op == 5)
+			has_mmco5 = 1;
+
+	cur->frame_num = first.frame_num;
+	h264_compute_poc(&filter->poc, &filter->active_sps, &first, has_mmco5,
+		&cur->top_poc, &cur->bottom_poc);
+
+	start = gst_util_get_timestamp();
+
+	ve_get(VE_ENGINE_H264, filter);
+
+	writel(0x0, filter->ve_regs + VE_H264_SDROT_CTRL);
+	writel(ve_virt2phys(filter->extra_buf), filter->ve_regs + VE_H264_EXTRA_BUFFER1);
+	writel(ve_virt2phys(filter->extra_buf) + 0x48000, filter->ve_regs + VE_H264_EXTRA_BUFFER2);
+
+	if (filter->active_sps.seq_scaling_matrix_present_flag || pps->pic_scaling_matrix_present_flag)
+		write_scaling_lists(filter->ve_regs, pps);
+
+	write_frame_list(filter, cur);
+
+	for (i = 0; i < filter->num_slices; i++) {
+		if (i == 0) {
+			sh = first;
+		} else if (!h264_parse_slice_header(&sh, filter->sps, filter->pps,
+				data + filter->nal_offset[i], filter->nal_size[i])) {
+			GST_WARNING_OBJECT(filter, "broken slice header, skipping slice %d", i);
+			continue;
+		}
+
+		if (sh.pps_id != first.pps_id || sh.slice_type == H264_SLICE_B) {
+			GST_WARNING_OBJECT(filter, "skipping slice %d, not part of the picture", i);
+			continue;
+		}
+
+		if (!decode_slice(filter, &sh, pps, i, GST_BUFFER_SIZE(buf)))
+			failed++;
+	}
+
+	ve_put();
+
+	GST_LOG_OBJECT(filter, "frame_num %d poc %d: %d slices in %" GST_TIME_FORMAT,
+		first.frame_num, cur->top_poc, filter->num_slices,
+		GST_TIME_ARGS(gst_util_get_timestamp() - start));
+
+	// a broken picture must not be referenced or shown, start over at the
+	// next key frame and flag the gap
+	if (failed) {
+		GST_WARNING_OBJECT(filter, "frame_num %d: %d slices failed, dropping it",
+			first.frame_num, failed);
+		reset_refs(filter);
+		return GST_FLOW_OK;
+	}
+
+	mark_references(filter, cur, &first);
+
+	// no B slices, output order is decode order
+	return output_frame(filter, cur, buf);
+}
+
+static GstFlowReturn
+gst_cedarh264dec_chain (GstPad * pad, GstBuffer * buf)
+{
+	Gstcedarh264dec *filter;
+	GstFlowReturn ret = GST_FLOW_OK;
+	int size = GST_BUFFER_SIZE(buf);
+
+	filter = GST_CEDAR_H264DEC (GST_OBJECT_PARENT (pad));
+
+	if (size > filter->bitstream_buf_size) {
+		ve_free(filter->bitstream_buf);
+		filter->bitstream_buf_size = ALIGN(size, BITSTREAM_BUF_SIZE);
+		filter->bitstream_buf = ve_malloc(filter->bitstream_buf_size);
+		if (!filter->bitstream_buf) {
+			filter->bitstream_buf_size = 0;
+			GST_ELEMENT_ERROR(filter, RESOURCE, NO_SPACE_LEFT, (NULL),
+				("cannot allocate a %d byte bitstream buffer", size));
+			gst_buffer_unref(buf);
+			return GST_FLOW_ERROR;
+		}
+		filter->bitstream_phys = ve_virt2phys(filter->bitstream_buf);
+	}
+
+	if (!split_nals(filter, GST_BUFFER_DATA(buf), size)) {
+		GST_WARNING_OBJECT(filter, "truncated access unit, skipping");
+		gst_buffer_unref(buf);
+		return GST_FLOW_OK;
+	}
+
+	if (filter->num_slices > 0) {
+		memcpy(filter->bitstream_buf, GST_BUFFER_DATA(buf), size);
+		ve_flush_cache(filter->bitstream_buf, size);
+
+		ret = decode_picture(filter, buf);
+	}
+
+	gst_buffer_unref(buf);
+
+	return ret;
+}
+
+static GstStateChangeReturn
+	gst_cedarh264dec_change_state (GstElement *element, GstStateChange transition)
+{
+	GstStateChangeReturn ret;
+	Gstcedarh264dec *filter = GST_CEDAR_H264DEC(element);
+
+	switch (transition) {
+		case GST_STATE_CHANGE_NULL_TO_READY:
+			if (!ve_open()) {
+				GST_ERROR("Cannot open VE");
+				return GST_STATE_CHANGE_FAILURE;
+			}
+
+			filter->ve_regs = ve_get_regs();
+			filter->extra_buf = ve_malloc(EXTRA_BUF_SIZE);
+
+			if (!filter->ve_regs || !filter->extra_buf) {
+				GST_ERROR("Cannot get VE regs or memory");
+				ve_free(filter->extra_buf);
+				filter->extra_buf = NULL;
+				ve_close();
+				return GST_STATE_CHANGE_FAILURE;
+			}
+
+			break;
+		case GST_STATE_CHANGE_READY_TO_PAUSED:
+			reset_refs(filter);
+			break;
+		default:
+			break;
+	}
+
+	ret = GST_ELEMENT_CLASS(parent_class)->change_state(element, transition);
+	if (ret == GST_STATE_CHANGE_FAILURE)
+		return ret;
+
+	switch (transition) {
+		case GST_STATE_CHANGE_PAUSED_TO_READY:
+			free_frames(filter);
+			break;
+		case GST_STATE_CHANGE_READY_TO_NULL:
+			free_bufs(filter);
+			free_param_sets(filter);
+			filter->ve_regs = NULL;
+			ve_close();
+			break;
+		default:
+			break;
+	}
+
+	return ret;
+}
@@ -0,0 +1,129 @@
+/*
+ * Cedar H264 Decoder Plugin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __GST_CEDAR_H264DEC_H__
+#define __GST_CEDAR_H264DEC_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "h264.h"
+#include "ve.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_CEDAR_H264DEC \
+  (gst_cedarh264dec_get_type())
+#define GST_CEDAR_H264DEC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_CEDAR_H264DEC,Gstcedarh264dec))
+#define GST_CEDAR_H264DEC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_CEDAR_H264DEC,Gstcedarh264decClass))
+#define GST_IS_CEDAR_H264DEC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_CEDAR_H264DEC))
+#define GST_IS_CEDAR_H264DEC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_CEDAR_H264DEC))
+
+/* entries in the VE's frame buffer list */
+#define CEDAR_DEC_MAX_FRAMES	18
+
+/* slices per access unit */
+#define CEDAR_DEC_MAX_SLICES	64
+
+typedef struct _Gstcedarh264dec      Gstcedarh264dec;
+typedef struct _Gstcedarh264decClass Gstcedarh264decClass;
+typedef struct _Gstcedarh264frame    Gstcedarh264frame;
+
+enum
+{
+	CEDAR_REF_NONE,
+	CEDAR_REF_SHORT,
+	CEDAR_REF_LONG
+};
+
+/* a decoded picture, its position in the VE's frame list is its index */
+struct _Gstcedarh264frame
+{
+	void *buf;		// tiled luma, chroma and co-located motion vectors
+	uint32_t phys;
+	int ref;
+	int frame_num;
+	int pic_num;		// FrameNumWrap, or LongTermFrameIdx for long-term ones
+	int long_term_frame_idx;
+	int top_poc;
+	int bottom_poc;
+};
+
+struct _Gstcedarh264dec
+{
+	GstElement element;
+
+	GstPad *sinkpad;
+	GstPad *srcpad;
+
+	gboolean avc;
+	int nal_length_size;
+
+	struct h264_sps *sps[H264_MAX_SPS];
+	struct h264_pps *pps[H264_MAX_PPS];
+	struct h264_sps active_sps;	// copy, parameter sets may be replaced while referenced
+	gboolean sps_active;
+
+	int width;		// cropped output size
+	int height;
+	int fps_num;
+	int fps_den;
+	int par_n;
+	int par_d;
+
+	void *ve_regs;
+	void *bitstream_buf;
+	int bitstream_buf_size;
+	uint32_t bitstream_phys;
+	void *extra_buf;	// picture and neighbour info used by the VE
+
+	Gstcedarh264frame frames[CEDAR_DEC_MAX_FRAMES];
+	int num_frames;
+	int tile_w;
+	int luma_size;
+	int chroma_size;
+	int mv_col_size;	// per field
+
+	struct h264_poc_state poc;
+	int max_long_term_frame_idx;	// -1 for none
+	gboolean need_idr;
+	gboolean discont;	// pictures were dropped since the last output
+
+	int nal_offset[CEDAR_DEC_MAX_SLICES];
+	int nal_size[CEDAR_DEC_MAX_SLICES];
+	int num_slices;
+};
+
+struct _Gstcedarh264decClass
+{
+  GstElementClass parent_class;
+};
+
+GType gst_cedarh264dec_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_CEDAR_H264DEC_H__ */
@@ -43,24 +43,48 @@
  * |[
  * gst-launch -ve videotestsrc ! cedar_h264enc ! h264parse ! matroskamux ! filesink location="cedar.mkv"
  * ]|
+ * |[
+ * gst-launch -ve videotestsrc ! cedar_h264enc ! video/x-h264,stream-format=avc ! matroskamux ! filesink location="cedar.mkv"
+ * ]|
  * </refsect2>
+ *
+ * With the activity property set, every encoded frame is preceded by a
+ * serialized custom downstream event with a "cedar-activity" structure:
+ * <itemizedlist>
+ * <listitem>"timestamp" (guint64): timestamp of the frame</listitem>
+ * <listitem>"mb-width", "mb-height" (gint): size of the grid</listitem>
+ * <listitem>"grid" (GstBuffer): one byte per macroblock in raster order,
+ *   the mean absolute luma difference to the previous frame</listitem>
+ * <listitem>"mean" (gint): the mean of the grid</listitem>
+ * <listitem>"thumbnail" (GstBuffer), "thumbnail-width",
+ *   "thumbnail-height" (gint): with activity-thumbnail, the half
+ *   resolution luma of the macroblock aligned picture, GRAY8</listitem>
+ * </itemizedlist>
  */
 
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <gst/gst.h>
 
 #include "gstcedarh264enc.h"
+#include "gstcedarbuffer.h"
+#include "activity.h"
+#include "denoise.h"
+#include "scale.h"
+#include "tiled.h"
+#include "twopass.h"
 #include "ve.h"
 
-GST_DEBUG_CATEGORY_STATIC (gst_cedarh264enc_debug);
+GST_DEBUG_CATEGORY (gst_cedarh264enc_debug);
 #define GST_CAT_DEFAULT gst_cedarh264enc_debug
 
 #define CEDAR_OUTPUT_BUF_SIZE	(1* 1024 * 1024)
+#define CEDAR_START_CODE_SIZE	4
 
 /* Filter signals and args */
 enum
@@ -72,9 +96,34 @@ enum
 enum
 {
   PROP_0,
-  PROP_SILENT
+  PROP_SILENT,
+  PROP_KEYFRAME_INTERVAL,
+  PROP_VE_MEMORY,
+  PROP_VE_FOOTPRINT,
+  PROP_ACTIVITY,
+  PROP_ACTIVITY_THUMBNAIL,
+  PROP_SCENE_THRESHOLD,
+  PROP_MIN_KEYFRAME_INTERVAL,
+  PROP_SCENE_DETECT_TIME,
+  PROP_TEMPORAL_LAYERS,
+  PROP_LTR_INTERVAL,
+  PROP_QP,
+  PROP_PASS,
+  PROP_STATS_FILE,
+  PROP_TARGET_SIZE,
+  PROP_DENOISE,
+  PROP_UPLOAD_TIME,
+  PROP_WARM_UP,
+  PROP_PERSISTENT_VE,
+  PROP_FIRST_FRAME_TIME
 };
 
+#define DEFAULT_KEYFRAME_INTERVAL	1
+#define DEFAULT_SCENE_THRESHOLD		0
+#define DEFAULT_MIN_KEYFRAME_INTERVAL	10
+#define DEFAULT_QP			30
+#define DEFAULT_STATS_FILE		"cedar_h264enc.stats"
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
@@ -88,18 +137,35 @@ static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
 			"width = (int) [16,1920], "
 			"height = (int) [16,1080]"
 			/*"framerate=(fraction)[1/1,25/1]"*/
+		"; "
+		"video/x-raw-yuv, "
+			"format = (fourcc) ST12, "
+			"width = (int) [16,1920], "
+			"height = (int) [16,1080]"
     )
     );
 
+#define CEDAR_SRC_CAPS \
+		"video/x-h264, " \
+			"stream-format = (string) byte-stream, " \
+			"alignment = (string) { nal, au }, " \
+			"profile = (string) { baseline, main, high }; " \
+		"video/x-h264, " \
+			"stream-format = (string) avc, " \
+			"alignment = (string) au, " \
+			"profile = (string) { baseline, main, high }"
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS (
-		"video/x-h264, "
-			"stream-format = (string) byte-stream, "
-			"alignment = (string) nal, "
-			"profile = (string) { main }"
-	)
+    GST_STATIC_CAPS (CEDAR_SRC_CAPS)
+    );
+
+/* simulcast layers, downscaled from the input */
+static GstStaticPadTemplate src_request_factory = GST_STATIC_PAD_TEMPLATE ("src_%d",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (CEDAR_SRC_CAPS)
     );
 
 GST_BOILERPLATE (Gstcedarh264enc, gst_cedarh264enc, GstElement,
@@ -109,12 +175,86 @@ static void gst_cedarh264enc_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_cedarh264enc_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static void gst_cedarh264enc_finalize (GObject * object);
 
 static gboolean gst_cedarh264enc_set_caps (GstPad * pad, GstCaps * caps);
 static GstFlowReturn gst_cedarh264enc_chain (GstPad * pad, GstBuffer * buf);
+static gboolean gst_cedarh264enc_sink_event (GstPad * pad, GstEvent * event);
+static gboolean gst_cedarh264enc_src_event (GstPad * pad, GstEvent * event);
+static gboolean gst_cedarh264enc_src_query (GstPad * pad, GstQuery * query);
 
 static GstStateChangeReturn
 	gst_cedarh264enc_change_state (GstElement *element, GstStateChange transition);
+static GstPad *gst_cedarh264enc_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name);
+static void gst_cedarh264enc_release_pad (GstElement * element, GstPad * pad);
+
+/* src pads hold the settings of their layer */
+enum
+{
+  PROP_PAD_0,
+  PROP_PAD_QP_OFFSET
+};
+
+G_DEFINE_TYPE (Gstcedarh264encPad, gst_cedarh264enc_pad, GST_TYPE_PAD);
+
+static void
+gst_cedarh264enc_pad_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  Gstcedarh264encPad *pad = GST_CEDAR_H264ENC_PAD (object);
+
+  switch (prop_id) {
+    case PROP_PAD_QP_OFFSET:
+      pad->qp_offset = g_value_get_int (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_cedarh264enc_pad_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  Gstcedarh264encPad *pad = GST_CEDAR_H264ENC_PAD (object);
+
+  switch (prop_id) {
+    case PROP_PAD_QP_OFFSET:
+      g_value_set_int (value, pad->qp_offset);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_cedarh264enc_pad_class_init (Gstcedarh264encPadClass * klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *) klass;
+
+  gobject_class->set_property = gst_cedarh264enc_pad_set_property;
+  gobject_class->get_property = gst_cedarh264enc_pad_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_PAD_QP_OFFSET,
+      g_param_spec_int ("qp-offset", "QP offset",
+          "Added to the QP of every frame of this layer, also to the QP "
+          "a second pass plans for the base layer",
+          -51, 51, 0, G_PARAM_READWRITE));
+}
+
+static void
+gst_cedarh264enc_pad_init (Gstcedarh264encPad * pad)
+{
+}
+
+static GstPad *new_src_pad(GstPadTemplate *templ, const gchar *name)
+{
+	return g_object_new(GST_TYPE_CEDAR_H264ENC_PAD, "name", name,
+		"direction", GST_PAD_SRC, "template", templ, NULL);
+}
 
 /* byte stream utils from:
  * https://github.com/jemk/cedrus/tree/master/h264enc
@@ -141,15 +281,15 @@ static void put_se(void* regs, int x)
 
 static void put_start_code(void* regs)
 {
-	uint32_t tmp = readl(regs + VE_AVC_PARAM);
+	uint32_t tmp = ve_read_shadow(VE_AVC_PARAM);
 
 	// disable emulation_prevention_three_byte
-	writel(tmp | (0x1 << 31), regs + VE_AVC_PARAM);
+	ve_write_reg(tmp | (0x1 << 31), VE_AVC_PARAM);
 
 	put_bits(regs, 0, 31);
 	put_bits(regs, 1, 1);
 
-	writel(tmp, regs + VE_AVC_PARAM);
+	ve_write_reg(tmp, VE_AVC_PARAM);
 }
 
 static void put_rbsp_trailing_bits(void* regs)
@@ -160,24 +300,143 @@ static void put_rbsp_trailing_bits(void* regs)
 	put_bits(regs, 1 << num_zero_bits, num_zero_bits + 1);
 }
 
-static void put_seq_parameter_set(void* regs, int width, int height)
+/* H.264 default scaling lists (Table 7-3 and 7-4), stored in raster order
+ * as the VE expects them. The bitstream carries them in zigzag order.
+ */
+static const uint8_t scaling_list_4x4[2][16] = {
+	{  6, 13, 20, 28, 13, 20, 28, 32, 20, 28, 32, 37, 28, 32, 37, 42 },
+	{ 10, 14, 20, 24, 14, 20, 24, 27, 20, 24, 27, 30, 24, 27, 30, 34 }
+};
+
+static const uint8_t scaling_list_8x8[2][64] = {
+	{  6, 10, 13, 16, 18, 23, 25, 27, 10, 11, 16, 18, 23, 25, 27, 29,
+	  13, 16, 18, 23, 25, 27, 29, 31, 16, 18, 23, 25, 27, 29, 31, 33,
+	  18, 23, 25, 27, 29, 31, 33, 36, 23, 25, 27, 29, 31, 33, 36, 38,
+	  25, 27, 29, 31, 33, 36, 38, 40, 27, 29, 31, 33, 36, 38, 40, 42 },
+	{  9, 13, 15, 17, 19, 21, 22, 24, 13, 13, 17, 19, 21, 22, 24, 25,
+	  15, 17, 19, 21, 22, 24, 25, 27, 17, 19, 21, 22, 24, 25, 27, 28,
+	  19, 21, 22, 24, 25, 27, 28, 30, 21, 22, 24, 25, 27, 28, 30, 32,
+	  22, 24, 25, 27, 28, 30, 32, 33, 24, 25, 27, 28, 30, 32, 33, 35 }
+};
+
+static const uint8_t zigzag_4x4[16] = {
+	0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15
+};
+
+static const uint8_t zigzag_8x8[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static void put_scaling_list(void* regs, const uint8_t *list, const uint8_t *scan, int size)
+{
+	int i, delta, last = 8;
+
+	put_bits(regs, 1, 1);			// scaling_list_present_flag
+	for (i = 0; i < size; i++) {
+		delta = list[scan[i]] - last;
+		if (delta > 127)
+			delta -= 256;
+		else if (delta < -128)
+			delta += 256;
+		put_se(regs, delta);		// delta_scale
+		last = list[scan[i]];
+	}
+}
+
+static void put_vui_parameters(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	void *regs = cedarelement->ve_regs;
+	gboolean sar = stream->par_n > 0 && stream->par_d > 0
+		&& stream->par_n != stream->par_d;
+	gboolean timing = cedarelement->fps_num > 0 && cedarelement->fps_den > 0;
+
+	put_bits(regs, sar, 1);			// aspect_ratio_info_present_flag
+	if (sar) {
+		put_bits(regs, 255, 8);		// aspect_ratio_idc = Extended_SAR
+		put_bits(regs, stream->par_n, 16);	// sar_width
+		put_bits(regs, stream->par_d, 16);	// sar_height
+	}
+
+	put_bits(regs, 0, 1);			// overscan_info_present_flag
+
+	put_bits(regs, cedarelement->colour_primaries != 0, 1);	// video_signal_type_present_flag
+	if (cedarelement->colour_primaries != 0) {
+		put_bits(regs, 5, 3);		// video_format = unspecified
+		put_bits(regs, 0, 1);		// video_full_range_flag
+		put_bits(regs, 1, 1);		// colour_description_present_flag
+		put_bits(regs, cedarelement->colour_primaries, 8);	// colour_primaries
+		put_bits(regs, cedarelement->colour_primaries, 8);	// transfer_characteristics
+		put_bits(regs, cedarelement->colour_primaries, 8);	// matrix_coefficients
+	}
+
+	put_bits(regs, 0, 1);			// chroma_loc_info_present_flag
+
+	put_bits(regs, timing, 1);		// timing_info_present_flag
+	if (timing) {
+		// put_bits can't write 32 bits at once
+		put_bits(regs, cedarelement->fps_den >> 16, 16);	// num_units_in_tick
+		put_bits(regs, cedarelement->fps_den & 0xffff, 16);
+		put_bits(regs, (2 * cedarelement->fps_num) >> 16, 16);	// time_scale
+		put_bits(regs, (2 * cedarelement->fps_num) & 0xffff, 16);
+		put_bits(regs, 1, 1);		// fixed_frame_rate_flag
+	}
+
+	put_bits(regs, 0, 1);			// nal_hrd_parameters_present_flag
+	put_bits(regs, 0, 1);			// vcl_hrd_parameters_present_flag
+	put_bits(regs, 0, 1);			// pic_struct_present_flag
+
+	put_bits(regs, 1, 1);			// bitstream_restriction_flag
+	put_bits(regs, 1, 1);			// motion_vectors_over_pic_boundaries_flag
+	put_ue(regs, 0);			// max_bytes_per_pic_denom
+	put_ue(regs, 0);			// max_bits_per_mb_denom
+	put_ue(regs, 16);			// log2_max_mv_length_horizontal
+	put_ue(regs, 16);			// log2_max_mv_length_vertical
+	put_ue(regs, 0);			// max_num_reorder_frames
+	// can't be less than max_num_ref_frames, decoders still output
+	// every frame immediately since nothing is reordered
+	put_ue(regs, cedarelement->num_ref_frames);	// max_dec_frame_buffering
+}
+
+static void put_seq_parameter_set(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
+	void *regs = cedarelement->ve_regs;
+	int i;
+
 	put_bits(regs, 3 << 5 | 7 << 0, 8);	// NAL Header
-	put_bits(regs, 77, 8);			// profile_idc
-	put_bits(regs, 0x0, 8);			// constraints
+	put_bits(regs, stream->profile_idc, 8);	// profile_idc
+	if (stream->profile_idc == 66)
+		put_bits(regs, 0x3 << 6, 8);	// constraint_set0/1: constrained baseline
+	else
+		put_bits(regs, 0x0, 8);		// constraints
 	put_bits(regs, 4 * 10 + 1, 8);		// level_idc
 	put_ue(regs, 0);			// seq_parameter_set_id
 
+	if (stream->profile_idc >= 100) {
+		put_ue(regs, 1);		// chroma_format_idc
+		put_ue(regs, 0);		// bit_depth_luma_minus8
+		put_ue(regs, 0);		// bit_depth_chroma_minus8
+		put_bits(regs, 0, 1);		// qpprime_y_zero_transform_bypass_flag
+		put_bits(regs, 1, 1);		// seq_scaling_matrix_present_flag
+		for (i = 0; i < 6; i++)
+			put_scaling_list(regs, scaling_list_4x4[i / 3], zigzag_4x4, 16);
+		for (i = 0; i < 2; i++)
+			put_scaling_list(regs, scaling_list_8x8[i], zigzag_8x8, 64);
+	}
+
 	put_ue(regs, 0);			// log2_max_frame_num_minus4
 	put_ue(regs, 0);			// pic_order_cnt_type
 	// if (pic_order_cnt_type == 0)
 		put_ue(regs, 4);		// log2_max_pic_order_cnt_lsb_minus4
 
-	put_ue(regs, 1);			// max_num_ref_frames
-	put_bits(regs, 0, 1);			// gaps_in_frame_num_value_allowed_flag
+	put_ue(regs, cedarelement->num_ref_frames);	// max_num_ref_frames
+	// a relay dropping the middle temporal layer leaves frame_num gaps
+	put_bits(regs, cedarelement->temporal_layers == 3, 1);	// gaps_in_frame_num_value_allowed_flag
 
-	put_ue(regs, width - 1);		// pic_width_in_mbs_minus1
-	put_ue(regs, height - 1);		// pic_height_in_map_units_minus1
+	put_ue(regs, stream->mb_w - 1);		// pic_width_in_mbs_minus1
+	put_ue(regs, stream->mb_h - 1);		// pic_height_in_map_units_minus1
 
 	put_bits(regs, 1, 1);			// frame_mbs_only_flag
 	// if (!frame_mbs_only_flag)
@@ -186,16 +445,19 @@ static void put_seq_parameter_set(void* regs, int width, int height)
 	put_bits(regs, 0, 1);			// frame_cropping_flag
 	// if (frame_cropping_flag)
 
-	put_bits(regs, 0, 1);			// vui_parameters_present_flag
+	put_bits(regs, 1, 1);			// vui_parameters_present_flag
 	// if (vui_parameters_present_flag)
+		put_vui_parameters(cedarelement, stream);
 }
 
-static void put_pic_parameter_set(void *regs)
+static void put_pic_parameter_set(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
+	void *regs = cedarelement->ve_regs;
+
 	put_bits(regs, 3 << 5 | 8 << 0, 8);	// NAL Header
 	put_ue(regs, 0);			// pic_parameter_set_id
 	put_ue(regs, 0);			// seq_parameter_set_id
-	put_bits(regs, 1, 1);			// entropy_coding_mode_flag
+	put_bits(regs, stream->entropy_coding_mode_flag, 1);	// entropy_coding_mode_flag
 	put_bits(regs, 0, 1);			// bottom_field_pic_order_in_frame_present_flag
 	put_ue(regs, 0);			// num_slice_groups_minus1
 	// if (num_slice_groups_minus1 > 0)
@@ -210,28 +472,101 @@ static void put_pic_parameter_set(void *regs)
 	put_bits(regs, 1, 1);			// deblocking_filter_control_present_flag
 	put_bits(regs, 0, 1);			// constrained_intra_pred_flag
 	put_bits(regs, 0, 1);			// redundant_pic_cnt_present_flag
+
+	if (stream->profile_idc >= 100) {
+		put_bits(regs, stream->transform_8x8_mode_flag, 1);	// transform_8x8_mode_flag
+		put_bits(regs, 0, 1);		// pic_scaling_matrix_present_flag
+		put_se(regs, 4);		// second_chroma_qp_index_offset
+	}
+}
+
+/* upload the scaling lists signalled in the SPS to the VE */
+static void load_scaling_lists(void* regs)
+{
+	const uint8_t *list;
+	int i, j;
+
+	writel(VE_SRAM_H264_SCALING_LISTS, regs + VE_H264_RAM_WRITE_PTR);
+
+	for (i = 0; i < 2; i++) {
+		list = scaling_list_8x8[i];
+		for (j = 0; j < 64; j += 4)
+			writel(list[j] | list[j + 1] << 8 | list[j + 2] << 16 | list[j + 3] << 24,
+				regs + VE_H264_RAM_WRITE_DATA);
+	}
+
+	for (i = 0; i < 6; i++) {
+		list = scaling_list_4x4[i / 3];
+		for (j = 0; j < 16; j += 4)
+			writel(list[j] | list[j + 1] << 8 | list[j + 2] << 16 | list[j + 3] << 24,
+				regs + VE_H264_RAM_WRITE_DATA);
+	}
 }
 
-static void put_slice_header(void* regs)
+static void put_slice_header(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
-	put_bits(regs, 3 << 5 | 5 << 0, 8);	// NAL Header
+	void *regs = cedarelement->ve_regs;
+	gboolean idr = stream->gop_pos == 0;
+	int diff;
+
+	if (idr)
+		put_bits(regs, 3 << 5 | 5 << 0, 8);	// NAL Header
+	else if (stream->nal_ref)
+		put_bits(regs, 2 << 5 | 1 << 0, 8);	// NAL Header
+	else
+		put_bits(regs, 0 << 5 | 1 << 0, 8);	// NAL Header
 
 	put_ue(regs, 0);			// first_mb_in_slice
-	put_ue(regs, 2);			// slice_type
+	put_ue(regs, idr ? 2 : 0);		// slice_type
 	put_ue(regs, 0);			// pic_parameter_set_id
-	put_bits(regs, 0, 4);			// frame_num
+	put_bits(regs, stream->frame_num & 0xf, 4);	// frame_num
 
-	// if (IdrPicFlag)
-		put_ue(regs, 0);		// idr_pic_id
+	if (idr)
+		put_ue(regs, stream->idr_pic_id & 0x1);	// idr_pic_id
 
 	// if (pic_order_cnt_type == 0)
-		put_bits(regs, 0, 8);		// pic_order_cnt_lsb
+		put_bits(regs, (stream->gop_pos * 2) & 0xff, 8);	// pic_order_cnt_lsb
+
+	if (!idr) {
+		put_bits(regs, 0, 1);		// num_ref_idx_active_override_flag
+
+		// the reference is first in the list when it is the last
+		// reference picture, otherwise move it there
+		diff = (stream->frame_num - stream->rec_frame_num[stream->ref_rec]) & 0xf;
+		if (stream->ref_rec == stream->ltr_slot) {
+			put_bits(regs, 1, 1);	// ref_pic_list_modification_flag_l0
+			put_ue(regs, 2);	// modification_of_pic_nums_idc
+			put_ue(regs, 0);	// long_term_pic_num
+			put_ue(regs, 3);	// modification_of_pic_nums_idc
+		} else if (diff == 1) {
+			put_bits(regs, 0, 1);	// ref_pic_list_modification_flag_l0
+		} else {
+			put_bits(regs, 1, 1);	// ref_pic_list_modification_flag_l0
+			put_ue(regs, 0);	// modification_of_pic_nums_idc
+			put_ue(regs, diff - 1);	// abs_diff_pic_num_minus1
+			put_ue(regs, 3);	// modification_of_pic_nums_idc
+		}
+	}
 
 	// dec_ref_pic_marking
+	if (idr) {
 		put_bits(regs, 0, 1);		// no_output_of_prior_pics_flag
-		put_bits(regs, 0, 1);		// long_term_reference_flag
+		put_bits(regs, stream->ltr_refresh, 1);	// long_term_reference_flag
+	} else if (stream->ltr_refresh) {
+		// replaces the old long-term reference, MaxLongTermFrameIdx
+		// is 0 since the IDR frame
+		put_bits(regs, 1, 1);		// adaptive_ref_pic_marking_mode_flag
+		put_ue(regs, 6);		// memory_management_control_operation
+		put_ue(regs, 0);		// long_term_frame_idx
+		put_ue(regs, 0);		// memory_management_control_operation
+	} else if (stream->nal_ref) {
+		put_bits(regs, 0, 1);		// adaptive_ref_pic_marking_mode_flag
+	}
 
-	put_se(regs, 4);			// slice_qp_delta
+	if (stream->entropy_coding_mode_flag && !idr)
+		put_ue(regs, 0);		// cabac_init_idc
+
+	put_se(regs, stream->frame_qp - 26);	// slice_qp_delta
 
 	// if (deblocking_filter_control_present_flag)
 		put_ue(regs, 0);		// disable_deblocking_filter_idc
@@ -247,315 +582,2108 @@ static void put_aud(void* regs)
 	put_bits(regs, 7, 3);			// primary_pic_type
 }
 
-static gboolean alloc_cedar_bufs(Gstcedarh264enc *cedarelement)
+static uint32_t avc_param(Gstcedarh264stream *stream)
 {
-	cedarelement->tile_w = (cedarelement->width + 31) & ~31;
-	cedarelement->tile_w2 = (cedarelement->width / 2 + 31) & ~31;
-	cedarelement->tile_h = (cedarelement->height + 31) & ~31;
-	cedarelement->tile_h2 = (cedarelement->height / 2 + 31) & ~31;
-	cedarelement->mb_w = (cedarelement->width + 15) / 16;
-	cedarelement->mb_h = (cedarelement->height + 15) / 16;
-	cedarelement->plane_size = cedarelement->mb_w * 16 * cedarelement->mb_h * 16;
-	
-	cedarelement->output_buf = ve_malloc(CEDAR_OUTPUT_BUF_SIZE);
-	if (!cedarelement->output_buf) {
-		GST_ERROR("Cannot allocate Cedar output buffer");
-		return FALSE;
-	}
-	
-	/**
-	 * TODO: avoid input buffer copy and let upstream element write directly to
-	 *   a cedar buffer (pad alloc?)
-	 */
-	cedarelement->input_buf = ve_malloc(cedarelement->plane_size + cedarelement->plane_size / 2);
-	if (!cedarelement->input_buf) {
-		GST_ERROR("Cannot allocate Cedar output buffer");
-		goto error_out1;
-	}
+	uint32_t param = 0x0;
 
-	cedarelement->reconstruct_buf =
-			ve_malloc(cedarelement->tile_w * cedarelement->tile_h + cedarelement->tile_w * cedarelement->tile_h2);
-	if (!cedarelement->reconstruct_buf) {
-		GST_ERROR("Cannot allocate Cedar reconstruct buffer");
-		goto error_out2;
-	}
-	
-	cedarelement->small_luma_buf = ve_malloc(cedarelement->tile_w2 * cedarelement->tile_h2);
-	if (!cedarelement->small_luma_buf) {
-		GST_ERROR("Cannot allocate Cedar small luma buffer");
-		goto error_out3;
-	}
-	
-	cedarelement->mb_info_buf = ve_malloc(0x1000);
-	if (!cedarelement->mb_info_buf) {
-		GST_ERROR("Cannot allocate Cedar mb info buffer");
-		goto error_out4;
-	}
-	
-	// activate AVC engine
-	writel(0x0013000b, cedarelement->ve_regs + VE_CTRL);
-	
-	return TRUE;
+	if (stream->entropy_coding_mode_flag)
+		param |= 0x1 << 8;	// CABAC
+	if (stream->transform_8x8_mode_flag)
+		param |= 0x1 << 9;	// 8x8 transform and scaling matrices
+	if (stream->gop_pos != 0)
+		param |= 0x1 << 4;	// P slice
+
+	return param;
+}
 
-error_out4:
-	ve_free(cedarelement->small_luma_buf);
-	cedarelement->small_luma_buf = NULL;
-error_out3:
-	ve_free(cedarelement->reconstruct_buf);
-	cedarelement->reconstruct_buf = NULL;
-error_out2:
-	ve_free(cedarelement->input_buf);
-	cedarelement->input_buf = NULL;
-error_out1:
-	ve_free(cedarelement->output_buf);
-	cedarelement->output_buf = NULL;
+/* TRUE if any structure of caps leaves field unset or allows value */
+static gboolean caps_allow(GstCaps *caps, const gchar *field, const gchar *value)
+{
+	const GValue *val;
+	guint i, j;
+
+	for (i = 0; i < gst_caps_get_size(caps); i++) {
+		val = gst_structure_get_value(gst_caps_get_structure(caps, i), field);
+		if (!val)
+			return TRUE;
+
+		if (G_VALUE_HOLDS_STRING(val)) {
+			if (!strcmp(g_value_get_string(val), value))
+				return TRUE;
+		} else if (GST_VALUE_HOLDS_LIST(val)) {
+			for (j = 0; j < gst_value_list_get_size(val); j++)
+				if (!strcmp(g_value_get_string(gst_value_list_get_value(val, j)), value))
+					return TRUE;
+		}
+	}
 
 	return FALSE;
 }
 
-/* GObject vmethod implementations */
+static gint64 gcd(gint64 a, gint64 b)
+{
+	while (b) {
+		gint64 t = a % b;
+		a = b;
+		b = t;
+	}
 
-static void
-gst_cedarh264enc_base_init (gpointer gclass)
+	return a;
+}
+
+/* pixel aspect ratio of a layer, so that it shows with the display aspect
+ * ratio of the input even if it isn't scaled uniformly
+ */
+static void layer_par(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
-  GstElementClass *element_class = GST_ELEMENT_CLASS (gclass);
+	gint64 n = (gint64)cedarelement->par_n * cedarelement->width * stream->height;
+	gint64 d = (gint64)cedarelement->par_d * cedarelement->height * stream->width;
+	gint64 div = gcd(n, d);
 
-  gst_element_class_set_details_simple(element_class,
-    "cedar_h264enc",
-    "CedarX H264 Encoder",
-    "H264 Encoder Plugin for CedarX hardware",
-    "Enrico Butera <ebutera@users.berlios.de>");
+	n /= div;
+	d /= div;
 
-  gst_element_class_add_pad_template (element_class,
-      gst_static_pad_template_get (&src_factory));
-  gst_element_class_add_pad_template (element_class,
-      gst_static_pad_template_get (&sink_factory));
+	// sar_width and sar_height are 16 bit
+	while (n > 0xffff || d > 0xffff) {
+		n = (n + 1) / 2;
+		d = (d + 1) / 2;
+	}
+
+	stream->par_n = n;
+	stream->par_d = d;
 }
 
-/* initialize the cedar_h264enc's class */
-static void
-gst_cedarh264enc_class_init (Gstcedarh264encClass * klass)
+/* pick profile and stream format from what downstream accepts,
+ * main and byte-stream if it doesn't care. Requested pads also take
+ * their size from downstream, by default each one halves it again.
+ */
+static void negotiate_src(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
-  GObjectClass *gobject_class;
-  GstElementClass *gstelement_class;
+	GstCaps *allowed;
+	const gchar *profile = "main";
+	int width, height;
 
-  gobject_class = (GObjectClass *) klass;
-  gstelement_class = (GstElementClass *) klass;
-  
-  gobject_class->set_property = gst_cedarh264enc_set_property;
-  gobject_class->get_property = gst_cedarh264enc_get_property;
-  
-  gstelement_class->change_state = gst_cedarh264enc_change_state;
+	stream->avc = FALSE;
 
-  g_object_class_install_property (gobject_class, PROP_SILENT,
-      g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
-          FALSE, G_PARAM_READWRITE));
+	allowed = gst_pad_get_allowed_caps(stream->srcpad);
+	if (allowed && !gst_caps_is_empty(allowed)) {
+		if (!caps_allow(allowed, "profile", "main"))
+			profile = caps_allow(allowed, "profile", "high") ? "high" : "baseline";
+
+		stream->avc = !caps_allow(allowed, "stream-format", "byte-stream");
+	}
+
+	if (stream->index == 0) {
+		stream->width = cedarelement->width;
+		stream->height = cedarelement->height;
+		stream->par_n = cedarelement->par_n;
+		stream->par_d = cedarelement->par_d;
+	} else {
+		width = cedarelement->width >> stream->index;
+		height = cedarelement->height >> stream->index;
+
+		if (allowed && !gst_caps_is_empty(allowed)) {
+			GstStructure *s = gst_structure_copy(gst_caps_get_structure(allowed, 0));
+
+			gst_structure_fixate_field_nearest_int(s, "width", width);
+			gst_structure_fixate_field_nearest_int(s, "height", height);
+			gst_structure_get_int(s, "width", &width);
+			gst_structure_get_int(s, "height", &height);
+			gst_structure_free(s);
+		}
+
+		// only downscaling, even sizes for the subsampled chroma
+		stream->width = CLAMP(width, 16, cedarelement->width) & ~1;
+		stream->height = CLAMP(height, 16, cedarelement->height) & ~1;
+		layer_par(cedarelement, stream);
+	}
+
+	if (!strcmp(profile, "baseline")) {
+		stream->profile_idc = 66;
+		stream->entropy_coding_mode_flag = FALSE;
+		stream->transform_8x8_mode_flag = FALSE;
+	} else if (!strcmp(profile, "high")) {
+		stream->profile_idc = 100;
+		stream->entropy_coding_mode_flag = TRUE;
+		stream->transform_8x8_mode_flag = TRUE;
+	} else {
+		stream->profile_idc = 77;
+		stream->entropy_coding_mode_flag = TRUE;
+		stream->transform_8x8_mode_flag = FALSE;
+	}
+
+	if (allowed)
+		gst_caps_unref(allowed);
 }
 
-/* initialize the new element
- * instantiate pads and add them to element
- * set pad calback functions
- * initialize instance structure
+static const gchar *profile_name(int profile_idc)
+{
+	switch (profile_idc) {
+		case 66:
+			return "baseline";
+		case 100:
+			return "high";
+		default:
+			return "main";
+	}
+}
+
+/* H.264 colour_primaries for the caps color-matrix, the matching transfer
+ * characteristics and matrix coefficients use the same code. 0 if unknown.
  */
-static void
-gst_cedarh264enc_init (Gstcedarh264enc * filter,
-    Gstcedarh264encClass * gclass)
+static int colour_primaries(GstCaps *caps)
 {
-  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
-  gst_pad_set_setcaps_function (filter->sinkpad,
-                                GST_DEBUG_FUNCPTR(gst_cedarh264enc_set_caps));
-  gst_pad_set_chain_function (filter->sinkpad,
-                              GST_DEBUG_FUNCPTR(gst_cedarh264enc_chain));
+	const gchar *matrix;
 
-  filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
-  gst_pad_use_fixed_caps(filter->srcpad);
+	matrix = gst_structure_get_string(gst_caps_get_structure(caps, 0), "color-matrix");
+	if (!matrix)
+		return 0;
 
-  gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
-  gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
-  filter->silent = FALSE;
+	if (!strcmp(matrix, "hdtv"))
+		return 1;	// BT.709
+	if (!strcmp(matrix, "sdtv"))
+		return 6;	// SMPTE 170M / BT.601
+
+	return 0;
 }
 
-static void
-gst_cedarh264enc_set_property (GObject * object, guint prop_id,
-    const GValue * value, GParamSpec * pspec)
+static GstCaps *make_src_caps(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
-  Gstcedarh264enc *filter = GST_CEDAR_H264ENC (object);
+	GstCaps *caps;
 
-  switch (prop_id) {
-    case PROP_SILENT:
-      filter->silent = g_value_get_boolean (value);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
-  }
+	caps = gst_caps_new_simple("video/x-h264",
+		"stream-format", G_TYPE_STRING, stream->avc ? "avc" : "byte-stream",
+		"alignment", G_TYPE_STRING, "au",
+		"width", G_TYPE_INT, stream->width,
+		"height", G_TYPE_INT, stream->height,
+		"framerate", GST_TYPE_FRACTION, cedarelement->fps_num, cedarelement->fps_den,
+		"pixel-aspect-ratio", GST_TYPE_FRACTION, stream->par_n, stream->par_d,
+		"profile", G_TYPE_STRING, profile_name(stream->profile_idc), NULL);
+
+	if (stream->avc && stream->codec_data)
+		gst_caps_set_simple(caps, "codec_data", GST_TYPE_BUFFER, stream->codec_data, NULL);
+
+	return caps;
 }
 
-static void
-gst_cedarh264enc_get_property (GObject * object, guint prop_id,
-    GValue * value, GParamSpec * pspec)
+/* write a start code and remember where the NAL begins in the output */
+static void put_nal_start(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
 {
-  Gstcedarh264enc *filter = GST_CEDAR_H264ENC (object);
+	// offsets are only needed to convert to avc, spare the register read
+	if (stream->avc && stream->num_nals < CEDAR_MAX_NALS)
+		stream->nal_offset[stream->num_nals++] =
+			readl(cedarelement->ve_regs + VE_AVC_VLE_LENGTH) / 8;
 
-  switch (prop_id) {
-    case PROP_SILENT:
-      g_value_set_boolean (value, filter->silent);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
-  }
+	put_start_code(cedarelement->ve_regs);
 }
 
-/* GstElement vmethod implementations */
-
-/* this function handles the link with other elements */
-static gboolean
-gst_cedarh264enc_set_caps (GstPad * pad, GstCaps * caps)
+/* build an avcC record from the SPS and PPS NALs (without start code) */
+static GstBuffer *make_codec_data(const uint8_t *sps, int sps_size, const uint8_t *pps, int pps_size)
 {
-	Gstcedarh264enc *filter;
-	GstPad *otherpad;
-	GstCaps *othercaps;
-
-	filter = GST_CEDAR_H264ENC (gst_pad_get_parent (pad));
-	otherpad = (pad == filter->srcpad) ? filter->sinkpad : filter->srcpad;
-  
-	if (pad == filter->sinkpad) {
-		int ret;
-		int fps_num, fps_den;
-		
-		gst_video_format_parse_caps(caps, NULL, &filter->width, &filter->height);
-		gst_video_parse_caps_framerate(caps, &fps_num, &fps_den);
-		
-		othercaps = gst_caps_copy (gst_pad_get_pad_template_caps(filter->srcpad));
-		gst_caps_set_simple (othercaps,
-			"width", G_TYPE_INT, filter->width,
-			"height", G_TYPE_INT, filter->height,
-			"framerate", GST_TYPE_FRACTION, fps_num, fps_den,
-			"profile", G_TYPE_STRING, "main", NULL);
-		
-		gst_object_unref (filter);
-		ret = gst_pad_set_caps (otherpad, othercaps);
-		gst_caps_unref(othercaps);
-		
-		return ret;
+	GstBuffer *buf;
+	uint8_t *data;
+	int high = sps[1] >= 100;
+
+	buf = gst_buffer_new_and_alloc(11 + sps_size + pps_size + (high ? 4 : 0));
+	data = GST_BUFFER_DATA(buf);
+
+	data[0] = 1;				// configurationVersion
+	data[1] = sps[1];			// AVCProfileIndication
+	data[2] = sps[2];			// profile_compatibility
+	data[3] = sps[3];			// AVCLevelIndication
+	data[4] = 0xfc | (CEDAR_START_CODE_SIZE - 1);	// lengthSizeMinusOne
+	data[5] = 0xe0 | 1;			// numOfSequenceParameterSets
+	GST_WRITE_UINT16_BE(data + 6, sps_size);
+	memcpy(data + 8, sps, sps_size);
+	data += 8 + sps_size;
+
+	data[0] = 1;				// numOfPictureParameterSets
+	GST_WRITE_UINT16_BE(data + 1, pps_size);
+	memcpy(data + 3, pps, pps_size);
+	data += 3 + pps_size;
+
+	if (high) {
+		data[0] = 0xfc | 1;		// chroma_format
+		data[1] = 0xf8 | 0;		// bit_depth_luma_minus8
+		data[2] = 0xf8 | 0;		// bit_depth_chroma_minus8
+		data[3] = 0;			// numOfSequenceParameterSetExt
 	}
 
-	gst_object_unref (filter);
-	return gst_pad_set_caps (otherpad, caps);
+	return buf;
 }
 
-/* chain function
- * this function does the actual processing
+/* convert the encoded byte stream in the VE output buffer to a length
+ * prefixed avc buffer, using the NAL offsets recorded while encoding.
+ * Parameter sets go to codec_data, AUDs are dropped.
  */
-static GstFlowReturn
-gst_cedarh264enc_chain (GstPad * pad, GstBuffer * buf)
+static GstBuffer *make_avc_buffer(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream, int size)
 {
-	Gstcedarh264enc *filter;
-	GstBuffer *outbuf;
+	const uint8_t *data = stream->output_buf;
+	const uint8_t *sps = NULL, *pps = NULL;
+	int sps_size = 0, pps_size = 0;
+	int i, start, end, out_size = 0;
+	GstBuffer *outbuf, *codec_data;
+	uint8_t *out;
+
+	for (i = 0; i < stream->num_nals; i++) {
+		start = stream->nal_offset[i] + CEDAR_START_CODE_SIZE;
+		end = (i + 1 < stream->num_nals) ? stream->nal_offset[i + 1] : size;
+
+		switch (data[start] & 0x1f) {
+			case 7:
+				sps = data + start;
+				sps_size = end - start;
+				break;
+			case 8:
+				pps = data + start;
+				pps_size = end - start;
+				break;
+			case 9:
+				break;
+			default:
+				out_size += CEDAR_START_CODE_SIZE + end - start;
+				break;
+		}
+	}
 
-	filter = GST_CEDAR_H264ENC (GST_OBJECT_PARENT (pad));
+	if (sps && pps) {
+		codec_data = make_codec_data(sps, sps_size, pps, pps_size);
 
-	if (!filter->input_buf || !filter->output_buf) {
-		if (!alloc_cedar_bufs(filter)) {
-			GST_ERROR("Cannot allocate cedar buffers");
-			return GST_FLOW_ERROR;
+		if (!stream->codec_data
+			|| GST_BUFFER_SIZE(codec_data) != GST_BUFFER_SIZE(stream->codec_data)
+			|| memcmp(GST_BUFFER_DATA(codec_data), GST_BUFFER_DATA(stream->codec_data),
+				GST_BUFFER_SIZE(codec_data))) {
+			GstCaps *caps;
+
+			if (stream->codec_data)
+				gst_buffer_unref(stream->codec_data);
+			stream->codec_data = codec_data;
+
+			caps = make_src_caps(cedarelement, stream);
+			gst_pad_set_caps(stream->srcpad, caps);
+			gst_caps_unref(caps);
+		} else {
+			gst_buffer_unref(codec_data);
 		}
 	}
-	
-	if (!GST_BUFFER_DATA(buf)) {
-		// TODO: needed?
-		GST_WARNING("Received empty buffer");
-		outbuf = gst_buffer_new();
-		gst_buffer_set_caps(outbuf, GST_PAD_CAPS(filter->srcpad));
-		GST_BUFFER_TIMESTAMP(outbuf) = GST_BUFFER_TIMESTAMP(buf);
-		
-		return gst_pad_push (filter->srcpad, outbuf);
+
+	outbuf = gst_buffer_new_and_alloc(out_size);
+	out = GST_BUFFER_DATA(outbuf);
+
+	for (i = 0; i < stream->num_nals; i++) {
+		start = stream->nal_offset[i] + CEDAR_START_CODE_SIZE;
+		end = (i + 1 < stream->num_nals) ? stream->nal_offset[i + 1] : size;
+
+		switch (data[start] & 0x1f) {
+			case 7:
+			case 8:
+			case 9:
+				break;
+			default:
+				GST_WRITE_UINT32_BE(out, end - start);
+				memcpy(out + CEDAR_START_CODE_SIZE, data + start, end - start);
+				out += CEDAR_START_CODE_SIZE + end - start;
+				break;
+		}
 	}
-	
-	memcpy(filter->input_buf, GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf));
-	
-	ve_flush_cache(filter->input_buf, filter->plane_size + filter->plane_size / 2);
 
-	// output buffer
-	// flush output buffer, otherwise we might read old cached data
-	ve_flush_cache(filter->output_buf, CEDAR_OUTPUT_BUF_SIZE);
-	
-	writel(0x0, filter->ve_regs + VE_AVC_VLE_OFFSET);
-	writel(ve_virt2phys(filter->output_buf), filter->ve_regs + VE_AVC_VLE_ADDR);
-	writel(ve_virt2phys(filter->output_buf) + CEDAR_OUTPUT_BUF_SIZE - 1, filter->ve_regs + VE_AVC_VLE_END);
+	return outbuf;
+}
 
-	writel(0x04000000, filter->ve_regs + 0xb8c); // ???
+/* (re)allocate a VE buffer unless the current one is big enough already */
+static gboolean ensure_ve_buf(void **buf, int *buf_size, int size)
+{
+	if (*buf && *buf_size >= size)
+		return TRUE;
 
-	// input size
-	writel(filter->mb_w << 16, filter->ve_regs + VE_ISP_INPUT_STRIDE);
-	writel((filter->mb_w << 16) | (filter->mb_h << 0), filter->ve_regs + VE_ISP_INPUT_SIZE);
+	ve_free(*buf);
+	*buf = ve_malloc(size);
+	*buf_size = *buf ? size : 0;
 
-	// input buffer
-	writel(ve_virt2phys(filter->input_buf), filter->ve_regs + VE_ISP_INPUT_LUMA);
-	writel(ve_virt2phys(filter->input_buf) + filter->plane_size, filter->ve_regs + VE_ISP_INPUT_CHROMA);
+	return *buf != NULL;
+}
 
-	put_start_code(filter->ve_regs);
-	put_aud(filter->ve_regs);
-	put_rbsp_trailing_bits(filter->ve_regs);
+static void release_ve_buf(void **buf, int *buf_size)
+{
+	if (*buf) {
+		ve_free(*buf);
+		*buf = NULL;
+	}
+	*buf_size = 0;
+}
 
-	// reference output
-	writel(ve_virt2phys(filter->reconstruct_buf), filter->ve_regs + VE_AVC_REC_LUMA);
-	writel(ve_virt2phys(filter->reconstruct_buf) + filter->tile_w * filter->tile_h, filter->ve_regs + VE_AVC_REC_CHROMA);
-	writel(ve_virt2phys(filter->small_luma_buf), filter->ve_regs + VE_AVC_REC_SLUMA);
-	writel(ve_virt2phys(filter->mb_info_buf), filter->ve_regs + VE_AVC_MB_INFO);
+static void free_stream_bufs(Gstcedarh264stream *stream)
+{
+	int i;
 
-	if (GST_BUFFER_OFFSET(buf) == 0)
-	{
-		// TODO: put sps/pps at regular interval
-		put_start_code(filter->ve_regs);
-		put_seq_parameter_set(filter->ve_regs, filter->mb_w, filter->mb_h);
-		put_rbsp_trailing_bits(filter->ve_regs);
+	release_ve_buf(&stream->mb_info_buf, &stream->mb_info_buf_size);
 
-		put_start_code(filter->ve_regs);
-		put_pic_parameter_set(filter->ve_regs);
-		put_rbsp_trailing_bits(filter->ve_regs);
+	for (i = 0; i < CEDAR_MAX_REC; i++) {
+		release_ve_buf(&stream->small_luma_buf[i], &stream->small_luma_buf_size[i]);
+		release_ve_buf(&stream->reconstruct_buf[i], &stream->reconstruct_buf_size[i]);
 	}
 
-	put_start_code(filter->ve_regs);
-	put_slice_header(filter->ve_regs);
+	release_ve_buf(&stream->input_buf, &stream->input_buf_size);
+	release_ve_buf(&stream->output_buf, &stream->output_buf_size);
 
-	writel(readl(filter->ve_regs + VE_AVC_CTRL) | 0xf, filter->ve_regs + VE_AVC_CTRL);
-	writel(readl(filter->ve_regs + VE_AVC_STATUS) | 0x7, filter->ve_regs + VE_AVC_STATUS);
+	g_free(stream->scale_tmp);
+	stream->scale_tmp = NULL;
 
-	// parameters
-	writel(0x00000100, filter->ve_regs + VE_AVC_PARAM);
-	writel(0x00041e1e, filter->ve_regs + VE_AVC_QP);
-	writel(0x00000104, filter->ve_regs + VE_AVC_MOTION_EST);
+	g_free(stream->activity_luma);
+	stream->activity_luma = NULL;
 
-	writel(0x8, filter->ve_regs + VE_AVC_TRIGGER);
-	ve_wait(1);
+	g_free(stream->ltr_means);
+	stream->ltr_means = NULL;
 
-	writel(readl(filter->ve_regs + VE_AVC_STATUS), filter->ve_regs + VE_AVC_STATUS);
+	if (stream->activity_event) {
+		gst_event_unref(stream->activity_event);
+		stream->activity_event = NULL;
+	}
+}
 
-	// TODO: use gst_pad_alloc_buffer
-	outbuf = gst_buffer_new_and_alloc(readl(filter->ve_regs + VE_AVC_VLE_LENGTH) / 8);
-	gst_buffer_set_caps(outbuf, GST_PAD_CAPS(filter->srcpad));
-	memcpy(GST_BUFFER_DATA(outbuf), filter->output_buf, GST_BUFFER_SIZE(outbuf));
-	GST_BUFFER_TIMESTAMP(outbuf) = GST_BUFFER_TIMESTAMP(buf);
-	
-	gst_buffer_unref(buf);
-	return gst_pad_push (filter->srcpad, outbuf);
+static gboolean ltr_enabled(Gstcedarh264enc *cedarelement)
+{
+	return cedarelement->ltr_interval > 0 && cedarelement->temporal_layers == 1;
 }
 
-static GstStateChangeReturn
-	gst_cedarh264enc_change_state (GstElement *element, GstStateChange transition)
+/* T0 of three temporal layers refers back past the last T1, and the
+ * long-term reference is kept next to the previous frame
+ */
+static void update_num_ref_frames(Gstcedarh264enc *cedarelement)
+{
+	cedarelement->num_ref_frames =
+		cedarelement->temporal_layers == 3 || ltr_enabled(cedarelement) ? 2 : 1;
+}
+
+static void set_geometry(Gstcedarh264stream *stream)
+{
+	stream->tile_w = (stream->width + 31) & ~31;
+	stream->tile_w2 = (stream->width / 2 + 31) & ~31;
+	stream->tile_h = (stream->height + 31) & ~31;
+	stream->tile_h2 = (stream->height / 2 + 31) & ~31;
+	stream->mb_w = (stream->width + 15) / 16;
+	stream->mb_h = (stream->height + 15) / 16;
+	stream->plane_size = stream->mb_w * 16 * stream->mb_h * 16;
+}
+
+static int input_buf_size(Gstcedarh264stream *stream)
+{
+	return stream->plane_size + stream->plane_size / 2;
+}
+
+static int reconstruct_buf_size(Gstcedarh264stream *stream)
+{
+	return stream->tile_w * stream->tile_h + stream->tile_w * stream->tile_h2;
+}
+
+static int small_luma_buf_size(Gstcedarh264stream *stream)
+{
+	return stream->tile_w2 * stream->tile_h2;
+}
+
+static int mb_info_buf_size(Gstcedarh264stream *stream)
+{
+	return ((stream->mb_w + 3) & ~3) * stream->mb_h * 8;
+}
+
+/* VE memory needed for the current geometry, as ve_malloc() rounds it */
+static int stream_footprint(Gstcedarh264stream *stream)
+{
+	return ve_malloc_size(CEDAR_OUTPUT_BUF_SIZE)
+		+ ve_malloc_size(input_buf_size(stream))
+		+ stream->num_rec * ve_malloc_size(reconstruct_buf_size(stream))
+		+ stream->num_rec * ve_malloc_size(small_luma_buf_size(stream))
+		+ ve_malloc_size(mb_info_buf_size(stream));
+}
+
+/* VE memory currently held */
+static int stream_mem_used(Gstcedarh264stream *stream)
+{
+	int i, used;
+
+	used = ve_malloc_size(stream->output_buf_size)
+		+ ve_malloc_size(stream->input_buf_size)
+		+ ve_malloc_size(stream->mb_info_buf_size);
+
+	for (i = 0; i < CEDAR_MAX_REC; i++)
+		used += ve_malloc_size(stream->reconstruct_buf_size[i])
+			+ ve_malloc_size(stream->small_luma_buf_size[i]);
+
+	return used;
+}
+
+static int cedar_footprint(Gstcedarh264enc *cedarelement)
+{
+	int i, footprint = 0;
+
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++)
+		if (cedarelement->streams[i] && cedarelement->streams[i]->mb_w)
+			footprint += stream_footprint(cedarelement->streams[i]);
+
+	return footprint;
+}
+
+static int cedar_mem_used(Gstcedarh264enc *cedarelement)
+{
+	int i, used = 0;
+
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++)
+		if (cedarelement->streams[i])
+			used += stream_mem_used(cedarelement->streams[i]);
+
+	return used;
+}
+
+/* allocate the VE buffers for the current size. Buffers that are already
+ * large enough are kept, so this is also used when the caps change while
+ * streaming.
+ */
+static gboolean alloc_stream_bufs(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	struct ve_mem_info mem;
+	int i, needed;
+
+	set_geometry(stream);
+
+	// the current picture and the last pictures of the referenced layers
+	stream->num_rec = cedarelement->temporal_layers == 3 || ltr_enabled(cedarelement) ? 3 : 2;
+
+	// refuse early if the reserved memory can't hold us, even unfragmented
+	needed = stream_footprint(stream);
+	ve_get_mem_info(&mem);
+	if (needed > mem.total - mem.used + stream_mem_used(stream)) {
+		GST_ERROR("Cedar buffers need %d kB, only %d kB of VE memory free",
+			needed / 1024, (mem.total - mem.used) / 1024);
+		return FALSE;
+	}
+
+	if (!ensure_ve_buf(&stream->output_buf, &stream->output_buf_size,
+			CEDAR_OUTPUT_BUF_SIZE)) {
+		GST_ERROR("Cannot allocate Cedar output buffer");
+		goto error;
+	}
+
+	// still needed when upstream buffers are not in VE memory, see input_in_place()
+	if (!ensure_ve_buf(&stream->input_buf, &stream->input_buf_size,
+			input_buf_size(stream))) {
+		GST_ERROR("Cannot allocate Cedar input buffer");
+		goto error;
+	}
+
+	// one picture is reconstructed while the others are referenced
+	for (i = 0; i < CEDAR_MAX_REC; i++) {
+		if (i >= stream->num_rec) {
+			release_ve_buf(&stream->reconstruct_buf[i], &stream->reconstruct_buf_size[i]);
+			release_ve_buf(&stream->small_luma_buf[i], &stream->small_luma_buf_size[i]);
+			continue;
+		}
+
+		if (!ensure_ve_buf(&stream->reconstruct_buf[i], &stream->reconstruct_buf_size[i],
+				reconstruct_buf_size(stream))) {
+			GST_ERROR("Cannot allocate Cedar reconstruct buffer");
+			goto error;
+		}
+
+		if (!ensure_ve_buf(&stream->small_luma_buf[i], &stream->small_luma_buf_size[i],
+				small_luma_buf_size(stream))) {
+			GST_ERROR("Cannot allocate Cedar small luma buffer");
+			goto error;
+		}
+	}
+
+	if (!ensure_ve_buf(&stream->mb_info_buf, &stream->mb_info_buf_size,
+			mb_info_buf_size(stream))) {
+		GST_ERROR("Cannot allocate Cedar mb info buffer");
+		goto error;
+	}
+
+	// allocated on the next frame when activity is on, at the new size
+	g_free(stream->activity_luma);
+	stream->activity_luma = NULL;
+	g_free(stream->ltr_means);
+	stream->ltr_means = NULL;
+
+	// scaled layers are produced from the input in the base layer's buffer
+	if (stream->index != 0) {
+		g_free(stream->scale_tmp);
+		stream->scale_tmp = g_malloc(scale_nv12_tmp_size(cedarelement->width, cedarelement->height));
+	}
+
+	// the AVC engine is selected and programmed by the next chain()
+	stream->reg_prog_len = 0;
+	cedarelement->sram_dirty = TRUE;
+
+	stream->gop_pos = 0;
+
+	ve_get_mem_info(&mem);
+	GST_INFO("VE memory: %d of %d kB used, largest free block %d kB, %d%% fragmented",
+		mem.used / 1024, mem.total / 1024, mem.largest_free / 1024, mem.fragmentation);
+
+	return TRUE;
+
+error:
+	free_stream_bufs(stream);
+
+	return FALSE;
+}
+
+static void add_reg(Gstcedarh264stream *stream, uint32_t offset, uint32_t value)
+{
+	struct ve_reg *reg = &stream->reg_prog[stream->reg_prog_len++];
+
+	g_assert(stream->reg_prog_len <= CEDAR_MAX_REG_PROG);
+
+	reg->offset = offset;
+	reg->value = value;
+}
+
+/* collect the registers that stay the same from frame to frame. They are
+ * written through the shadow in ve.c, so after the first frame only the
+ * ones another stream changed in between reach the hardware.
+ * Called with the AVC engine selected.
+ */
+static void build_reg_prog(Gstcedarh264stream *stream)
+{
+	uint32_t output = ve_virt2phys(stream->output_buf);
+	uint32_t input = ve_virt2phys(stream->input_buf);
+
+	stream->reg_prog_len = 0;
+
+	// output buffer
+	add_reg(stream, VE_AVC_VLE_ADDR, output);
+	add_reg(stream, VE_AVC_VLE_END, output + CEDAR_OUTPUT_BUF_SIZE - 1);
+
+	add_reg(stream, 0xb8c, 0x04000000); // ???
+
+	// input size
+	add_reg(stream, VE_ISP_INPUT_STRIDE, VE_ISP_STRIDE(stream->mb_w));
+	add_reg(stream, VE_ISP_INPUT_SIZE, VE_ISP_SIZE(stream->mb_w, stream->mb_h));
+
+	// input buffer
+	add_reg(stream, VE_ISP_INPUT_LUMA, input);
+	add_reg(stream, VE_ISP_INPUT_CHROMA, input + stream->plane_size);
+
+	add_reg(stream, VE_AVC_MB_INFO, ve_virt2phys(stream->mb_info_buf));
+
+	// the unknown upper bits are kept from the reset value, read once here
+	add_reg(stream, VE_AVC_CTRL, ve_read_shadow(VE_AVC_CTRL) | 0xf);
+
+	add_reg(stream, VE_AVC_MOTION_EST, 0x00000104);
+}
+
+/* negotiate a pad for the current input caps and reserve its VE memory,
+ * so that too many streams are refused here rather than on their first frame
+ */
+static gboolean configure_stream(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	GstCaps *caps;
+	gboolean ret;
+
+	negotiate_src(cedarelement, stream);
+
+	if (stream->codec_data) {
+		gst_buffer_unref(stream->codec_data);
+		stream->codec_data = NULL;
+	}
+
+	if (!alloc_stream_bufs(cedarelement, stream)) {
+		struct ve_mem_info mem;
+
+		ve_get_mem_info(&mem);
+		GST_ELEMENT_ERROR(cedarelement, RESOURCE, NO_SPACE_LEFT,
+			("Not enough VE memory for %dx%d", stream->width, stream->height),
+			("need %d kB, %d of %d kB in use, largest free block %d kB",
+				stream_footprint(stream) / 1024, mem.used / 1024,
+				mem.total / 1024, mem.largest_free / 1024));
+		return FALSE;
+	}
+
+	stream->configured = TRUE;
+
+	GST_INFO_OBJECT(cedarelement, "%s: %dx%d %s", GST_PAD_NAME(stream->srcpad),
+		stream->width, stream->height, profile_name(stream->profile_idc));
+
+	// avc caps are set with the first frame, once codec_data is known
+	if (stream->avc)
+		return TRUE;
+
+	caps = make_src_caps(cedarelement, stream);
+	ret = gst_pad_set_caps(stream->srcpad, caps);
+	gst_caps_unref(caps);
+
+	return ret;
+}
+
+/* downscale the current frame into a layer's input */
+static void scale_input(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	struct nv12_image dst;
+
+	dst.luma = stream->input_buf;
+	dst.chroma = dst.luma + stream->plane_size;
+	dst.width = stream->width;
+	dst.height = stream->height;
+	dst.stride = stream->mb_w * 16;
+
+	scale_nv12(&cedarelement->input, &dst, stream->scale_tmp);
+
+	ve_flush_cache(stream->input_buf, input_buf_size(stream));
+}
+
+/* frames from cedar_h264dec are in VE memory and flushed already, the
+ * VE reads them where they are when the rows are laid out as it expects.
+ * Otherwise the frame goes through the base layer's input buffer.
+ */
+static gboolean input_in_place(Gstcedarh264enc *cedarelement, GstBuffer *buf)
+{
+	Gstcedarh264stream *base = cedarelement->streams[0];
+	struct nv12_image *input = &cedarelement->input;
+	GstCedarBuffer *cedar_buf;
+	int stride, chroma_offset;
+
+	stride = gst_video_format_get_row_stride(GST_VIDEO_FORMAT_NV12, 0, cedarelement->width);
+	chroma_offset = gst_video_format_get_component_offset(GST_VIDEO_FORMAT_NV12, 1,
+		cedarelement->width, cedarelement->height);
+
+	input->width = base->width;
+	input->height = base->height;
+	cedarelement->input_phys = 0;
+
+	// the denoiser needs the previous frame in the input buffer
+	if (!cedarelement->input_tiled && !cedarelement->denoise && GST_IS_CEDAR_BUFFER(buf)) {
+		cedar_buf = GST_CEDAR_BUFFER(buf);
+
+		// the VE reads whole macroblocks
+		if (GST_BUFFER_DATA(buf) == cedar_buf->mem && stride == base->mb_w * 16 &&
+				chroma_offset + stride * base->mb_h * 8 <= cedar_buf->mem_size) {
+			input->luma = cedar_buf->mem;
+			input->chroma = input->luma + chroma_offset;
+			input->stride = stride;
+			cedarelement->input_phys = cedar_buf->phys;
+			return TRUE;
+		}
+	}
+
+	input->luma = base->input_buf;
+	input->chroma = input->luma + base->plane_size;
+	input->stride = base->mb_w * 16;
+
+	return FALSE;
+}
+
+/* 0 while the input buffer doesn't hold the previous frame */
+static int denoise_strength(Gstcedarh264enc *cedarelement)
+{
+	return cedarelement->denoise_valid ? cedarelement->denoise : 0;
+}
+
+static void detile_upload(Gstcedarh264enc *cedarelement, uint8_t *dst, const uint8_t *src,
+	int tile_stride, int stride, int height)
+{
+	int strength = denoise_strength(cedarelement), y, rows;
+
+	if (!strength) {
+		detile_mb32_plane(dst, stride, src, tile_stride, stride, height);
+		return;
+	}
+
+	// a row of tiles at a time, blended in while it is still cached
+	if (cedarelement->denoise_strip_size < 32 * stride) {
+		cedarelement->denoise_strip_size = 32 * stride;
+		cedarelement->denoise_strip = g_realloc(cedarelement->denoise_strip,
+			cedarelement->denoise_strip_size);
+	}
+
+	for (y = 0; y < height; y += 32) {
+		rows = MIN(32, height - y);
+		detile_mb32_plane(cedarelement->denoise_strip, stride, src + y * tile_stride, tile_stride,
+			stride, rows);
+		denoise_copy(dst + y * stride, cedarelement->denoise_strip, rows * stride, strength);
+	}
+}
+
+/* ST12 input: 32x32 tiled NV12 as the CSI and the decoders write it, the
+ * chroma tiles follow the luma ones. The ISP's tiled input mode is not
+ * known, so the frame is detiled on its way into the input buffer, which
+ * costs no more than the linear copy it replaces.
+ */
+static gboolean upload_tiled(Gstcedarh264enc *cedarelement, GstBuffer *buf)
+{
+	Gstcedarh264stream *base = cedarelement->streams[0];
+	int tile_stride = (cedarelement->width + 31) & ~31;
+	int luma_size = tile_stride * ((cedarelement->height + 31) & ~31);
+	int chroma_size = tile_stride * ((cedarelement->height / 2 + 31) & ~31);
+	int stride = base->mb_w * 16;
+
+	if (GST_BUFFER_SIZE(buf) < luma_size + chroma_size) {
+		GST_ERROR("Tiled buffer of %d bytes, expected %d", GST_BUFFER_SIZE(buf),
+			luma_size + chroma_size);
+		return FALSE;
+	}
+
+	// the tiles cover whole macroblocks, so does the copy
+	detile_upload(cedarelement, base->input_buf, GST_BUFFER_DATA(buf), tile_stride,
+		stride, base->mb_h * 16);
+	detile_upload(cedarelement, base->input_buf + base->plane_size,
+		GST_BUFFER_DATA(buf) + luma_size, tile_stride, stride, base->mb_h * 8);
+
+	return TRUE;
+}
+
+/* copy the frame into the base layer's input buffer, denoised against
+ * the previous one still in there
+ */
+static void upload(Gstcedarh264enc *cedarelement, GstBuffer *buf)
+{
+	Gstcedarh264stream *base = cedarelement->streams[0];
+
+	denoise_copy(base->input_buf, GST_BUFFER_DATA(buf),
+		MIN(GST_BUFFER_SIZE(buf), input_buf_size(base)), denoise_strength(cedarelement));
+}
+
+/* the VE leaves a half resolution copy of every picture in the small
+ * luma buffer for the next motion search, in 32x32 tiles. Comparing it
+ * with the previous one gives a per-macroblock activity grid without
+ * reading the full frame.
+ */
+static GstEvent *activity_event(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream,
+	int rec, GstBuffer *buf)
+{
+	int width = stream->mb_w * 8, height = stream->mb_h * 8;
+	uint8_t *cur, *prev;
+	GstBuffer *grid, *thumbnail;
+	GstStructure *s;
+	int mean;
+
+	if (!stream->activity_luma) {
+		stream->activity_luma = g_malloc(2 * width * height);
+		stream->activity_valid = FALSE;
+	}
+
+	cur = stream->activity_luma + stream->activity_cur * width * height;
+	prev = stream->activity_luma + !stream->activity_cur * width * height;
+
+	ve_invalidate_cache(stream->small_luma_buf[rec], small_luma_buf_size(stream));
+	detile_mb32(cur, width, stream->small_luma_buf[rec], stream->tile_w2, 0, 0, width, height);
+
+	grid = gst_buffer_new_and_alloc(stream->mb_w * stream->mb_h);
+	mean = activity_grid(GST_BUFFER_DATA(grid), cur, stream->activity_valid ? prev : cur,
+		width, stream->mb_w, stream->mb_h);
+
+	s = gst_structure_new("cedar-activity",
+		"timestamp", G_TYPE_UINT64, GST_BUFFER_TIMESTAMP(buf),
+		"mb-width", G_TYPE_INT, stream->mb_w,
+		"mb-height", G_TYPE_INT, stream->mb_h,
+		"grid", GST_TYPE_BUFFER, grid,
+		"mean", G_TYPE_INT, mean, NULL);
+	gst_buffer_unref(grid);
+
+	if (cedarelement->activity_thumbnail) {
+		thumbnail = gst_buffer_new_and_alloc(width * height);
+		memcpy(GST_BUFFER_DATA(thumbnail), cur, width * height);
+		gst_structure_set(s,
+			"thumbnail", GST_TYPE_BUFFER, thumbnail,
+			"thumbnail-width", G_TYPE_INT, width,
+			"thumbnail-height", G_TYPE_INT, height, NULL);
+		gst_buffer_unref(thumbnail);
+	}
+
+	stream->activity_cur = !stream->activity_cur;
+	stream->activity_valid = TRUE;
+
+	return gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM, s);
+}
+
+static int block_means_size(Gstcedarh264enc *cedarelement)
+{
+	return (cedarelement->input.width / 8) * (cedarelement->input.height / 8);
+}
+
+/* 8x8 block means of the current or the previous input frame */
+static uint8_t *block_means(Gstcedarh264enc *cedarelement, gboolean previous)
+{
+	int cur = previous ? !cedarelement->scene_cur : cedarelement->scene_cur;
+
+	return cedarelement->scene_luma + cur * block_means_size(cedarelement);
+}
+
+static void update_block_means(Gstcedarh264enc *cedarelement)
+{
+	const struct nv12_image *input = &cedarelement->input;
+
+	cedarelement->scene_valid = cedarelement->scene_luma != NULL;
+	if (!cedarelement->scene_luma)
+		cedarelement->scene_luma = g_malloc(2 * block_means_size(cedarelement));
+
+	cedarelement->scene_cur = !cedarelement->scene_cur;
+	activity_block_means(block_means(cedarelement, FALSE), input->luma, input->stride,
+		input->width, input->height);
+}
+
+/* compare the block means with the previous frame's. A cut changes most
+ * blocks at once, motion only some, so the mean change separates the two
+ * well enough to place an IDR frame.
+ */
+static gboolean scene_cut(Gstcedarh264enc *cedarelement)
+{
+	int diff;
+
+	if (!cedarelement->scene_valid)
+		return FALSE;
+
+	diff = activity_diff(block_means(cedarelement, FALSE), block_means(cedarelement, TRUE),
+		block_means_size(cedarelement));
+
+	GST_LOG_OBJECT(cedarelement, "scene change %d", diff);
+
+	return diff >= cedarelement->scene_threshold;
+}
+
+/* after an occlusion the background in the long-term reference matches
+ * better than the previous frame
+ */
+static gboolean prefer_ltr(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	const uint8_t *cur = block_means(cedarelement, FALSE);
+	int size = block_means_size(cedarelement);
+
+	if (!cedarelement->scene_valid)
+		return FALSE;
+
+	return activity_diff(cur, stream->ltr_means, size)
+		< activity_diff(cur, block_means(cedarelement, TRUE), size);
+}
+
+static GstClockTime frame_duration(Gstcedarh264enc *cedarelement)
+{
+	if (cedarelement->fps_num <= 0 || cedarelement->fps_den <= 0)
+		return GST_CLOCK_TIME_NONE;
+
+	return gst_util_uint64_scale_int(GST_SECOND, cedarelement->fps_den, cedarelement->fps_num);
+}
+
+/* latency added by the encoder: frames are encoded synchronously, so it is
+ * the VE time per frame. Until that has been measured assume a full frame.
+ */
+static GstClockTime encoder_latency(Gstcedarh264enc *cedarelement)
+{
+	GstClockTime latency;
+
+	GST_OBJECT_LOCK(cedarelement);
+	latency = cedarelement->encode_time;
+	GST_OBJECT_UNLOCK(cedarelement);
+
+	if (!GST_CLOCK_TIME_IS_VALID(latency))
+		latency = frame_duration(cedarelement);
+
+	return GST_CLOCK_TIME_IS_VALID(latency) ? latency : 0;
+}
+
+static void reset_qos(Gstcedarh264enc *cedarelement)
+{
+	int i;
+
+	GST_OBJECT_LOCK(cedarelement);
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++)
+		if (cedarelement->streams[i])
+			cedarelement->streams[i]->earliest_time = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK(cedarelement);
+}
+
+/* TRUE if downstream QoS says the buffer would be late anyway */
+static gboolean qos_drop(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream, GstBuffer *buf)
+{
+	GstClockTime qostime, earliest_time;
+
+	if (!GST_BUFFER_TIMESTAMP_IS_VALID(buf))
+		return FALSE;
+
+	qostime = gst_segment_to_running_time(&cedarelement->segment, GST_FORMAT_TIME,
+		GST_BUFFER_TIMESTAMP(buf));
+
+	GST_OBJECT_LOCK(cedarelement);
+	earliest_time = stream->earliest_time;
+	GST_OBJECT_UNLOCK(cedarelement);
+
+	if (GST_CLOCK_TIME_IS_VALID(qostime) && GST_CLOCK_TIME_IS_VALID(earliest_time)
+		&& qostime <= earliest_time) {
+		GST_DEBUG_OBJECT(stream->srcpad, "dropping frame, running time %" GST_TIME_FORMAT
+			" earliest %" GST_TIME_FORMAT, GST_TIME_ARGS(qostime), GST_TIME_ARGS(earliest_time));
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static Gstcedarh264stream *add_stream(Gstcedarh264enc *cedarelement, int index, GstPad *pad)
+{
+	Gstcedarh264stream *stream = g_new0(Gstcedarh264stream, 1);
+
+	stream->index = index;
+	stream->srcpad = pad;
+	stream->profile_idc = 77;
+	stream->entropy_coding_mode_flag = TRUE;
+	stream->transform_8x8_mode_flag = FALSE;
+	stream->earliest_time = GST_CLOCK_TIME_NONE;
+
+	gst_pad_set_element_private(pad, stream);
+	gst_pad_use_fixed_caps(pad);
+	gst_pad_set_event_function (pad,
+	                            GST_DEBUG_FUNCPTR(gst_cedarh264enc_src_event));
+	gst_pad_set_query_function (pad,
+	                            GST_DEBUG_FUNCPTR(gst_cedarh264enc_src_query));
+
+	// chain() walks the streams with the stream lock held
+	GST_PAD_STREAM_LOCK(cedarelement->sinkpad);
+	cedarelement->streams[index] = stream;
+	GST_PAD_STREAM_UNLOCK(cedarelement->sinkpad);
+
+	return stream;
+}
+
+static void free_stream(Gstcedarh264stream *stream)
+{
+	free_stream_bufs(stream);
+
+	if (stream->codec_data)
+		gst_buffer_unref(stream->codec_data);
+
+	g_free(stream);
+}
+
+/* GObject vmethod implementations */
+
+static void
+gst_cedarh264enc_base_init (gpointer gclass)
+{
+  GstElementClass *element_class = GST_ELEMENT_CLASS (gclass);
+
+  gst_element_class_set_details_simple(element_class,
+    "cedar_h264enc",
+    "CedarX H264 Encoder",
+    "H264 Encoder Plugin for CedarX hardware",
+    "Enrico Butera <ebutera@users.berlios.de>");
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_request_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+/* initialize the cedar_h264enc's class */
+static void
+gst_cedarh264enc_class_init (Gstcedarh264encClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+
+  gobject_class->set_property = gst_cedarh264enc_set_property;
+  gobject_class->get_property = gst_cedarh264enc_get_property;
+  gobject_class->finalize = gst_cedarh264enc_finalize;
+
+  gstelement_class->change_state = gst_cedarh264enc_change_state;
+  gstelement_class->request_new_pad = gst_cedarh264enc_request_new_pad;
+  gstelement_class->release_pad = gst_cedarh264enc_release_pad;
+
+  g_object_class_install_property (gobject_class, PROP_SILENT,
+      g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
+          FALSE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_KEYFRAME_INTERVAL,
+      g_param_spec_int ("keyframe-interval", "Keyframe interval",
+          "Number of frames between IDR frames (1 = intra only)",
+          1, G_MAXINT, DEFAULT_KEYFRAME_INTERVAL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_VE_MEMORY,
+      g_param_spec_int ("ve-memory", "VE memory",
+          "Bytes of reserved VE memory held by this encoder",
+          0, G_MAXINT, 0, G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class, PROP_VE_FOOTPRINT,
+      g_param_spec_int ("ve-footprint", "VE footprint",
+          "Bytes of reserved VE memory the negotiated caps need",
+          0, G_MAXINT, 0, G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class, PROP_ACTIVITY,
+      g_param_spec_boolean ("activity", "Activity",
+          "Send a cedar-activity event with a macroblock activity grid ahead of every frame",
+          FALSE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_ACTIVITY_THUMBNAIL,
+      g_param_spec_boolean ("activity-thumbnail", "Activity thumbnail",
+          "Add the half resolution luma to the cedar-activity events",
+          FALSE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SCENE_THRESHOLD,
+      g_param_spec_int ("scene-threshold", "Scene threshold",
+          "Mean luma change between frames that starts a new GOP (0 = off)",
+          0, 255, DEFAULT_SCENE_THRESHOLD, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_KEYFRAME_INTERVAL,
+      g_param_spec_int ("min-keyframe-interval", "Minimum keyframe interval",
+          "Frames since the last IDR frame before a scene change starts a new GOP",
+          1, G_MAXINT, DEFAULT_MIN_KEYFRAME_INTERVAL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SCENE_DETECT_TIME,
+      g_param_spec_uint64 ("scene-detect-time", "Scene detect time",
+          "Average time per frame spent analysing the input for scene changes and the long-term reference in ns",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class, PROP_TEMPORAL_LAYERS,
+      g_param_spec_int ("temporal-layers", "Temporal layers",
+          "Hierarchical P layers, buffers of the upper ones can be dropped (1 = off)",
+          1, CEDAR_MAX_TEMPORAL_LAYERS, 1, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_LTR_INTERVAL,
+      g_param_spec_int ("ltr-interval", "LTR interval",
+          "Frames between refreshes of the long-term reference (0 = off), "
+          "only without temporal layers",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_QP,
+      g_param_spec_int ("qp", "QP",
+          "Quantizer of every frame, and of the first pass",
+          TWOPASS_MIN_QP, TWOPASS_MAX_QP, DEFAULT_QP, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_PASS,
+      g_param_spec_int ("pass", "Pass",
+          "Two-pass encoding: 1 writes frame statistics to stats-file, 2 reads "
+          "them to meet target-size (0 = single pass at qp)",
+          0, 2, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_FILE,
+      g_param_spec_string ("stats-file", "Stats file",
+          "Frame statistics of the first pass",
+          DEFAULT_STATS_FILE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_TARGET_SIZE,
+      g_param_spec_uint64 ("target-size", "Target size",
+          "Bytes of the base layer stream in the second pass",
+          0, G_MAXUINT64, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_DENOISE,
+      g_param_spec_int ("denoise", "Denoise",
+          "Strength of the temporal denoiser applied while copying the input (0 = off)",
+          0, DENOISE_MAX_STRENGTH, 0, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_UPLOAD_TIME,
+      g_param_spec_uint64 ("upload-time", "Upload time",
+          "Average time per frame spent copying (and denoising) the input in ns",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class, PROP_WARM_UP,
+      g_param_spec_boolean ("warm-up", "Warm-up",
+          "Encode a dummy picture when the caps are set, to take the setup off the first frame",
+          FALSE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_PERSISTENT_VE,
+      g_param_spec_boolean ("persistent-ve", "Persistent VE",
+          "Keep the VE open and set up until the process exits, for pipelines that restart often",
+          FALSE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_FIRST_FRAME_TIME,
+      g_param_spec_uint64 ("first-frame-time", "First frame time",
+          "Time from leaving NULL (or READY) to the first encoded frame in ns",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE));
+}
+
+/* initialize the new element
+ * instantiate pads and add them to element
+ * set pad calback functions
+ * initialize instance structure
+ */
+static void
+gst_cedarh264enc_init (Gstcedarh264enc * filter,
+    Gstcedarh264encClass * gclass)
+{
+  Gstcedarh264stream *stream;
+  GstPadTemplate *templ;
+
+  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_setcaps_function (filter->sinkpad,
+                                GST_DEBUG_FUNCPTR(gst_cedarh264enc_set_caps));
+  gst_pad_set_chain_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_cedarh264enc_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_cedarh264enc_sink_event));
+
+  templ = gst_static_pad_template_get (&src_factory);
+  stream = add_stream (filter, 0, new_src_pad (templ, "src"));
+  gst_object_unref (templ);
+
+  gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (filter), stream->srcpad);
+  filter->silent = FALSE;
+  filter->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+  filter->scene_threshold = DEFAULT_SCENE_THRESHOLD;
+  filter->min_keyframe_interval = DEFAULT_MIN_KEYFRAME_INTERVAL;
+  filter->num_ref_frames = 1;
+  filter->temporal_layers = 1;
+  filter->qp = DEFAULT_QP;
+  filter->stats_file = g_strdup (DEFAULT_STATS_FILE);
+  filter->encode_time = GST_CLOCK_TIME_NONE;
+  filter->reported_latency = GST_CLOCK_TIME_NONE;
+  filter->switch_start = GST_CLOCK_TIME_NONE;
+  filter->start_time = GST_CLOCK_TIME_NONE;
+  filter->first_frame_time = GST_CLOCK_TIME_NONE;
+  gst_segment_init (&filter->segment, GST_FORMAT_TIME);
+}
+
+static void
+gst_cedarh264enc_finalize (GObject * object)
+{
+  Gstcedarh264enc *filter = GST_CEDAR_H264ENC (object);
+  int i;
+
+  for (i = 0; i < CEDAR_MAX_STREAMS; i++)
+    if (filter->streams[i])
+      free_stream (filter->streams[i]);
+
+  g_free (filter->scene_luma);
+  g_free (filter->stats_file);
+  g_free (filter->denoise_strip);
+  twopass_close (&filter->twopass);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_cedarh264enc_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  Gstcedarh264enc *filter = GST_CEDAR_H264ENC (object);
+
+  switch (prop_id) {
+    case PROP_SILENT:
+      filter->silent = g_value_get_boolean (value);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      filter->keyframe_interval = g_value_get_int (value);
+      break;
+    case PROP_ACTIVITY:
+      filter->activity = g_value_get_boolean (value);
+      break;
+    case PROP_ACTIVITY_THUMBNAIL:
+      filter->activity_thumbnail = g_value_get_boolean (value);
+      break;
+    case PROP_SCENE_THRESHOLD:
+      filter->scene_threshold = g_value_get_int (value);
+      break;
+    case PROP_MIN_KEYFRAME_INTERVAL:
+      filter->min_keyframe_interval = g_value_get_int (value);
+      break;
+    case PROP_TEMPORAL_LAYERS:
+      filter->temporal_layers = g_value_get_int (value);
+      update_num_ref_frames (filter);
+      break;
+    case PROP_LTR_INTERVAL:
+      filter->ltr_interval = g_value_get_int (value);
+      update_num_ref_frames (filter);
+      break;
+    case PROP_QP:
+      filter->qp = g_value_get_int (value);
+      break;
+    case PROP_PASS:
+      filter->pass = g_value_get_int (value);
+      break;
+    case PROP_STATS_FILE:
+      g_free (filter->stats_file);
+      filter->stats_file = g_value_dup_string (value);
+      break;
+    case PROP_TARGET_SIZE:
+      filter->target_size = g_value_get_uint64 (value);
+      break;
+    case PROP_DENOISE:
+      filter->denoise = g_value_get_int (value);
+      break;
+    case PROP_WARM_UP:
+      filter->warm_up = g_value_get_boolean (value);
+      break;
+    case PROP_PERSISTENT_VE:
+      filter->persistent_ve = g_value_get_boolean (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_cedarh264enc_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  Gstcedarh264enc *filter = GST_CEDAR_H264ENC (object);
+
+  switch (prop_id) {
+    case PROP_SILENT:
+      g_value_set_boolean (value, filter->silent);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      g_value_set_int (value, filter->keyframe_interval);
+      break;
+    case PROP_VE_MEMORY:
+      g_value_set_int (value, cedar_mem_used (filter));
+      break;
+    case PROP_VE_FOOTPRINT:
+      g_value_set_int (value, cedar_footprint (filter));
+      break;
+    case PROP_ACTIVITY:
+      g_value_set_boolean (value, filter->activity);
+      break;
+    case PROP_ACTIVITY_THUMBNAIL:
+      g_value_set_boolean (value, filter->activity_thumbnail);
+      break;
+    case PROP_SCENE_THRESHOLD:
+      g_value_set_int (value, filter->scene_threshold);
+      break;
+    case PROP_MIN_KEYFRAME_INTERVAL:
+      g_value_set_int (value, filter->min_keyframe_interval);
+      break;
+    case PROP_TEMPORAL_LAYERS:
+      g_value_set_int (value, filter->temporal_layers);
+      break;
+    case PROP_LTR_INTERVAL:
+      g_value_set_int (value, filter->ltr_interval);
+      break;
+    case PROP_QP:
+      g_value_set_int (value, filter->qp);
+      break;
+    case PROP_PASS:
+      g_value_set_int (value, filter->pass);
+      break;
+    case PROP_STATS_FILE:
+      g_value_set_string (value, filter->stats_file);
+      break;
+    case PROP_TARGET_SIZE:
+      g_value_set_uint64 (value, filter->target_size);
+      break;
+    case PROP_DENOISE:
+      g_value_set_int (value, filter->denoise);
+      break;
+    case PROP_WARM_UP:
+      g_value_set_boolean (value, filter->warm_up);
+      break;
+    case PROP_PERSISTENT_VE:
+      g_value_set_boolean (value, filter->persistent_ve);
+      break;
+    case PROP_FIRST_FRAME_TIME:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint64 (value, GST_CLOCK_TIME_IS_VALID (filter->first_frame_time) ?
+          filter->first_frame_time : 0);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_UPLOAD_TIME:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint64 (value, filter->upload_frames ?
+          filter->upload_time / filter->upload_frames : 0);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_SCENE_DETECT_TIME:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint64 (value, filter->scene_frames ?
+          filter->scene_time / filter->scene_frames : 0);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+/* GstElement vmethod implementations */
+
+static GstPad *
+gst_cedarh264enc_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name)
+{
+	Gstcedarh264enc *filter = GST_CEDAR_H264ENC (element);
+	Gstcedarh264stream *stream;
+	gchar *pad_name;
+	int index;
+
+	if (name && sscanf(name, "src_%d", &index) == 1) {
+		if (index < 1 || index >= CEDAR_MAX_STREAMS || filter->streams[index]) {
+			GST_WARNING_OBJECT(filter, "pad %s is not available", name);
+			return NULL;
+		}
+	} else {
+		for (index = 1; index < CEDAR_MAX_STREAMS; index++)
+			if (!filter->streams[index])
+				break;
+
+		if (index == CEDAR_MAX_STREAMS) {
+			GST_WARNING_OBJECT(filter, "at most %d simulcast layers", CEDAR_MAX_STREAMS - 1);
+			return NULL;
+		}
+	}
+
+	pad_name = g_strdup_printf("src_%d", index);
+	stream = add_stream(filter, index, new_src_pad(templ, pad_name));
+	g_free(pad_name);
+
+	// negotiated on the next frame, once downstream is linked
+	if (GST_STATE(filter) > GST_STATE_READY)
+		gst_pad_set_active(stream->srcpad, TRUE);
+	gst_element_add_pad(element, stream->srcpad);
+
+	return stream->srcpad;
+}
+
+static void
+gst_cedarh264enc_release_pad (GstElement * element, GstPad * pad)
+{
+	Gstcedarh264enc *filter = GST_CEDAR_H264ENC (element);
+	Gstcedarh264stream *stream = gst_pad_get_element_private(pad);
+
+	if (!stream || stream->index == 0)
+		return;
+
+	GST_PAD_STREAM_LOCK(filter->sinkpad);
+	filter->streams[stream->index] = NULL;
+	GST_PAD_STREAM_UNLOCK(filter->sinkpad);
+
+	// no new events or queries reach the stream once the pad is gone,
+	// one already in src_event finds element_private cleared
+	gst_object_ref(pad);
+	gst_pad_set_active(pad, FALSE);
+	gst_element_remove_pad(element, pad);
+
+	GST_OBJECT_LOCK(filter);
+	gst_pad_set_element_private(pad, NULL);
+	GST_OBJECT_UNLOCK(filter);
+	gst_object_unref(pad);
+
+	free_stream(stream);
+}
+
+/* encode a black picture into the void, so that the engine switch, the
+ * register programme, the scaling lists and the first touch of the new
+ * buffers are done before the first real frame. The stream state is not
+ * advanced, the next frame is an IDR frame anyway.
+ */
+static void warm_up(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	void *regs = cedarelement->ve_regs;
+	uint32_t rec = ve_virt2phys(stream->reconstruct_buf[0]);
+
+	memset(stream->input_buf, 16, stream->plane_size);
+	memset(stream->input_buf + stream->plane_size, 128, stream->plane_size / 2);
+	ve_flush_cache(stream->input_buf, input_buf_size(stream));
+
+	if (ve_get(VE_ENGINE_AVC, cedarelement))
+		cedarelement->sram_dirty = TRUE;
+
+	if (stream->reg_prog_len == 0)
+		build_reg_prog(stream);
+	ve_write_regs(stream->reg_prog, stream->reg_prog_len);
+	ve_write_reg(0x00040000 | cedarelement->qp << 8 | cedarelement->qp, VE_AVC_QP);
+
+	if (cedarelement->sram_dirty && stream->profile_idc >= 100) {
+		load_scaling_lists(regs);
+		cedarelement->sram_dirty = FALSE;
+	}
+
+	writel(0x0, regs + VE_AVC_VLE_OFFSET);
+	ve_write_reg(rec, VE_AVC_REC_LUMA);
+	ve_write_reg(rec + stream->tile_w * stream->tile_h, VE_AVC_REC_CHROMA);
+	ve_write_reg(ve_virt2phys(stream->small_luma_buf[0]), VE_AVC_REC_SLUMA);
+
+	// gop_pos is 0, an I picture
+	writel(0x7, regs + VE_AVC_STATUS);
+	ve_write_reg(avc_param(stream), VE_AVC_PARAM);
+	writel(0x8, regs + VE_AVC_TRIGGER);
+	ve_wait(1);
+	writel(readl(regs + VE_AVC_STATUS), regs + VE_AVC_STATUS);
+
+	ve_put();
+}
+
+/* this function handles the link with other elements */
+static gboolean
+gst_cedarh264enc_set_caps (GstPad * pad, GstCaps * caps)
+{
+	Gstcedarh264enc *filter;
+	int old_width, old_height, i;
+	guint32 fourcc;
+	GstClockTime start;
+	gboolean ret = TRUE;
+
+	filter = GST_CEDAR_H264ENC (gst_pad_get_parent (pad));
+	old_width = filter->width;
+	old_height = filter->height;
+
+	gst_video_format_parse_caps(caps, NULL, &filter->width, &filter->height);
+	filter->input_tiled = gst_structure_get_fourcc(gst_caps_get_structure(caps, 0), "format", &fourcc)
+		&& fourcc == GST_MAKE_FOURCC('S', 'T', '1', '2');
+	if (!gst_video_parse_caps_framerate(caps, &filter->fps_num, &filter->fps_den)) {
+		filter->fps_num = 0;
+		filter->fps_den = 1;
+	}
+	if (!gst_video_parse_caps_pixel_aspect_ratio(caps, &filter->par_n, &filter->par_d)) {
+		filter->par_n = 1;
+		filter->par_d = 1;
+	}
+	filter->colour_primaries = colour_primaries(caps);
+
+	// new size for the block means, detection restarts
+	g_free(filter->scene_luma);
+	filter->scene_luma = NULL;
+	filter->denoise_valid = FALSE;
+
+	// caps changed while streaming: keep the VE open, resize what is
+	// too small and start over with new SPS/PPS and an IDR
+	if (filter->streams[0]->input_buf) {
+		GST_INFO_OBJECT(filter, "renegotiating %dx%d -> %dx%d",
+			old_width, old_height, filter->width, filter->height);
+		filter->switch_start = gst_util_get_timestamp();
+	}
+
+	// the base layer first, the others are scaled from its input
+	for (i = 0; i < CEDAR_MAX_STREAMS && ret; i++) {
+		if (!filter->streams[i])
+			continue;
+
+		filter->streams[i]->configured = FALSE;
+		ret = configure_stream(filter, filter->streams[i]);
+	}
+
+	if (ret && filter->warm_up) {
+		start = gst_util_get_timestamp();
+		for (i = 0; i < CEDAR_MAX_STREAMS; i++)
+			if (filter->streams[i])
+				warm_up(filter, filter->streams[i]);
+		GST_INFO_OBJECT(filter, "warm-up took %" GST_TIME_FORMAT,
+			GST_TIME_ARGS(gst_util_get_timestamp() - start));
+	}
+
+	if (GST_CLOCK_TIME_IS_VALID(filter->start_time))
+		filter->caps_time = gst_util_get_timestamp() - filter->start_time;
+
+	gst_object_unref (filter);
+
+	return ret;
+}
+
+/* push an event out of every src pad, takes ownership of event */
+static gboolean push_event_all(Gstcedarh264enc *cedarelement, GstEvent *event)
+{
+	gboolean ret = TRUE;
+	int i;
+
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+		if (!cedarelement->streams[i])
+			continue;
+
+		gst_event_ref(event);
+		ret &= gst_pad_push_event(cedarelement->streams[i]->srcpad, event);
+	}
+
+	gst_event_unref(event);
+
+	return ret;
+}
+
+static gboolean
+gst_cedarh264enc_sink_event (GstPad * pad, GstEvent * event)
+{
+	Gstcedarh264enc *filter;
+	gboolean ret;
+
+	filter = GST_CEDAR_H264ENC (gst_pad_get_parent (pad));
+
+	switch (GST_EVENT_TYPE (event)) {
+		case GST_EVENT_NEWSEGMENT: {
+			gboolean update;
+			gdouble rate, applied_rate;
+			GstFormat format;
+			gint64 start, stop, position;
+
+			gst_event_parse_new_segment_full (event, &update, &rate, &applied_rate,
+				&format, &start, &stop, &position);
+			if (format == GST_FORMAT_TIME)
+				gst_segment_set_newsegment_full (&filter->segment, update, rate,
+					applied_rate, format, start, stop, position);
+			break;
+		}
+		case GST_EVENT_FLUSH_STOP:
+			gst_segment_init (&filter->segment, GST_FORMAT_TIME);
+			reset_qos (filter);
+			break;
+		case GST_EVENT_EOS:
+			// the planned QPs belong to other frames if the input isn't the same
+			if (filter->pass == 2 && filter->twopass.pos != filter->twopass.num_frames)
+				GST_ELEMENT_WARNING (filter, STREAM, ENCODE, (NULL),
+					("The second pass encoded %d frames, the first pass %d",
+					filter->twopass.pos, filter->twopass.num_frames));
+			break;
+		default:
+			break;
+	}
+
+	ret = push_event_all (filter, event);
+	gst_object_unref (filter);
+
+	return ret;
+}
+
+static gboolean
+gst_cedarh264enc_src_event (GstPad * pad, GstEvent * event)
+{
+	Gstcedarh264enc *filter;
+	Gstcedarh264stream *stream;
+	gboolean ret;
+
+	filter = GST_CEDAR_H264ENC (gst_pad_get_parent (pad));
+	if (!filter) {
+		gst_event_unref (event);
+		return FALSE;
+	}
+
+	// each layer drops frames for its own downstream
+	if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+		gdouble proportion;
+		GstClockTimeDiff diff;
+		GstClockTime timestamp, duration;
+
+		gst_event_parse_qos (event, &proportion, &diff, &timestamp);
+		duration = frame_duration (filter);
+
+		// cleared under the object lock when the pad is released
+		GST_OBJECT_LOCK (filter);
+		stream = gst_pad_get_element_private (pad);
+		if (stream) {
+			if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+				stream->earliest_time = GST_CLOCK_TIME_NONE;
+			else if (diff > 0)
+				// we are late, skip ahead a bit more to catch up
+				stream->earliest_time = timestamp + 2 * diff
+					+ (GST_CLOCK_TIME_IS_VALID (duration) ? duration : 0);
+			else
+				stream->earliest_time = timestamp + diff;
+		}
+		GST_OBJECT_UNLOCK (filter);
+
+		GST_LOG_OBJECT (pad, "QoS proportion %g diff %" G_GINT64_FORMAT, proportion, diff);
+	}
+
+	ret = gst_pad_push_event (filter->sinkpad, event);
+	gst_object_unref (filter);
+
+	return ret;
+}
+
+static gboolean
+gst_cedarh264enc_src_query (GstPad * pad, GstQuery * query)
+{
+	Gstcedarh264enc *filter;
+	gboolean ret;
+
+	filter = GST_CEDAR_H264ENC (gst_pad_get_parent (pad));
+	if (!filter)
+		return FALSE;
+
+	switch (GST_QUERY_TYPE (query)) {
+		case GST_QUERY_LATENCY: {
+			gboolean live;
+			GstClockTime min, max, latency;
+
+			ret = gst_pad_peer_query (filter->sinkpad, query);
+			if (ret) {
+				gst_query_parse_latency (query, &live, &min, &max);
+
+				latency = encoder_latency (filter);
+				min += latency;
+				if (GST_CLOCK_TIME_IS_VALID (max))
+					max += latency;
+
+				GST_OBJECT_LOCK (filter);
+				filter->reported_latency = latency;
+				GST_OBJECT_UNLOCK (filter);
+
+				GST_DEBUG_OBJECT (filter, "latency %" GST_TIME_FORMAT, GST_TIME_ARGS (latency));
+				gst_query_set_latency (query, live, min, max);
+			}
+			break;
+		}
+		default:
+			ret = gst_pad_query_default (pad, query);
+			break;
+	}
+
+	gst_object_unref (filter);
+
+	return ret;
+}
+
+/* hierarchical P: with two layers every other frame is T1, with three
+ * the pattern is T0 T2 T1 T2. T0 refers to the last T0, the upper layers
+ * to the last picture of a lower layer, and the top layer is not used
+ * as a reference.
+ */
+static int temporal_layer(Gstcedarh264enc *cedarelement, int gop_pos)
+{
+	switch (cedarelement->temporal_layers) {
+		case 3:
+			return gop_pos % 4 == 0 ? 0 : gop_pos % 2 == 0 ? 1 : 2;
+		case 2:
+			return gop_pos % 2;
+		default:
+			return 0;
+	}
+}
+
+/* pick the reference and the reconstruct buffer of the next picture,
+ * returns its temporal layer
+ */
+static int start_picture(Gstcedarh264enc *cedarelement, Gstcedarh264stream *stream)
+{
+	int layer = temporal_layer(cedarelement, stream->gop_pos);
+	int i, l;
+
+	if (stream->gop_pos == 0) {
+		stream->frame_num = 0;
+		for (l = 0; l < CEDAR_MAX_TEMPORAL_LAYERS; l++)
+			stream->ref_slot[l] = -1;
+		stream->ltr_slot = -1;
+	}
+
+	stream->nal_ref = layer == 0 || layer < cedarelement->temporal_layers - 1;
+
+	// the most recent picture of the layers below, T0 uses T0
+	stream->ref_rec = -1;
+	for (l = 0; l < MAX(layer, 1); l++) {
+		i = stream->ref_slot[l];
+		if (i >= 0 && (stream->ref_rec < 0 || stream->rec_pos[i] > stream->rec_pos[stream->ref_rec]))
+			stream->ref_rec = i;
+	}
+
+	// the IDR frame is the first long-term reference
+	stream->ltr_refresh = ltr_enabled(cedarelement) &&
+		stream->gop_pos % cedarelement->ltr_interval == 0;
+
+	if (stream->ltr_slot >= 0 && stream->ref_rec != stream->ltr_slot &&
+			prefer_ltr(cedarelement, stream)) {
+		GST_DEBUG_OBJECT(stream->srcpad, "frame %d refers to the long-term reference",
+			stream->gop_pos);
+		stream->ref_rec = stream->ltr_slot;
+		stream->ltr_refs++;
+	}
+
+	// any buffer no layer still refers to
+	for (i = 0; i < stream->num_rec; i++) {
+		for (l = 0; l < CEDAR_MAX_TEMPORAL_LAYERS; l++)
+			if (stream->ref_slot[l] == i)
+				break;
+		if (l == CEDAR_MAX_TEMPORAL_LAYERS && i != stream->ltr_slot)
+			break;
+	}
+	stream->cur_rec = i;
+
+	return layer;
+}
+
+/* encode the picture in the stream's input buffer */
+static GstBuffer *encode_frame(Gstcedarh264enc *filter, Gstcedarh264stream *stream,
+	GstBuffer *buf, GstClockTime *encode_time)
+{
+	GstBuffer *outbuf;
+	GstClockTime start;
+	int rec, ref, layer, output_size;
+
+	if (stream->gop_pos >= filter->keyframe_interval)
+		stream->gop_pos = 0;
+
+	layer = start_picture(filter, stream);
+
+	// the VE may be shared with other streams, keep it until the output is read
+	if (ve_get(VE_ENGINE_AVC, filter))
+		filter->sram_dirty = TRUE;
+
+	if (stream->reg_prog_len == 0)
+		build_reg_prog(stream);
+	ve_write_regs(stream->reg_prog, stream->reg_prog_len);
+
+	// the QP may change from frame to frame in the second pass
+	ve_write_reg(0x00040000 | stream->frame_qp << 8 | stream->frame_qp, VE_AVC_QP);
+
+	// the shadow puts the programmed input back for the next copied frame
+	if (stream->index == 0 && filter->input_phys) {
+		ve_write_reg(filter->input_phys, VE_ISP_INPUT_LUMA);
+		ve_write_reg(filter->input_phys + (filter->input.chroma - filter->input.luma),
+			VE_ISP_INPUT_CHROMA);
+	}
+
+	// all layers use the default lists, Main and Baseline ignore them
+	if (filter->sram_dirty && stream->profile_idc >= 100) {
+		load_scaling_lists(filter->ve_regs);
+		filter->sram_dirty = FALSE;
+	}
+
+	writel(0x0, filter->ve_regs + VE_AVC_VLE_OFFSET);
+
+	stream->num_nals = 0;
+
+	put_nal_start(filter, stream);
+	put_aud(filter->ve_regs);
+	put_rbsp_trailing_bits(filter->ve_regs);
+
+	// reference output
+	rec = stream->cur_rec;
+	ref = stream->ref_rec;
+	ve_write_reg(ve_virt2phys(stream->reconstruct_buf[rec]), VE_AVC_REC_LUMA);
+	ve_write_reg(ve_virt2phys(stream->reconstruct_buf[rec]) + stream->tile_w * stream->tile_h, VE_AVC_REC_CHROMA);
+	ve_write_reg(ve_virt2phys(stream->small_luma_buf[rec]), VE_AVC_REC_SLUMA);
+
+	// reference input
+	if (stream->gop_pos != 0) {
+		ve_write_reg(ve_virt2phys(stream->reconstruct_buf[ref]), VE_AVC_REF_LUMA);
+		ve_write_reg(ve_virt2phys(stream->reconstruct_buf[ref]) + stream->tile_w * stream->tile_h, VE_AVC_REF_CHROMA);
+		ve_write_reg(ve_virt2phys(stream->small_luma_buf[ref]), VE_AVC_REF_SLUMA);
+	}
+
+	if (stream->gop_pos == 0)
+	{
+		put_nal_start(filter, stream);
+		put_seq_parameter_set(filter, stream);
+		put_rbsp_trailing_bits(filter->ve_regs);
+
+		put_nal_start(filter, stream);
+		put_pic_parameter_set(filter, stream);
+		put_rbsp_trailing_bits(filter->ve_regs);
+	}
+
+	put_nal_start(filter, stream);
+	put_slice_header(filter, stream);
+
+	// status bits are write-1-to-clear and were cleared after the last frame
+	writel(0x7, filter->ve_regs + VE_AVC_STATUS);
+
+	// parameters
+	ve_write_reg(avc_param(stream), VE_AVC_PARAM);
+
+	start = gst_util_get_timestamp();
+	writel(0x8, filter->ve_regs + VE_AVC_TRIGGER);
+	ve_wait(1);
+	*encode_time += gst_util_get_timestamp() - start;
+
+	writel(readl(filter->ve_regs + VE_AVC_STATUS), filter->ve_regs + VE_AVC_STATUS);
+
+	output_size = MIN(readl(filter->ve_regs + VE_AVC_VLE_LENGTH) / 8, CEDAR_OUTPUT_BUF_SIZE);
+	ve_put();
+
+	// drop old cached data, only what is read
+	ve_invalidate_cache(stream->output_buf, output_size);
+
+	if (filter->activity)
+		stream->activity_event = activity_event(filter, stream, rec, buf);
+
+	if (stream->avc) {
+		outbuf = make_avc_buffer(filter, stream, output_size);
+	} else {
+		// TODO: use gst_pad_alloc_buffer
+		outbuf = gst_buffer_new_and_alloc(output_size);
+		memcpy(GST_BUFFER_DATA(outbuf), stream->output_buf, GST_BUFFER_SIZE(outbuf));
+	}
+	gst_buffer_set_caps(outbuf, GST_PAD_CAPS(stream->srcpad));
+	gst_buffer_copy_metadata(outbuf, buf, GST_BUFFER_COPY_TIMESTAMPS);
+	if (!GST_BUFFER_DURATION_IS_VALID(outbuf))
+		GST_BUFFER_DURATION(outbuf) = frame_duration(filter);
+	if (GST_BUFFER_IS_DISCONT(buf))
+		GST_BUFFER_FLAG_SET(outbuf, GST_BUFFER_FLAG_DISCONT);
+	if (stream->gop_pos != 0)
+		GST_BUFFER_FLAG_SET(outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+	if (layer & 1)
+		GST_BUFFER_FLAG_SET(outbuf, GST_BUFFER_FLAG_MEDIA1);
+	if (layer & 2)
+		GST_BUFFER_FLAG_SET(outbuf, GST_BUFFER_FLAG_MEDIA2);
+
+	if (stream->nal_ref) {
+		stream->ref_slot[layer] = rec;
+		stream->rec_pos[rec] = stream->gop_pos;
+		stream->rec_frame_num[rec] = stream->frame_num;
+		stream->frame_num++;
+	}
+
+	if (stream->ltr_refresh) {
+		if (!stream->ltr_means)
+			stream->ltr_means = g_malloc(block_means_size(filter));
+		memcpy(stream->ltr_means, block_means(filter, FALSE), block_means_size(filter));
+		stream->ltr_slot = rec;
+	}
+
+	if (stream->gop_pos == 0)
+		stream->idr_pic_id++;
+	stream->gop_pos++;
+
+	return outbuf;
+}
+
+/* time to the first frame, with the caps arriving and the VE time of the
+ * frame itself, to tell a slow start of the pipeline from one of ours
+ */
+static void first_frame_done(Gstcedarh264enc *cedarelement, GstClockTime encode_time)
+{
+	GstClockTime now = gst_util_get_timestamp();
+
+	GST_OBJECT_LOCK(cedarelement);
+	cedarelement->first_frame_time = now - cedarelement->start_time;
+	GST_OBJECT_UNLOCK(cedarelement);
+
+	GST_INFO_OBJECT(cedarelement, "first frame after %" GST_TIME_FORMAT " (caps after %"
+		GST_TIME_FORMAT ", VE %" GST_TIME_FORMAT ")",
+		GST_TIME_ARGS(cedarelement->first_frame_time), GST_TIME_ARGS(cedarelement->caps_time),
+		GST_TIME_ARGS(encode_time));
+
+	cedarelement->start_time = GST_CLOCK_TIME_NONE;
+}
+
+/* chain function
+ * this function does the actual processing
+ */
+static GstFlowReturn
+gst_cedarh264enc_chain (GstPad * pad, GstBuffer * buf)
+{
+	Gstcedarh264enc *filter;
+	Gstcedarh264stream *base, *stream;
+	GstBuffer *outbuf[CEDAR_MAX_STREAMS];
+	GstClockTime encode_time = 0, start;
+	GstFlowReturn ret = GST_FLOW_NOT_LINKED, flow;
+	gboolean post_latency, encode = FALSE, cut = FALSE;
+	int i;
+
+	filter = GST_CEDAR_H264ENC (GST_OBJECT_PARENT (pad));
+	base = filter->streams[0];
+
+	if (!filter->width) {
+		GST_ERROR("No input caps");
+		gst_buffer_unref(buf);
+		return GST_FLOW_NOT_NEGOTIATED;
+	}
+
+	if (!GST_BUFFER_DATA(buf)) {
+		// TODO: needed?
+		GST_WARNING("Received empty buffer");
+		for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+			if (!filter->streams[i])
+				continue;
+
+			outbuf[i] = gst_buffer_new();
+			gst_buffer_set_caps(outbuf[i], GST_PAD_CAPS(filter->streams[i]->srcpad));
+			gst_buffer_copy_metadata(outbuf[i], buf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS);
+			gst_pad_push (filter->streams[i]->srcpad, outbuf[i]);
+		}
+
+		gst_buffer_unref(buf);
+		return GST_FLOW_OK;
+	}
+
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+		outbuf[i] = NULL;
+		stream = filter->streams[i];
+		if (!stream)
+			continue;
+
+		// pads requested since the last caps
+		if (!stream->configured && !configure_stream(filter, stream)) {
+			gst_buffer_unref(buf);
+			return GST_FLOW_ERROR;
+		}
+
+		// drop before the VE sees it, the next encoded frame references the last one.
+		// Both passes of a two-pass encode have to see the same frames, they never drop.
+		if (filter->pass != 0 || !qos_drop(filter, stream, buf)) {
+			outbuf[i] = buf;
+			encode = TRUE;
+		}
+	}
+
+	if (!encode) {
+		gst_buffer_unref(buf);
+		return GST_FLOW_OK;
+	}
+
+	// upload once into the base layer, the other layers are scaled from there
+	if (!input_in_place(filter, buf)) {
+		start = gst_util_get_timestamp();
+
+		if (!filter->input_tiled)
+			upload(filter, buf);
+		else if (!upload_tiled(filter, buf)) {
+			gst_buffer_unref(buf);
+			return GST_FLOW_ERROR;
+		}
+
+		ve_flush_cache(base->input_buf, input_buf_size(base));
+		filter->denoise_valid = TRUE;
+
+		GST_OBJECT_LOCK(filter);
+		filter->upload_time += gst_util_get_timestamp() - start;
+		filter->upload_frames++;
+		GST_OBJECT_UNLOCK(filter);
+	} else {
+		filter->denoise_valid = FALSE;
+	}
+
+	if (filter->scene_threshold > 0 || ltr_enabled(filter)) {
+		start = gst_util_get_timestamp();
+		update_block_means(filter);
+		cut = filter->scene_threshold > 0 && scene_cut(filter);
+
+		GST_OBJECT_LOCK(filter);
+		filter->scene_time += gst_util_get_timestamp() - start;
+		filter->scene_frames++;
+		GST_OBJECT_UNLOCK(filter);
+	}
+
+	// start a new GOP on cuts, unless the last IDR frame is too recent
+	if (cut) {
+		filter->scene_cuts++;
+		for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+			stream = filter->streams[i];
+			if (!outbuf[i] || stream->gop_pos < filter->min_keyframe_interval)
+				continue;
+
+			GST_DEBUG_OBJECT(stream->srcpad, "scene cut, IDR after %d frames", stream->gop_pos);
+			stream->gop_pos = 0;
+		}
+	}
+
+	// the second pass plans the base layer only. There is no rate control
+	// per layer, every layer is coded at that QP plus its pad's qp-offset.
+	if (filter->pass == 2)
+		filter->frame_qp = twopass_next_qp(&filter->twopass);
+	else
+		filter->frame_qp = filter->qp;
+
+	// all layers back to back, then push
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+		if (!outbuf[i])
+			continue;
+
+		stream = filter->streams[i];
+		if (i != 0)
+			scale_input(filter, stream);
+
+		stream->frame_qp = CLAMP(filter->frame_qp +
+			GST_CEDAR_H264ENC_PAD(stream->srcpad)->qp_offset, 0, 51);
+		outbuf[i] = encode_frame(filter, stream, buf, &encode_time);
+	}
+
+	if (outbuf[0] && filter->pass == 1)
+		twopass_write(&filter->twopass, !GST_BUFFER_FLAG_IS_SET(outbuf[0], GST_BUFFER_FLAG_DELTA_UNIT),
+			base->frame_qp, GST_BUFFER_SIZE(outbuf[0]));
+	else if (outbuf[0] && filter->pass == 2)
+		twopass_update(&filter->twopass, GST_BUFFER_SIZE(outbuf[0]));
+
+	// running average of the VE time, reported as latency
+	GST_OBJECT_LOCK(filter);
+	if (GST_CLOCK_TIME_IS_VALID(filter->encode_time))
+		filter->encode_time = (7 * filter->encode_time + encode_time) / 8;
+	else
+		filter->encode_time = encode_time;
+	post_latency = GST_CLOCK_TIME_IS_VALID(filter->reported_latency)
+		&& filter->encode_time > filter->reported_latency;
+	if (post_latency)
+		filter->reported_latency = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK(filter);
+
+	// ask the pipeline to requery, we take longer than announced
+	if (post_latency)
+		gst_element_post_message(GST_ELEMENT(filter),
+			gst_message_new_latency(GST_OBJECT(filter)));
+
+	if (GST_CLOCK_TIME_IS_VALID(filter->switch_start)) {
+		GST_INFO_OBJECT(filter, "switched to %dx%d in %" GST_TIME_FORMAT,
+			filter->width, filter->height,
+			GST_TIME_ARGS(gst_util_get_timestamp() - filter->switch_start));
+		filter->switch_start = GST_CLOCK_TIME_NONE;
+	}
+
+	gst_buffer_unref(buf);
+
+	// the layers are independent, an unlinked one doesn't stop the others
+	for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+		if (!outbuf[i])
+			continue;
+
+		stream = filter->streams[i];
+		if (stream->activity_event) {
+			gst_pad_push_event (stream->srcpad, stream->activity_event);
+			stream->activity_event = NULL;
+		}
+
+		flow = gst_pad_push (stream->srcpad, outbuf[i]);
+		if (ret == GST_FLOW_NOT_LINKED || (flow != GST_FLOW_NOT_LINKED && flow < ret))
+			ret = flow;
+	}
+
+	if (GST_CLOCK_TIME_IS_VALID(filter->start_time))
+		first_frame_done(filter, encode_time);
+
+	return ret;
+}
+
+/* open the statistics of a two-pass encode, the first pass writes them
+ * and the second plans the QP of every frame from them
+ */
+static gboolean start_pass(Gstcedarh264enc *cedarelement)
+{
+	struct twopass *tp = &cedarelement->twopass;
+
+	twopass_close(tp);
+
+	if (cedarelement->pass == 1 && !twopass_create(tp, cedarelement->stats_file, cedarelement->qp)) {
+		GST_ELEMENT_ERROR(cedarelement, RESOURCE, OPEN_WRITE, (NULL),
+			("Cannot write %s", cedarelement->stats_file));
+		return FALSE;
+	}
+
+	if (cedarelement->pass == 2) {
+		if (cedarelement->target_size == 0) {
+			GST_ELEMENT_ERROR(cedarelement, RESOURCE, SETTINGS, (NULL),
+				("The second pass needs a target-size"));
+			return FALSE;
+		}
+
+		if (!twopass_plan(tp, cedarelement->stats_file, cedarelement->target_size)) {
+			GST_ELEMENT_ERROR(cedarelement, RESOURCE, OPEN_READ, (NULL),
+				("Cannot read first pass statistics from %s", cedarelement->stats_file));
+			return FALSE;
+		}
+
+		GST_INFO_OBJECT(cedarelement, "planned %" G_GUINT64_FORMAT " bytes over %d frames",
+			cedarelement->target_size, tp->num_frames);
+	}
+
+	return TRUE;
+}
+
+static GstStateChangeReturn
+	gst_cedarh264enc_change_state (GstElement *element, GstStateChange transition)
 {
 	GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
 	Gstcedarh264enc *cedarelement = GST_CEDAR_H264ENC(element);
-	
+	Gstcedarh264stream *stream;
+	int i;
+
 	switch(transition) {
 		case GST_STATE_CHANGE_NULL_TO_READY:
+			cedarelement->start_time = gst_util_get_timestamp();
+
 			if (!ve_open()) {
 				GST_ERROR("Cannot open VE");
 				return GST_STATE_CHANGE_FAILURE;
 			}
-			
+
+			// the next NULL_TO_READY finds it open and skips the setup
+			if (cedarelement->persistent_ve && !ve_keep_open())
+				GST_WARNING_OBJECT(cedarelement, "Cannot keep the VE open");
+
 			cedarelement->ve_regs = ve_get_regs();
 
 			if (!cedarelement->ve_regs) {
@@ -563,9 +2691,29 @@ static GstStateChangeReturn
 				ve_close();
 				return GST_STATE_CHANGE_FAILURE;
 			}
-			
+
 			break;
 		case GST_STATE_CHANGE_READY_TO_PAUSED:
+			if (!GST_CLOCK_TIME_IS_VALID(cedarelement->start_time))
+				cedarelement->start_time = gst_util_get_timestamp();
+			cedarelement->caps_time = GST_CLOCK_TIME_NONE;
+			GST_OBJECT_LOCK(cedarelement);
+			cedarelement->first_frame_time = GST_CLOCK_TIME_NONE;
+			GST_OBJECT_UNLOCK(cedarelement);
+			gst_segment_init(&cedarelement->segment, GST_FORMAT_TIME);
+			g_free(cedarelement->scene_luma);
+			cedarelement->scene_luma = NULL;
+			cedarelement->scene_time = 0;
+			cedarelement->scene_frames = 0;
+			cedarelement->scene_cuts = 0;
+			cedarelement->denoise_valid = FALSE;
+			cedarelement->upload_time = 0;
+			cedarelement->upload_frames = 0;
+			reset_qos(cedarelement);
+			cedarelement->encode_time = GST_CLOCK_TIME_NONE;
+			cedarelement->reported_latency = GST_CLOCK_TIME_NONE;
+			if (!start_pass(cedarelement))
+				return GST_STATE_CHANGE_FAILURE;
 			break;
 		case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 			break;
@@ -573,7 +2721,7 @@ static GstStateChangeReturn
 			// silence compiler warning...
 			break;
 	}
-	
+
 	ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
 	if (ret == GST_STATE_CHANGE_FAILURE)
 		return ret;
@@ -582,37 +2730,52 @@ static GstStateChangeReturn
 		case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 			break;
 		case GST_STATE_CHANGE_PAUSED_TO_READY:
-			if (cedarelement->mb_info_buf) {
-				ve_free(cedarelement->mb_info_buf);
-				cedarelement->mb_info_buf = NULL;
-			}
-			
-			if (cedarelement->small_luma_buf) {
-				ve_free(cedarelement->small_luma_buf);
-				cedarelement->small_luma_buf = NULL;
-			}
-			
-			if (cedarelement->reconstruct_buf) {
-				ve_free(cedarelement->reconstruct_buf);
-				cedarelement->reconstruct_buf = NULL;
+			if (cedarelement->scene_frames > 0)
+				GST_INFO_OBJECT(cedarelement, "%d scene cuts in %d frames, average detection time %"
+					GST_TIME_FORMAT, cedarelement->scene_cuts, cedarelement->scene_frames,
+					GST_TIME_ARGS(cedarelement->scene_time / cedarelement->scene_frames));
+			if (cedarelement->upload_frames > 0)
+				GST_INFO_OBJECT(cedarelement, "average upload time %" GST_TIME_FORMAT
+					" with denoise %d", GST_TIME_ARGS(cedarelement->upload_time /
+					cedarelement->upload_frames), cedarelement->denoise);
+			if (cedarelement->pass == 2)
+				GST_INFO_OBJECT(cedarelement, "second pass: %" G_GINT64_FORMAT " bytes in %d frames, "
+					"%" G_GINT64_FORMAT " planned", cedarelement->twopass.actual,
+					cedarelement->twopass.pos, cedarelement->twopass.planned);
+			twopass_close(&cedarelement->twopass);
+			for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+				if (!cedarelement->streams[i])
+					continue;
+
+				if (ltr_enabled(cedarelement))
+					GST_INFO_OBJECT(cedarelement->streams[i]->srcpad,
+						"%d frames predicted from the long-term reference",
+						cedarelement->streams[i]->ltr_refs);
+				cedarelement->streams[i]->ltr_refs = 0;
+
+				free_stream_bufs(cedarelement->streams[i]);
+				cedarelement->streams[i]->configured = FALSE;
 			}
-			
-			if (cedarelement->input_buf) {
-				ve_free(cedarelement->input_buf);
-				cedarelement->input_buf = NULL;
-			}
-			
-			if (cedarelement->output_buf) {
-				ve_free(cedarelement->output_buf);
-				cedarelement->output_buf = NULL;
-			}
-			writel(0x00130007, cedarelement->ve_regs + VE_CTRL);
-			
+			cedarelement->start_time = GST_CLOCK_TIME_NONE;
+			ve_get(VE_ENGINE_NONE, NULL);
+			ve_put();
+
 			break;
 		case GST_STATE_CHANGE_READY_TO_NULL:
 			cedarelement->width = cedarelement->height = 0;
-			cedarelement->tile_w = cedarelement->tile_w2 = cedarelement->tile_h = cedarelement->tile_h2 = 0;
-			cedarelement->mb_w = cedarelement->mb_h = cedarelement->plane_size = 0;
+			for (i = 0; i < CEDAR_MAX_STREAMS; i++) {
+				stream = cedarelement->streams[i];
+				if (!stream)
+					continue;
+
+				stream->width = stream->height = 0;
+				stream->tile_w = stream->tile_w2 = stream->tile_h = stream->tile_h2 = 0;
+				stream->mb_w = stream->mb_h = stream->plane_size = 0;
+				if (stream->codec_data) {
+					gst_buffer_unref(stream->codec_data);
+					stream->codec_data = NULL;
+				}
+			}
 			cedarelement->ve_regs = NULL;
 			ve_close();
 			break;
@@ -620,40 +2783,6 @@ static GstStateChangeReturn
 			// silence compiler warning...
 			break;
 	}
-	
-	return ret;
-}
-
-/* entry point to initialize the plug-in */
-static gboolean
-cedar_h264enc_init (GstPlugin * cedar_h264enc)
-{
-  // debug category for fltering log messages
-  GST_DEBUG_CATEGORY_INIT (gst_cedarh264enc_debug, "cedar_h264enc",
-      0, "CedarX H264 Encoder");
 
-  return gst_element_register (cedar_h264enc, "cedar_h264enc", GST_RANK_NONE,
-      GST_TYPE_CEDAR_H264ENC);
+	return ret;
 }
-
-/* PACKAGE: this is usually set by autotools depending on some _INIT macro
- * in configure.ac and then written into and defined in config.h, but we can
- * just set it ourselves here in case someone doesn't use autotools to
- * compile this code. GST_PLUGIN_DEFINE needs PACKAGE to be defined.
- */
-#ifndef PACKAGE
-#define PACKAGE "myfirstcedar_h264enc"
-#endif
-
-// gstreamer looks for this structure to register cedar_h264encs
-GST_PLUGIN_DEFINE (
-    GST_VERSION_MAJOR,
-    GST_VERSION_MINOR,
-    "cedar_h264enc",
-    "CedarX H264 Encoder",
-    cedar_h264enc_init,
-    VERSION,
-    "LGPL",
-    "Sunxi",
-    "http://github.com/ebutera/gst-plugin-cedar"
-)
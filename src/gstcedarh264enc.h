@@ -32,6 +32,10 @@
 #include <gst/gst.h>
 #include <gst/video/video.h>
 
+#include "scale.h"
+#include "twopass.h"
+#include "ve.h"
+
 G_BEGIN_DECLS
 
 /* #defines don't like whitespacey bits */
@@ -46,25 +50,71 @@ G_BEGIN_DECLS
 #define GST_IS_CEDAR_H264ENC_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_CEDAR_H264ENC))
 
+#define GST_TYPE_CEDAR_H264ENC_PAD \
+  (gst_cedarh264enc_pad_get_type())
+#define GST_CEDAR_H264ENC_PAD(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_CEDAR_H264ENC_PAD,Gstcedarh264encPad))
+
+/* NALs per access unit: AUD, SPS, PPS and slice */
+#define CEDAR_MAX_NALS	8
+
+/* registers that only change with the stream configuration */
+#define CEDAR_MAX_REG_PROG	16
+
+/* simulcast layers, including the always src pad */
+#define CEDAR_MAX_STREAMS	4
+
+/* hierarchical P layers per stream */
+#define CEDAR_MAX_TEMPORAL_LAYERS	3
+
+/* reconstruct buffers: the current picture and the references, two
+ * short-term ones with three temporal layers or one and the long-term one
+ */
+#define CEDAR_MAX_REC		3
+
+/* temporal layer of an encoded buffer, kept in the media flags. Buffers
+ * of the upper layers can be dropped without breaking the layers below.
+ */
+#define GST_CEDAR_BUFFER_TEMPORAL_LAYER(buf) \
+	((GST_BUFFER_FLAG_IS_SET((buf), GST_BUFFER_FLAG_MEDIA1) ? 1 : 0) | \
+	 (GST_BUFFER_FLAG_IS_SET((buf), GST_BUFFER_FLAG_MEDIA2) ? 2 : 0))
+
 typedef struct _Gstcedarh264enc      Gstcedarh264enc;
 typedef struct _Gstcedarh264encClass Gstcedarh264encClass;
+typedef struct _Gstcedarh264stream   Gstcedarh264stream;
+typedef struct _Gstcedarh264encPad      Gstcedarh264encPad;
+typedef struct _Gstcedarh264encPadClass Gstcedarh264encPadClass;
 
-struct _Gstcedarh264enc
+/* a src pad, with the settings of its layer as properties */
+struct _Gstcedarh264encPad
 {
-	GstElement element;
+	GstPad pad;
+	int qp_offset;		// added to the QP of every frame
+};
 
-	GstPad *sinkpad, *srcpad;
+struct _Gstcedarh264encPadClass
+{
+	GstPadClass parent_class;
+};
+
+/* one encoded output, the always src pad at input size or a requested
+ * src_%d pad encoding a downscaled copy of the input
+ */
+struct _Gstcedarh264stream
+{
+	GstPad *srcpad;
+	int index;
+	gboolean configured;	// negotiated and buffers allocated for the input caps
 
-	gboolean silent;
-  
 	int width;
 	int height;
-  
-	void *ve_regs;
+	int par_n;
+	int par_d;
+
 	void *input_buf;
 	void *output_buf;
-	void* reconstruct_buf;
-	void* small_luma_buf;
+	void* reconstruct_buf[CEDAR_MAX_REC];
+	void* small_luma_buf[CEDAR_MAX_REC];
 	void* mb_info_buf;
 	int tile_w;
 	int tile_w2;
@@ -73,6 +123,116 @@ struct _Gstcedarh264enc
 	int mb_w;
 	int mb_h;
 	int plane_size;
+	int num_rec;
+	int cur_rec;		// written by the current picture
+	int ref_rec;		// referenced by the current picture, -1 for IDR
+
+	int output_buf_size;
+	int input_buf_size;
+	int reconstruct_buf_size[CEDAR_MAX_REC];
+	int small_luma_buf_size[CEDAR_MAX_REC];
+	int mb_info_buf_size;
+
+	uint8_t *scale_tmp;	// scratch for downscaling the input
+
+	uint8_t *activity_luma;		// last two detiled small luma pictures
+	int activity_cur;
+	gboolean activity_valid;	// the other picture is the previous frame
+	GstEvent *activity_event;	// pushed ahead of the encoded frame
+
+	struct ve_reg reg_prog[CEDAR_MAX_REG_PROG];
+	int reg_prog_len;	// 0 when the programme has to be rebuilt
+
+	int profile_idc;
+	gboolean entropy_coding_mode_flag;
+	gboolean transform_8x8_mode_flag;
+
+	gboolean avc;
+	GstBuffer *codec_data;
+	int nal_offset[CEDAR_MAX_NALS];
+	int num_nals;
+
+	int frame_qp;		// the element's frame QP plus the pad's qp-offset
+	int gop_pos;
+	int idr_pic_id;
+	int frame_num;
+	gboolean nal_ref;	// the current picture is a reference
+	int ref_slot[CEDAR_MAX_TEMPORAL_LAYERS];	// last reference of each layer, -1 for none
+	int rec_pos[CEDAR_MAX_REC];		// gop_pos of the picture in each slot
+	int rec_frame_num[CEDAR_MAX_REC];
+	int ltr_slot;		// long-term reference, -1 for none
+	gboolean ltr_refresh;	// the current picture becomes the long-term reference
+	uint8_t *ltr_means;	// input block means of the long-term reference
+	int ltr_refs;		// pictures predicted from it
+
+	GstClockTime earliest_time;	// QoS of this pad
+};
+
+struct _Gstcedarh264enc
+{
+	GstElement element;
+
+	GstPad *sinkpad;
+
+	gboolean silent;
+  
+	int width;
+	int height;
+	int fps_num;
+	int fps_den;
+	int par_n;
+	int par_d;
+	int colour_primaries;
+  
+	void *ve_regs;
+	gboolean sram_dirty;	// scaling lists have to be reloaded
+
+	struct nv12_image input;	// current frame, the base layer input or in place
+	uint32_t input_phys;		// 0 unless encoded in place
+	gboolean input_tiled;		// ST12, 32x32 tiled NV12
+
+	Gstcedarh264stream *streams[CEDAR_MAX_STREAMS];
+
+	int num_ref_frames;
+	int keyframe_interval;
+	int temporal_layers;
+	int ltr_interval;
+	gboolean activity;
+	gboolean activity_thumbnail;
+
+	int qp;				// fixed, or of the first pass
+	int pass;			// 0 single pass, 1 writes statistics, 2 uses them
+	gchar *stats_file;
+	guint64 target_size;		// bytes of the base layer in the second pass
+	struct twopass twopass;
+	int frame_qp;			// of the frame being encoded
+
+	int denoise;			// strength, 0 is off
+	gboolean denoise_valid;		// the input buffer holds the previous frame
+	uint8_t *denoise_strip;		// a detiled row of tiles
+	int denoise_strip_size;
+	GstClockTime upload_time;	// spent copying the input since READY
+	int upload_frames;
+
+	int scene_threshold;		// 0 disables scene cut detection
+	int min_keyframe_interval;
+	uint8_t *scene_luma;		// block means of the last two frames
+	int scene_cur;
+	gboolean scene_valid;		// the other picture is the previous frame
+	GstClockTime scene_time;	// spent detecting since READY
+	int scene_frames;
+	int scene_cuts;
+
+	GstSegment segment;
+	GstClockTime encode_time;
+	GstClockTime reported_latency;
+	GstClockTime switch_start;
+
+	gboolean warm_up;
+	gboolean persistent_ve;
+	GstClockTime start_time;	// leaving NULL or READY, until the first frame
+	GstClockTime caps_time;		// from start_time
+	GstClockTime first_frame_time;
 };
 
 struct _Gstcedarh264encClass 
@@ -81,6 +241,7 @@ struct _Gstcedarh264encClass
 };
 
 GType gst_cedarh264enc_get_type (void);
+GType gst_cedarh264enc_pad_get_type (void);
 
 G_END_DECLS
 
@@ -0,0 +1,654 @@
+/*
+ * H.264 parameter set and slice header parser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Only what the VE doesn't do itself: the parameter sets, and the slice
+ * header up to slice_data() so the decoder knows the reference handling
+ * and how many bits the VE has to skip. Headers are parsed from an
+ * unescaped copy, bit counts are in RBSP bits like the VE counts them.
+ */
+
+#include <string.h>
+#include "h264.h"
+
+/* slice headers with all the optional parts fit comfortably */
+#define MAX_HEADER_SIZE	1024
+
+struct bit_reader
+{
+	uint8_t data[MAX_HEADER_SIZE];
+	int size;		// in bits
+	int pos;
+	int error;
+};
+
+static const uint8_t zigzag_4x4[16] = {
+	0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15
+};
+
+static const uint8_t zigzag_8x8[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* Table 7-3 and 7-4, in zigzag order */
+static const uint8_t default_4x4[2][16] = {
+	{ 6, 13, 13, 20, 20, 20, 28, 28, 28, 28, 32, 32, 32, 37, 37, 42 },
+	{ 10, 14, 14, 20, 20, 20, 24, 24, 24, 24, 27, 27, 27, 30, 30, 34 }
+};
+
+static const uint8_t default_8x8[2][64] = {
+	{  6, 10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23,
+	  23, 23, 23, 23, 23, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27,
+	  27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31, 31, 31, 31, 31,
+	  31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42 },
+	{  9, 13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21,
+	  21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 24, 24, 24, 24,
+	  24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27,
+	  27, 28, 28, 28, 28, 28, 30, 30, 30, 30, 32, 32, 32, 33, 33, 35 }
+};
+
+/* copy the NAL without emulation_prevention_three_bytes */
+static void init_reader(struct bit_reader *br, const uint8_t *nal, int size)
+{
+	int i, n = 0, zeros = 0;
+
+	for (i = 0; i < size && n < MAX_HEADER_SIZE; i++) {
+		if (zeros >= 2 && nal[i] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+
+		zeros = nal[i] == 0x00 ? zeros + 1 : 0;
+		br->data[n++] = nal[i];
+	}
+
+	br->size = n * 8;
+	br->pos = 0;
+	br->error = 0;
+}
+
+static uint32_t get_u(struct bit_reader *br, int num)
+{
+	uint32_t x = 0;
+
+	if (br->pos + num > br->size) {
+		br->error = 1;
+		br->pos = br->size;
+		return 0;
+	}
+
+	while (num--) {
+		x = x << 1 | ((br->data[br->pos / 8] >> (7 - br->pos % 8)) & 0x1);
+		br->pos++;
+	}
+
+	return x;
+}
+
+static uint32_t get_ue(struct bit_reader *br)
+{
+	int leading_zeros = 0;
+
+	while (get_u(br, 1) == 0 && !br->error)
+		if (++leading_zeros > 31) {
+			br->error = 1;
+			return 0;
+		}
+
+	return ((1u << leading_zeros) - 1) + get_u(br, leading_zeros);
+}
+
+static int32_t get_se(struct bit_reader *br)
+{
+	uint32_t x = get_ue(br);
+
+	return x & 0x1 ? (int32_t)((x + 1) / 2) : -(int32_t)(x / 2);
+}
+
+/* 7.2, anything left before rbsp_trailing_bits() */
+static int more_rbsp_data(struct bit_reader *br)
+{
+	int last = br->size - 1;
+
+	while (last >= 0 && !((br->data[last / 8] >> (7 - last % 8)) & 0x1))
+		last--;
+
+	return br->pos < last;
+}
+
+/* 7.3.2.1.1.1, returns 1 if the default list has to be used */
+static int get_scaling_list(struct bit_reader *br, uint8_t *list, int size, const uint8_t *zigzag)
+{
+	int last_scale = 8, next_scale = 8;
+	int j;
+
+	for (j = 0; j < size; j++) {
+		if (next_scale != 0) {
+			next_scale = (last_scale + get_se(br) + 256) % 256;
+			if (j == 0 && next_scale == 0)
+				return 1;
+		}
+
+		list[zigzag[j]] = next_scale == 0 ? last_scale : next_scale;
+		last_scale = list[zigzag[j]];
+	}
+
+	return 0;
+}
+
+static void set_default_list(uint8_t *list, const uint8_t *def, int size, const uint8_t *zigzag)
+{
+	int j;
+
+	for (j = 0; j < size; j++)
+		list[zigzag[j]] = def[j];
+}
+
+static void default_lists(uint8_t list_4x4[6][16], uint8_t list_8x8[2][64])
+{
+	int i;
+
+	for (i = 0; i < 6; i++)
+		set_default_list(list_4x4[i], default_4x4[i / 3], 16, zigzag_4x4);
+	for (i = 0; i < 2; i++)
+		set_default_list(list_8x8[i], default_8x8[i], 64, zigzag_8x8);
+}
+
+/* the scaling matrix syntax shared by SPS and PPS. fallback_4x4 and
+ * fallback_8x8 are what the first intra and inter lists fall back to,
+ * the defaults for the SPS (rule A) and the SPS lists for a PPS (rule B).
+ */
+static void get_scaling_matrix(struct bit_reader *br, int num_8x8,
+	uint8_t list_4x4[6][16], uint8_t list_8x8[2][64],
+	const uint8_t fallback_4x4[6][16], const uint8_t fallback_8x8[2][64])
+{
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (get_u(br, 1)) {
+			if (get_scaling_list(br, list_4x4[i], 16, zigzag_4x4))
+				set_default_list(list_4x4[i], default_4x4[i / 3], 16, zigzag_4x4);
+		} else if (i == 0 || i == 3) {
+			memcpy(list_4x4[i], fallback_4x4[i], 16);
+		} else {
+			memcpy(list_4x4[i], list_4x4[i - 1], 16);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (i < num_8x8 && get_u(br, 1)) {
+			if (get_scaling_list(br, list_8x8[i], 64, zigzag_8x8))
+				set_default_list(list_8x8[i], default_8x8[i], 64, zigzag_8x8);
+		} else {
+			memcpy(list_8x8[i], fallback_8x8[i], 64);
+		}
+	}
+}
+
+int h264_parse_sps(struct h264_sps *sps, int *id, const uint8_t *nal, int size)
+{
+	struct bit_reader br;
+	uint8_t def_4x4[6][16], def_8x8[2][64];
+	int i, sps_id;
+
+	init_reader(&br, nal, size);
+	memset(sps, 0, sizeof(*sps));
+
+	get_u(&br, 8);				// NAL header
+	sps->profile_idc = get_u(&br, 8);
+	get_u(&br, 8);				// constraint_set flags
+	sps->level_idc = get_u(&br, 8);
+	sps_id = get_ue(&br);
+
+	sps->chroma_format_idc = 1;
+	sps->bit_depth_luma = 8;
+	sps->bit_depth_chroma = 8;
+	memset(sps->scaling_list_4x4, 16, sizeof(sps->scaling_list_4x4));
+	memset(sps->scaling_list_8x8, 16, sizeof(sps->scaling_list_8x8));
+
+	switch (sps->profile_idc) {
+	case 100: case 110: case 122: case 244: case 44:
+	case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+		sps->chroma_format_idc = get_ue(&br);
+		if (sps->chroma_format_idc == 3)
+			get_u(&br, 1);		// separate_colour_plane_flag
+		sps->bit_depth_luma = get_ue(&br) + 8;
+		sps->bit_depth_chroma = get_ue(&br) + 8;
+		get_u(&br, 1);			// qpprime_y_zero_transform_bypass_flag
+		sps->seq_scaling_matrix_present_flag = get_u(&br, 1);
+		if (sps->seq_scaling_matrix_present_flag) {
+			// only 4:2:0 is supported, so there are never more than two 8x8 lists
+			default_lists(def_4x4, def_8x8);
+			get_scaling_matrix(&br, 2, sps->scaling_list_4x4, sps->scaling_list_8x8,
+				(const uint8_t (*)[16])def_4x4, (const uint8_t (*)[64])def_8x8);
+		}
+		break;
+	}
+
+	if (sps->chroma_format_idc != 1 || sps->bit_depth_luma != 8 || sps->bit_depth_chroma != 8)
+		return 0;
+
+	sps->log2_max_frame_num = get_ue(&br) + 4;
+	sps->pic_order_cnt_type = get_ue(&br);
+	if (sps->pic_order_cnt_type == 0) {
+		sps->log2_max_pic_order_cnt_lsb = get_ue(&br) + 4;
+	} else if (sps->pic_order_cnt_type == 1) {
+		sps->delta_pic_order_always_zero_flag = get_u(&br, 1);
+		sps->offset_for_non_ref_pic = get_se(&br);
+		sps->offset_for_top_to_bottom_field = get_se(&br);
+		sps->num_ref_frames_in_pic_order_cnt_cycle = get_ue(&br);
+		if (sps->num_ref_frames_in_pic_order_cnt_cycle > 255)
+			return 0;
+		for (i = 0; i < sps->num_ref_frames_in_pic_order_cnt_cycle; i++)
+			sps->offset_for_ref_frame[i] = get_se(&br);
+	} else if (sps->pic_order_cnt_type != 2) {
+		return 0;
+	}
+
+	sps->max_num_ref_frames = get_ue(&br);
+	get_u(&br, 1);				// gaps_in_frame_num_value_allowed_flag
+	sps->pic_width_in_mbs = get_ue(&br) + 1;
+	sps->pic_height_in_map_units = get_ue(&br) + 1;
+	sps->frame_mbs_only_flag = get_u(&br, 1);
+	if (!sps->frame_mbs_only_flag)
+		sps->mb_adaptive_frame_field_flag = get_u(&br, 1);
+	sps->direct_8x8_inference_flag = get_u(&br, 1);
+
+	if (get_u(&br, 1)) {
+		int crop_unit_y = 2 * (2 - sps->frame_mbs_only_flag);
+
+		sps->crop_left = get_ue(&br) * 2;
+		sps->crop_right = get_ue(&br) * 2;
+		sps->crop_top = get_ue(&br) * crop_unit_y;
+		sps->crop_bottom = get_ue(&br) * crop_unit_y;
+	}
+
+	// the VUI isn't needed
+
+	if (br.error || sps_id >= H264_MAX_SPS || sps->log2_max_frame_num > 16
+			|| sps->log2_max_pic_order_cnt_lsb > 16 || sps->max_num_ref_frames > 16)
+		return 0;
+
+	*id = sps_id;
+	return 1;
+}
+
+int h264_parse_pps(struct h264_pps *pps, int *id, struct h264_sps *const *sps_list,
+	const uint8_t *nal, int size)
+{
+	struct bit_reader br;
+	const struct h264_sps *sps;
+	uint8_t def_4x4[6][16], def_8x8[2][64];
+	int pps_id;
+
+	init_reader(&br, nal, size);
+	memset(pps, 0, sizeof(*pps));
+
+	get_u(&br, 8);				// NAL header
+	pps_id = get_ue(&br);
+	pps->sps_id = get_ue(&br);
+	if (pps_id >= H264_MAX_PPS || pps->sps_id >= H264_MAX_SPS || !sps_list[pps->sps_id])
+		return 0;
+	sps = sps_list[pps->sps_id];
+
+	pps->entropy_coding_mode_flag = get_u(&br, 1);
+	pps->bottom_field_pic_order_in_frame_present_flag = get_u(&br, 1);
+	pps->num_slice_groups = get_ue(&br) + 1;
+	if (pps->num_slice_groups > 1)
+		return 0;			// FMO, the VE doesn't do it
+
+	pps->num_ref_idx_l0_default_active = get_ue(&br) + 1;
+	pps->num_ref_idx_l1_default_active = get_ue(&br) + 1;
+	pps->weighted_pred_flag = get_u(&br, 1);
+	pps->weighted_bipred_idc = get_u(&br, 2);
+	pps->pic_init_qp = get_se(&br) + 26;
+	get_se(&br);				// pic_init_qs_minus26
+	pps->chroma_qp_index_offset = get_se(&br);
+	pps->deblocking_filter_control_present_flag = get_u(&br, 1);
+	pps->constrained_intra_pred_flag = get_u(&br, 1);
+	pps->redundant_pic_cnt_present_flag = get_u(&br, 1);
+
+	memcpy(pps->scaling_list_4x4, sps->scaling_list_4x4, sizeof(pps->scaling_list_4x4));
+	memcpy(pps->scaling_list_8x8, sps->scaling_list_8x8, sizeof(pps->scaling_list_8x8));
+	pps->second_chroma_qp_index_offset = pps->chroma_qp_index_offset;
+
+	if (more_rbsp_data(&br)) {
+		pps->transform_8x8_mode_flag = get_u(&br, 1);
+		pps->pic_scaling_matrix_present_flag = get_u(&br, 1);
+		if (pps->pic_scaling_matrix_present_flag) {
+			// rule A without an SPS matrix, rule B with one
+			if (sps->seq_scaling_matrix_present_flag) {
+				memcpy(def_4x4, sps->scaling_list_4x4, sizeof(def_4x4));
+				memcpy(def_8x8, sps->scaling_list_8x8, sizeof(def_8x8));
+			} else {
+				default_lists(def_4x4, def_8x8);
+			}
+			get_scaling_matrix(&br, pps->transform_8x8_mode_flag ? 2 : 0,
+				pps->scaling_list_4x4, pps->scaling_list_8x8,
+				(const uint8_t (*)[16])def_4x4, (const uint8_t (*)[64])def_8x8);
+		}
+		pps->second_chroma_qp_index_offset = get_se(&br);
+	}
+
+	if (br.error || pps->num_ref_idx_l0_default_active > H264_MAX_REFS
+			|| pps->num_ref_idx_l1_default_active > H264_MAX_REFS)
+		return 0;
+
+	*id = pps_id;
+	return 1;
+}
+
+static int get_ref_pic_list_modification(struct bit_reader *br, struct h264_slice *sh, int list)
+{
+	int idc;
+
+	sh->num_ref_mods[list] = 0;
+	if (!get_u(br, 1))
+		return 1;
+
+	while ((idc = get_ue(br)) != 3) {
+		if (idc > 3 || sh->num_ref_mods[list] > H264_MAX_REFS || br->error)
+			return 0;
+
+		sh->ref_mods[list][sh->num_ref_mods[list]].idc = idc;
+		sh->ref_mods[list][sh->num_ref_mods[list]].value = get_ue(br);
+		sh->num_ref_mods[list]++;
+	}
+
+	return 1;
+}
+
+static void get_pred_weight_table(struct bit_reader *br, struct h264_slice *sh, int num_lists)
+{
+	int list, i, j;
+
+	sh->luma_log2_weight_denom = get_ue(br);
+	sh->chroma_log2_weight_denom = get_ue(br);
+
+	for (list = 0; list < num_lists; list++) {
+		for (i = 0; i < sh->num_ref_idx_active[list]; i++) {
+			sh->luma_weight[list][i] = 1 << sh->luma_log2_weight_denom;
+			sh->luma_offset[list][i] = 0;
+			if (get_u(br, 1)) {
+				sh->luma_weight[list][i] = get_se(br);
+				sh->luma_offset[list][i] = get_se(br);
+			}
+
+			for (j = 0; j < 2; j++) {
+				sh->chroma_weight[list][i][j] = 1 << sh->chroma_log2_weight_denom;
+				sh->chroma_offset[list][i][j] = 0;
+			}
+			if (get_u(br, 1)) {
+				for (j = 0; j < 2; j++) {
+					sh->chroma_weight[list][i][j] = get_se(br);
+					sh->chroma_offset[list][i][j] = get_se(br);
+				}
+			}
+		}
+	}
+}
+
+static int get_dec_ref_pic_marking(struct bit_reader *br, struct h264_slice *sh)
+{
+	struct h264_mmco *m;
+
+	sh->num_mmcos = 0;
+
+	if (sh->nal_unit_type == H264_NAL_IDR_SLICE) {
+		sh->no_output_of_prior_pics_flag = get_u(br, 1);
+		sh->long_term_reference_flag = get_u(br, 1);
+		return 1;
+	}
+
+	sh->adaptive_ref_pic_marking_mode_flag = get_u(br, 1);
+	if (!sh->adaptive_ref_pic_marking_mode_flag)
+		return 1;
+
+	while (1) {
+		if (sh->num_mmcos >= H264_MAX_MMCO || br->error)
+			return 0;
+
+		m = &sh->mmcos[sh->num_mmcos];
+		memset(m, 0, sizeof(*m));
+		m->op = get_ue(br);
+		if (m->op == 0)
+			break;
+		if (m->op > 6)
+			return 0;
+
+		if (m->op == 1 || m->op == 3)
+			m->difference_of_pic_nums_minus1 = get_ue(br);
+		if (m->op == 2)
+			m->long_term_pic_num = get_ue(br);
+		if (m->op == 3 || m->op == 6)
+			m->long_term_frame_idx = get_ue(br);
+		if (m->op == 4)
+			m->max_long_term_frame_idx_plus1 = get_ue(br);
+
+		sh->num_mmcos++;
+	}
+
+	return 1;
+}
+
+int h264_parse_slice_header(struct h264_slice *sh, struct h264_sps *const *sps_list,
+	struct h264_pps *const *pps_list, const uint8_t *nal, int size)
+{
+	struct bit_reader br;
+	const struct h264_sps *sps;
+	const struct h264_pps *pps;
+	int p, b;
+
+	init_reader(&br, nal, size);
+	memset(sh, 0, sizeof(*sh));
+
+	sh->nal_ref_idc = (br.data[0] >> 5) & 0x3;
+	sh->nal_unit_type = br.data[0] & 0x1f;
+	get_u(&br, 8);
+
+	sh->first_mb_in_slice = get_ue(&br);
+	sh->slice_type = get_ue(&br) % 5;
+	sh->pps_id = get_ue(&br);
+	if (sh->pps_id >= H264_MAX_PPS || !pps_list[sh->pps_id])
+		return 0;
+	pps = pps_list[sh->pps_id];
+	sps = sps_list[pps->sps_id];
+	if (!sps)
+		return 0;
+
+	p = sh->slice_type == H264_SLICE_P || sh->slice_type == H264_SLICE_SP;
+	b = sh->slice_type == H264_SLICE_B;
+
+	sh->frame_num = get_u(&br, sps->log2_max_frame_num);
+	if (!sps->frame_mbs_only_flag) {
+		sh->field_pic_flag = get_u(&br, 1);
+		if (sh->field_pic_flag)
+			sh->bottom_field_flag = get_u(&br, 1);
+	}
+
+	if (sh->nal_unit_type == H264_NAL_IDR_SLICE)
+		sh->idr_pic_id = get_ue(&br);
+
+	if (sps->pic_order_cnt_type == 0) {
+		sh->pic_order_cnt_lsb = get_u(&br, sps->log2_max_pic_order_cnt_lsb);
+		if (pps->bottom_field_pic_order_in_frame_present_flag && !sh->field_pic_flag)
+			sh->delta_pic_order_cnt_bottom = get_se(&br);
+	}
+
+	if (sps->pic_order_cnt_type == 1 && !sps->delta_pic_order_always_zero_flag) {
+		sh->delta_pic_order_cnt[0] = get_se(&br);
+		if (pps->bottom_field_pic_order_in_frame_present_flag && !sh->field_pic_flag)
+			sh->delta_pic_order_cnt[1] = get_se(&br);
+	}
+
+	if (pps->redundant_pic_cnt_present_flag)
+		get_ue(&br);			// redundant_pic_cnt
+
+	if (b)
+		sh->direct_spatial_mv_pred_flag = get_u(&br, 1);
+
+	sh->num_ref_idx_active[0] = pps->num_ref_idx_l0_default_active;
+	sh->num_ref_idx_active[1] = pps->num_ref_idx_l1_default_active;
+	if (p || b) {
+		if (get_u(&br, 1)) {
+			sh->num_ref_idx_active[0] = get_ue(&br) + 1;
+			if (b)
+				sh->num_ref_idx_active[1] = get_ue(&br) + 1;
+		}
+		if (sh->num_ref_idx_active[0] > H264_MAX_REFS || sh->num_ref_idx_active[1] > H264_MAX_REFS)
+			return 0;
+	}
+
+	sh->num_ref_mods[0] = sh->num_ref_mods[1] = 0;
+	if (p || b)
+		if (!get_ref_pic_list_modification(&br, sh, 0))
+			return 0;
+	if (b)
+		if (!get_ref_pic_list_modification(&br, sh, 1))
+			return 0;
+
+	if ((pps->weighted_pred_flag && p) || (pps->weighted_bipred_idc == 1 && b))
+		get_pred_weight_table(&br, sh, b ? 2 : 1);
+
+	sh->num_mmcos = 0;
+	if (sh->nal_ref_idc != 0)
+		if (!get_dec_ref_pic_marking(&br, sh))
+			return 0;
+
+	if (pps->entropy_coding_mode_flag && (p || b))
+		sh->cabac_init_idc = get_ue(&br);
+
+	sh->slice_qp_delta = get_se(&br);
+
+	if (sh->slice_type == H264_SLICE_SP || sh->slice_type == H264_SLICE_SI) {
+		if (sh->slice_type == H264_SLICE_SP)
+			get_u(&br, 1);		// sp_for_switch_flag
+		get_se(&br);			// slice_qs_delta
+	}
+
+	if (pps->deblocking_filter_control_present_flag) {
+		sh->disable_deblocking_filter_idc = get_ue(&br);
+		if (sh->disable_deblocking_filter_idc != 1) {
+			sh->slice_alpha_c0_offset_div2 = get_se(&br);
+			sh->slice_beta_offset_div2 = get_se(&br);
+		}
+	}
+
+	if (br.error)
+		return 0;
+
+	sh->header_bits = br.pos - 8;
+	return 1;
+}
+
+void h264_compute_poc(struct h264_poc_state *s, const struct h264_sps *sps,
+	const struct h264_slice *sh, int has_mmco5, int *top, int *bottom)
+{
+	int idr = sh->nal_unit_type == H264_NAL_IDR_SLICE;
+	int max_frame_num = 1 << sps->log2_max_frame_num;
+	int frame_num_offset = 0;
+	int i;
+
+	if (sps->pic_order_cnt_type == 0) {
+		int max_lsb = 1 << sps->log2_max_pic_order_cnt_lsb;
+		int lsb = sh->pic_order_cnt_lsb;
+		int msb;
+
+		if (idr) {
+			s->prev_poc_msb = 0;
+			s->prev_poc_lsb = 0;
+		}
+
+		if (lsb < s->prev_poc_lsb && s->prev_poc_lsb - lsb >= max_lsb / 2)
+			msb = s->prev_poc_msb + max_lsb;
+		else if (lsb > s->prev_poc_lsb && lsb - s->prev_poc_lsb > max_lsb / 2)
+			msb = s->prev_poc_msb - max_lsb;
+		else
+			msb = s->prev_poc_msb;
+
+		*top = msb + lsb;
+		*bottom = *top + sh->delta_pic_order_cnt_bottom;
+
+		if (sh->nal_ref_idc != 0) {
+			s->prev_poc_msb = msb;
+			s->prev_poc_lsb = lsb;
+		}
+	} else {
+		if (!idr) {
+			frame_num_offset = s->prev_has_mmco5 ? 0 : s->prev_frame_num_offset;
+			if (s->prev_frame_num > sh->frame_num)
+				frame_num_offset += max_frame_num;
+		}
+
+		if (sps->pic_order_cnt_type == 1) {
+			int cycle = sps->num_ref_frames_in_pic_order_cnt_cycle;
+			int abs_frame_num = cycle != 0 ? frame_num_offset + sh->frame_num : 0;
+			int expected = 0;
+
+			if (sh->nal_ref_idc == 0 && abs_frame_num > 0)
+				abs_frame_num--;
+
+			if (abs_frame_num > 0) {
+				int delta_per_cycle = 0;
+
+				for (i = 0; i < cycle; i++)
+					delta_per_cycle += sps->offset_for_ref_frame[i];
+
+				expected = ((abs_frame_num - 1) / cycle) * delta_per_cycle;
+				for (i = 0; i <= (abs_frame_num - 1) % cycle; i++)
+					expected += sps->offset_for_ref_frame[i];
+			}
+
+			if (sh->nal_ref_idc == 0)
+				expected += sps->offset_for_non_ref_pic;
+
+			*top = expected + sh->delta_pic_order_cnt[0];
+			*bottom = *top + sps->offset_for_top_to_bottom_field + sh->delta_pic_order_cnt[1];
+		} else {
+			if (idr)
+				*top = 0;
+			else if (sh->nal_ref_idc == 0)
+				*top = 2 * (frame_num_offset + sh->frame_num) - 1;
+			else
+				*top = 2 * (frame_num_offset + sh->frame_num);
+			*bottom = *top;
+		}
+	}
+
+	s->prev_frame_num = sh->frame_num;
+	s->prev_frame_num_offset = frame_num_offset;
+	s->prev_has_mmco5 = has_mmco5;
+
+	// 8.2.1: after memory_management_control_operation 5 the picture
+	// counts as having POC 0 and frame_num 0 for the ones that follow
+	if (has_mmco5) {
+		int tmp = *top < *bottom ? *top : *bottom;
+
+		*top -= tmp;
+		*bottom -= tmp;
+		s->prev_poc_msb = 0;
+		s->prev_poc_lsb = *top;
+		s->prev_frame_num = 0;
+	}
+}
@@ -0,0 +1,176 @@
+/*
+ * H.264 parameter set and slice header parser
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __H264_H__
+#define __H264_H__
+
+#include <stdint.h>
+
+#define H264_NAL_SLICE		1
+#define H264_NAL_IDR_SLICE	5
+#define H264_NAL_SPS		7
+#define H264_NAL_PPS		8
+
+#define H264_SLICE_P		0
+#define H264_SLICE_B		1
+#define H264_SLICE_I		2
+#define H264_SLICE_SP		3
+#define H264_SLICE_SI		4
+
+#define H264_MAX_SPS		32
+#define H264_MAX_PPS		256
+#define H264_MAX_REFS		32
+#define H264_MAX_MMCO		66
+
+struct h264_sps
+{
+	int profile_idc;
+	int level_idc;
+	int chroma_format_idc;
+	int bit_depth_luma;
+	int bit_depth_chroma;
+	int seq_scaling_matrix_present_flag;
+	uint8_t scaling_list_4x4[6][16];	// raster order
+	uint8_t scaling_list_8x8[2][64];
+	int log2_max_frame_num;
+	int pic_order_cnt_type;
+	int log2_max_pic_order_cnt_lsb;
+	int delta_pic_order_always_zero_flag;
+	int offset_for_non_ref_pic;
+	int offset_for_top_to_bottom_field;
+	int num_ref_frames_in_pic_order_cnt_cycle;
+	int offset_for_ref_frame[256];
+	int max_num_ref_frames;
+	int pic_width_in_mbs;
+	int pic_height_in_map_units;
+	int frame_mbs_only_flag;
+	int mb_adaptive_frame_field_flag;
+	int direct_8x8_inference_flag;
+	int crop_left;				// in pixels
+	int crop_right;
+	int crop_top;
+	int crop_bottom;
+};
+
+struct h264_pps
+{
+	int sps_id;
+	int entropy_coding_mode_flag;
+	int bottom_field_pic_order_in_frame_present_flag;
+	int num_slice_groups;
+	int num_ref_idx_l0_default_active;
+	int num_ref_idx_l1_default_active;
+	int weighted_pred_flag;
+	int weighted_bipred_idc;
+	int pic_init_qp;
+	int chroma_qp_index_offset;
+	int deblocking_filter_control_present_flag;
+	int constrained_intra_pred_flag;
+	int redundant_pic_cnt_present_flag;
+	int transform_8x8_mode_flag;
+	int pic_scaling_matrix_present_flag;
+	int second_chroma_qp_index_offset;
+	uint8_t scaling_list_4x4[6][16];	// SPS lists with the PPS applied
+	uint8_t scaling_list_8x8[2][64];
+};
+
+struct h264_ref_mod
+{
+	int idc;
+	int value;
+};
+
+struct h264_mmco
+{
+	int op;
+	int difference_of_pic_nums_minus1;
+	int long_term_pic_num;
+	int long_term_frame_idx;
+	int max_long_term_frame_idx_plus1;
+};
+
+struct h264_slice
+{
+	int nal_ref_idc;
+	int nal_unit_type;
+	int header_bits;			// RBSP bits up to slice_data()
+
+	int first_mb_in_slice;
+	int slice_type;
+	int pps_id;
+	int frame_num;
+	int field_pic_flag;
+	int bottom_field_flag;
+	int idr_pic_id;
+	int pic_order_cnt_lsb;
+	int delta_pic_order_cnt_bottom;
+	int delta_pic_order_cnt[2];
+	int direct_spatial_mv_pred_flag;
+	int num_ref_idx_active[2];
+
+	int num_ref_mods[2];
+	struct h264_ref_mod ref_mods[2][H264_MAX_REFS + 1];
+
+	int luma_log2_weight_denom;
+	int chroma_log2_weight_denom;
+	int16_t luma_weight[2][H264_MAX_REFS];
+	int16_t luma_offset[2][H264_MAX_REFS];
+	int16_t chroma_weight[2][H264_MAX_REFS][2];
+	int16_t chroma_offset[2][H264_MAX_REFS][2];
+
+	int no_output_of_prior_pics_flag;
+	int long_term_reference_flag;
+	int adaptive_ref_pic_marking_mode_flag;
+	int num_mmcos;
+	struct h264_mmco mmcos[H264_MAX_MMCO];
+
+	int cabac_init_idc;
+	int slice_qp_delta;
+	int disable_deblocking_filter_idc;
+	int slice_alpha_c0_offset_div2;
+	int slice_beta_offset_div2;
+};
+
+/* picture order count state carried from picture to picture (8.2.1) */
+struct h264_poc_state
+{
+	int prev_poc_msb;
+	int prev_poc_lsb;
+	int prev_frame_num;
+	int prev_frame_num_offset;
+	int prev_has_mmco5;
+};
+
+/* nal points to the NAL header byte, size excludes any start code.
+ * All return 0 on malformed or unsupported input.
+ */
+int h264_parse_sps(struct h264_sps *sps, int *id, const uint8_t *nal, int size);
+int h264_parse_pps(struct h264_pps *pps, int *id, struct h264_sps *const *sps_list,
+	const uint8_t *nal, int size);
+int h264_parse_slice_header(struct h264_slice *sh, struct h264_sps *const *sps_list,
+	struct h264_pps *const *pps_list, const uint8_t *nal, int size);
+
+/* POC of a frame from its first slice, updates the state */
+void h264_compute_poc(struct h264_poc_state *s, const struct h264_sps *sps,
+	const struct h264_slice *sh, int has_mmco5, int *top, int *bottom);
+
+#endif
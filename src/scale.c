@@ -0,0 +1,164 @@
+/*
+ * NV12 downscaler for simulcast layers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Pictures are first halved with a 2x2 box filter as long as they are at
+ * least twice the target size, the rest is done bilinearly. That keeps
+ * the bilinear step from skipping source pixels, and 1080p -> 540p/270p
+ * never gets there at all.
+ */
+
+#include <string.h>
+#include "scale.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/* halve one row pair, bpp is 1 for luma and 2 for interleaved chroma */
+static void halve_row(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int width, int bpp)
+{
+	int x = 0, c;
+
+#ifdef __ARM_NEON__
+	if (bpp == 1) {
+		for (; x + 16 <= width; x += 16) {
+			uint16x8_t lo = vaddq_u16(vpaddlq_u8(vld1q_u8(s0 + 2 * x)), vpaddlq_u8(vld1q_u8(s1 + 2 * x)));
+			uint16x8_t hi = vaddq_u16(vpaddlq_u8(vld1q_u8(s0 + 2 * x + 16)), vpaddlq_u8(vld1q_u8(s1 + 2 * x + 16)));
+			vst1q_u8(d + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+		}
+	} else {
+		for (; x + 8 <= width; x += 8) {
+			uint8x16x2_t a = vld2q_u8(s0 + 4 * x);
+			uint8x16x2_t b = vld2q_u8(s1 + 4 * x);
+			uint8x8x2_t out;
+			out.val[0] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])), 2);
+			out.val[1] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+			vst2_u8(d + 2 * x, out);
+		}
+	}
+#endif
+
+	for (; x < width; x++)
+		for (c = 0; c < bpp; c++)
+			d[x * bpp + c] = (s0[2 * x * bpp + c] + s0[(2 * x + 1) * bpp + c]
+				+ s1[2 * x * bpp + c] + s1[(2 * x + 1) * bpp + c] + 2) >> 2;
+}
+
+/* d may alias s if it has the same stride, rows are consumed before
+ * they are overwritten
+ */
+static void halve_plane(const uint8_t *s, int s_stride, uint8_t *d, int d_stride,
+	int width, int height, int bpp)
+{
+	int y;
+
+	for (y = 0; y < height; y++)
+		halve_row(s + 2 * y * s_stride, s + (2 * y + 1) * s_stride, d + y * d_stride, width, bpp);
+}
+
+/* 16.16 source position of the centre of destination pixel i */
+static int src_pos(int i, int step)
+{
+	int pos = i * step + step / 2 - 0x8000;
+
+	return pos < 0 ? 0 : pos;
+}
+
+static void bilinear_plane(const uint8_t *s, int s_width, int s_height, int s_stride,
+	uint8_t *d, int d_width, int d_height, int d_stride, int bpp)
+{
+	int x_step = ((int64_t)s_width << 16) / d_width;
+	int y_step = ((int64_t)s_height << 16) / d_height;
+	int x, y, c;
+
+	for (y = 0; y < d_height; y++) {
+		int sy = src_pos(y, y_step);
+		int y0 = sy >> 16;
+		int y1 = y0 + 1 < s_height ? y0 + 1 : y0;
+		int fy = (sy >> 8) & 0xff;
+		const uint8_t *r0 = s + y0 * s_stride;
+		const uint8_t *r1 = s + y1 * s_stride;
+		uint8_t *out = d + y * d_stride;
+
+		for (x = 0; x < d_width; x++) {
+			int sx = src_pos(x, x_step);
+			int x0 = sx >> 16;
+			int x1 = x0 + 1 < s_width ? x0 + 1 : x0;
+			int fx = (sx >> 8) & 0xff;
+
+			for (c = 0; c < bpp; c++) {
+				int a = r0[x0 * bpp + c] * (256 - fx) + r0[x1 * bpp + c] * fx;
+				int b = r1[x0 * bpp + c] * (256 - fx) + r1[x1 * bpp + c] * fx;
+				out[x * bpp + c] = (a * (256 - fy) + b * fy + 0x8000) >> 16;
+			}
+		}
+	}
+}
+
+/* scratch memory scale_nv12() needs for a source of this size */
+int scale_nv12_tmp_size(int src_width, int src_height)
+{
+	int stride = ((src_width / 2) + 15) & ~15;
+
+	return stride * (src_height / 2) + stride * (src_height / 4 + 1);
+}
+
+/* downscale src into dst, tmp must hold scale_nv12_tmp_size() bytes */
+void scale_nv12(const struct nv12_image *src, const struct nv12_image *dst, uint8_t *tmp)
+{
+	struct nv12_image cur = *src, next;
+	int stride = ((src->width / 2) + 15) & ~15;
+
+	while (cur.width >= 2 * dst->width && cur.height >= 2 * dst->height) {
+		if (cur.width / 2 == dst->width && cur.height / 2 == dst->height) {
+			next = *dst;
+		} else {
+			next.luma = tmp;
+			next.chroma = tmp + stride * (src->height / 2);
+			next.stride = stride;
+			next.width = cur.width / 2;
+			next.height = cur.height / 2;
+		}
+
+		halve_plane(cur.luma, cur.stride, next.luma, next.stride, next.width, next.height, 1);
+		halve_plane(cur.chroma, cur.stride, next.chroma, next.stride, next.width / 2, next.height / 2, 2);
+
+		if (next.luma == dst->luma)
+			return;
+		cur = next;
+	}
+
+	if (cur.width == dst->width && cur.height == dst->height) {
+		int y;
+
+		for (y = 0; y < dst->height; y++)
+			memcpy(dst->luma + y * dst->stride, cur.luma + y * cur.stride, dst->width);
+		for (y = 0; y < dst->height / 2; y++)
+			memcpy(dst->chroma + y * dst->stride, cur.chroma + y * cur.stride, dst->width);
+		return;
+	}
+
+	bilinear_plane(cur.luma, cur.width, cur.height, cur.stride,
+		dst->luma, dst->width, dst->height, dst->stride, 1);
+	bilinear_plane(cur.chroma, cur.width / 2, cur.height / 2, cur.stride,
+		dst->chroma, dst->width / 2, dst->height / 2, dst->stride, 2);
+}
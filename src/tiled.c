@@ -0,0 +1,89 @@
+/*
+ * Conversions from the VE's 32x32 tiled layout
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Tiles are 32x32 bytes, stored one after the other, a row of tiles at
+ * a time:
+ *
+ *   byte (x, y) = ((y / 32) * (stride / 32) + x / 32) * 1024 + (y % 32) * 32 + x % 32
+ */
+
+#include <string.h>
+#include "tiled.h"
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+void detile_mb32(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+	int x, int y, int width, int height)
+{
+	int row, col, n;
+
+	for (row = y; row < y + height; row++) {
+		const uint8_t *line = src + (row / 32) * src_stride * 32 + (row % 32) * 32;
+		uint8_t *out = dst + (row - y) * dst_stride;
+
+		for (col = x; col < x + width; col += n) {
+			n = 32 - col % 32;
+			if (n > x + width - col)
+				n = x + width - col;
+
+			memcpy(out + col - x, line + (col / 32) * 1024 + col % 32, n);
+		}
+	}
+}
+
+/* one tile after the other, the source is read linearly and each tile
+ * row lands in 32 destination rows at once
+ */
+void detile_mb32_plane(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+	int width, int height)
+{
+	int tx, ty, r, rows, n;
+
+	for (ty = 0; ty < height; ty += 32) {
+		const uint8_t *tile = src + ty * src_stride;
+		rows = height - ty < 32 ? height - ty : 32;
+
+		for (tx = 0; tx < width; tx += 32, tile += 1024) {
+			uint8_t *out = dst + ty * dst_stride + tx;
+			n = width - tx < 32 ? width - tx : 32;
+
+			if (n < 32) {
+				for (r = 0; r < rows; r++)
+					memcpy(out + r * dst_stride, tile + r * 32, n);
+				continue;
+			}
+
+			for (r = 0; r < rows; r++) {
+#ifdef __ARM_NEON__
+				uint8x16_t a = vld1q_u8(tile + r * 32);
+				uint8x16_t b = vld1q_u8(tile + r * 32 + 16);
+				vst1q_u8(out + r * dst_stride, a);
+				vst1q_u8(out + r * dst_stride + 16, b);
+#else
+				memcpy(out + r * dst_stride, tile + r * 32, 32);
+#endif
+			}
+		}
+	}
+}
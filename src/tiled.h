@@ -0,0 +1,41 @@
+/*
+ * Conversions from the VE's 32x32 tiled layout
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __TILED_H__
+#define __TILED_H__
+
+#include <stdint.h>
+
+/* copy width x height bytes starting at (x, y) out of a plane of 32x32
+ * tiles, src_stride bytes (a multiple of 32) wide. Works on bytes, so it
+ * handles the luma and the interleaved NV12 chroma plane alike.
+ */
+void detile_mb32(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+	int x, int y, int width, int height);
+
+/* the same for a whole plane from (0, 0), walking the source in tile
+ * order. Used to upload tiled frames straight into the encoder's input.
+ */
+void detile_mb32_plane(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+	int width, int height);
+
+#endif
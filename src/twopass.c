@@ -0,0 +1,179 @@
+/*
+ * Two-pass rate control
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twopass.h"
+
+// share of the complexity that goes into the size of a frame
+#define QCOMP			0.6
+
+// the drift from the plan is corrected by up to this many QP steps
+#define MAX_CORRECTION		4
+
+static int clamp_qp(int qp)
+{
+	return qp < TWOPASS_MIN_QP ? TWOPASS_MIN_QP : qp > TWOPASS_MAX_QP ? TWOPASS_MAX_QP : qp;
+}
+
+/* bytes a frame of size bytes at qp takes at new_qp */
+static double scale_size(double size, int qp, double new_qp)
+{
+	return size * pow(2.0, (qp - new_qp) / 6.0);
+}
+
+int twopass_create(struct twopass *tp, const char *path, int qp)
+{
+	memset(tp, 0, sizeof(*tp));
+
+	tp->file = fopen(path, "w");
+	if (!tp->file)
+		return 0;
+
+	fprintf(tp->file, "# cedar_h264enc first pass, qp %d\n# idr qp size\n", qp);
+
+	return 1;
+}
+
+void twopass_write(struct twopass *tp, int idr, int qp, int size)
+{
+	if (tp->file)
+		fprintf(tp->file, "%d %d %d\n", idr, qp, size);
+}
+
+/* QP of every frame for an offset, and their expected total */
+static double plan_qp(struct twopass *tp, const double *complexity, double offset, int round_qp)
+{
+	double total = 0.0, qp;
+	int i;
+
+	for (i = 0; i < tp->num_frames; i++) {
+		// complexity at QP 0, the planned size is complexity^QCOMP
+		qp = 6.0 * (1.0 - QCOMP) * log2(complexity[i]) + offset;
+		if (round_qp)
+			qp = clamp_qp(lrint(qp));
+		else
+			qp = qp < TWOPASS_MIN_QP ? TWOPASS_MIN_QP : qp > TWOPASS_MAX_QP ? TWOPASS_MAX_QP : qp;
+
+		total += scale_size(complexity[i], 0, qp);
+
+		if (round_qp) {
+			tp->qp[i] = qp;
+			tp->size[i] = scale_size(complexity[i], 0, qp);
+		}
+	}
+
+	return total;
+}
+
+int twopass_plan(struct twopass *tp, const char *path, int64_t target)
+{
+	double *complexity = NULL, lo = -200.0, hi = 200.0, mid;
+	int idr, qp, size, alloc = 0, i;
+	char line[128];
+	FILE *f;
+
+	memset(tp, 0, sizeof(*tp));
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%d %d %d", &idr, &qp, &size) != 3)
+			continue;
+
+		if (tp->num_frames == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			complexity = realloc(complexity, alloc * sizeof(*complexity));
+			if (!complexity)
+				break;
+		}
+
+		complexity[tp->num_frames++] = scale_size(size > 0 ? size : 1, qp, 0);
+	}
+
+	fclose(f);
+
+	if (!complexity || tp->num_frames == 0) {
+		free(complexity);
+		tp->num_frames = 0;
+		return 0;
+	}
+
+	tp->qp = malloc(tp->num_frames * sizeof(*tp->qp));
+	tp->size = malloc(tp->num_frames * sizeof(*tp->size));
+
+	// the total shrinks as the offset grows
+	for (i = 0; i < 60; i++) {
+		mid = (lo + hi) / 2.0;
+		if (plan_qp(tp, complexity, mid, 0) > target)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	plan_qp(tp, complexity, hi, 1);
+
+	free(complexity);
+
+	return 1;
+}
+
+int twopass_next_qp(struct twopass *tp)
+{
+	int qp = tp->qp[tp->pos < tp->num_frames ? tp->pos : tp->num_frames - 1];
+	double drift;
+
+	// 6 QP steps per doubling, keep what went over or under the plan
+	// from piling up towards the end
+	if (tp->planned > 0 && tp->actual > 0) {
+		drift = 6.0 * log2((double)tp->actual / tp->planned);
+		if (drift > MAX_CORRECTION)
+			drift = MAX_CORRECTION;
+		else if (drift < -MAX_CORRECTION)
+			drift = -MAX_CORRECTION;
+
+		qp += lrint(drift);
+	}
+
+	return clamp_qp(qp);
+}
+
+void twopass_update(struct twopass *tp, int size)
+{
+	tp->planned += tp->size[tp->pos < tp->num_frames ? tp->pos : tp->num_frames - 1];
+	tp->actual += size;
+	tp->pos++;
+}
+
+void twopass_close(struct twopass *tp)
+{
+	if (tp->file)
+		fclose(tp->file);
+
+	free(tp->qp);
+	free(tp->size);
+
+	memset(tp, 0, sizeof(*tp));
+}
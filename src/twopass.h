@@ -0,0 +1,61 @@
+/*
+ * Two-pass rate control
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef __TWOPASS_H__
+#define __TWOPASS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TWOPASS_MIN_QP		10
+#define TWOPASS_MAX_QP		51
+
+/* The first pass encodes at a fixed QP and writes one line per frame
+ * with its QP and size. The second pass spreads a target size over the
+ * frames from those sizes: a frame's size is taken to halve every 6 QP
+ * steps, and complex frames get a smaller share than their complexity
+ * (as with x264's qcomp) so that the quality stays about the same.
+ */
+struct twopass
+{
+	FILE *file;		// first pass statistics being written
+	int num_frames;
+	int *qp;		// planned QP per frame
+	int *size;		// expected size at that QP
+	int pos;
+	int64_t planned;	// expected size of the frames so far
+	int64_t actual;
+};
+
+/* first pass */
+int twopass_create(struct twopass *tp, const char *path, int qp);
+void twopass_write(struct twopass *tp, int idr, int qp, int size);
+
+/* second pass, 0 if the file can't be read or is empty */
+int twopass_plan(struct twopass *tp, const char *path, int64_t target);
+int twopass_next_qp(struct twopass *tp);
+void twopass_update(struct twopass *tp, int size);
+
+void twopass_close(struct twopass *tp);
+
+#endif
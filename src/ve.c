@@ -20,11 +20,17 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <stropts.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
 #include "ve.h"
+#include "vebroker.h"
 
 #define DEVICE "/dev/cedar_dev"
 #define PAGE_OFFSET (0xc0000000) // from kernel
@@ -70,6 +76,19 @@ struct cedarv_cache_range
 static int fd = -1;
 static void *regs = NULL;
 static int version = 0;
+static int ref_count = 0;
+static uint32_t reserved_phys = 0;
+static int reserved_size = 0;
+
+static pthread_mutex_t ve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int engine = VE_ENGINE_NONE;
+static const void *owner = NULL;
+
+// last value written to each register through ve_write_reg(s)
+#define SHADOW_SIZE (0x1000 / 4)
+static uint32_t shadow[SHADOW_SIZE];
+static uint8_t shadow_valid[SHADOW_SIZE];
 
 struct memchunk_t
 {
@@ -81,72 +100,528 @@ struct memchunk_t
 
 static struct memchunk_t first_memchunk = { .phys_addr = 0x0, .size = 0, .virt_addr = NULL, .next = NULL };
 
-int ve_open(void)
+int ve_mmio_hooked = 0;
+
+// access trace, see vetrace.h
+static int ve_tracing = 0;
+static struct ve_trace_record *trace_ring = NULL;
+static unsigned int trace_size = 0;	// power of two
+static unsigned int trace_next = 0;
+static struct timespec trace_start;
+static char *trace_path = NULL;
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)(ts.tv_sec - trace_start.tv_sec) * 1000000000 + (ts.tv_nsec - trace_start.tv_nsec);
+}
+
+static void trace_record(int type, uint32_t offset, uint32_t value)
+{
+	struct ve_trace_record *r = &trace_ring[__sync_fetch_and_add(&trace_next, 1) & (trace_size - 1)];
+
+	r->time = trace_now();
+	r->type = type;
+	r->offset = offset;
+	r->value = value;
+}
+
+/* the whole ring, oldest record first */
+static void trace_dump(void)
+{
+	struct ve_trace_header header;
+	unsigned int next = trace_next;
+	FILE *f;
+
+	if (!trace_ring)
+		return;
+
+	header.magic = VE_TRACE_MAGIC;
+	header.version = VE_TRACE_VERSION;
+	header.record_size = sizeof(struct ve_trace_record);
+	header.count = next < trace_size ? next : trace_size;
+	header.dropped = next - header.count;
+
+	f = fopen(trace_path, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "[VE TRACE] can't write %s\n", trace_path);
+		return;
+	}
+
+	fwrite(&header, sizeof(header), 1, f);
+	if (next > trace_size)
+	{
+		fwrite(trace_ring + (next & (trace_size - 1)), sizeof(struct ve_trace_record),
+			trace_size - (next & (trace_size - 1)), f);
+		fwrite(trace_ring, sizeof(struct ve_trace_record), next & (trace_size - 1), f);
+	}
+	else
+		fwrite(trace_ring, sizeof(struct ve_trace_record), header.count, f);
+
+	fclose(f);
+}
+
+static void trace_init(void)
+{
+	const char *path = getenv("CEDAR_VE_TRACE");
+	const char *records = getenv("CEDAR_VE_TRACE_RECORDS");
+	unsigned int size = VE_TRACE_DEFAULT_RECORDS;
+
+	if (trace_ring || !path || !*path)
+		return;
+
+	if (records && atoi(records) > 0)
+		for (size = 1; size < (unsigned int)atoi(records); size <<= 1);
+
+	trace_ring = calloc(size, sizeof(struct ve_trace_record));
+	if (!trace_ring)
+		return;
+
+	trace_size = size;
+	trace_path = strdup(path);
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+
+	// buffers may keep the VE open until the very end
+	atexit(trace_dump);
+	ve_tracing = 1;
+	ve_mmio_hooked = 1;
+}
+
+// client of cedar-ve-broker, see vebroker.h
+static int broker = -1;
+static pthread_mutex_t broker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ve_reg batch[VE_BROKER_MAX_REGS];
+static int batch_len = 0;
+
+static int is_open(void)
+{
+	return fd != -1 || broker != -1;
+}
+
+static int full_write(int s, const void *buf, int len)
+{
+	int n;
+
+	for (; len > 0; buf += n, len -= n)
+		if ((n = write(s, buf, len)) <= 0)
+			return 0;
+
+	return 1;
+}
+
+static int full_read(int s, void *buf, int len)
+{
+	int n;
+
+	for (; len > 0; buf += n, len -= n)
+		if ((n = read(s, buf, len)) <= 0)
+			return 0;
+
+	return 1;
+}
+
+/* a reply, with the file descriptor passed along with it if fd is given */
+static int recv_reply(int s, struct ve_broker_reply *reply, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = reply, .iov_len = sizeof(*reply) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg;
+
+	if (!fd)
+		return full_read(s, reply, sizeof(*reply));
+
+	*fd = -1;
+	if (recvmsg(s, &mh, MSG_WAITALL) != sizeof(*reply))
+		return 0;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return 1;
+}
+
+/* called with broker_mutex held */
+static void broker_flush_regs(void)
+{
+	struct ve_broker_msg msg = { .type = VE_BROKER_REGS, .count = batch_len };
+
+	if (batch_len == 0)
+		return;
+
+	if (full_write(broker, &msg, sizeof(msg)))
+		full_write(broker, batch, batch_len * sizeof(struct ve_reg));
+
+	batch_len = 0;
+}
+
+/* send a message after the pending register writes and wait for the
+ * reply, if reply is given. Returns 0 if the broker went away.
+ */
+static int broker_call_fd(uint32_t type, uint32_t arg0, uint32_t arg1,
+	struct ve_broker_reply *reply, int *fd)
+{
+	struct ve_broker_msg msg = { .type = type, .count = 0, .arg = { arg0, arg1 } };
+	int ret = 1;
+
+	pthread_mutex_lock(&broker_mutex);
+	broker_flush_regs();
+	if (!full_write(broker, &msg, sizeof(msg)) || (reply && !recv_reply(broker, reply, fd)))
+	{
+		if (reply)
+			memset(reply, 0, sizeof(*reply));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&broker_mutex);
+
+	return ret;
+}
+
+static int broker_call(uint32_t type, uint32_t arg0, uint32_t arg1, struct ve_broker_reply *reply)
 {
-	if (fd != -1)
+	return broker_call_fd(type, arg0, arg1, reply, NULL);
+}
+
+static int broker_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ve_broker_msg msg = { .type = VE_BROKER_HELLO, .arg = { 1, 0 } };
+	struct ve_broker_reply reply;
+	const char *weight = getenv("CEDAR_VE_BROKER_WEIGHT");
+
+	if (weight && atoi(weight) > 0)
+		msg.arg[0] = atoi(weight);
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	broker = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (broker == -1)
 		return 0;
 
+	if (connect(broker, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| !full_write(broker, &msg, sizeof(msg))
+			|| !full_read(broker, &reply, sizeof(reply))
+			|| reply.ret != VE_BROKER_VERSION)
+	{
+		close(broker);
+		broker = -1;
+		return 0;
+	}
+
+	version = reply.arg[0];
+
+	// writes land here before they are sent, reads go to the broker
+	regs = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ve_mmio_hooked = 1;
+
+	printf("[VDPAU SUNXI] VE version 0x%04x opened through %s.\n", version, path);
+
+	return 1;
+}
+
+static void broker_close(void)
+{
+	close(broker);
+	broker = -1;
+	batch_len = 0;
+
+	munmap(regs, 0x1000);
+	regs = NULL;
+	ve_mmio_hooked = ve_tracing;
+}
+
+static void *broker_malloc(int size)
+{
+	struct ve_broker_reply reply;
+	struct memchunk_t *c;
+	void *virt = MAP_FAILED;
+	int mem_fd;
+
+	// the allocation's own shared memory file comes with the reply
+	if (!broker_call_fd(VE_BROKER_ALLOC, size, 0, &reply, &mem_fd) || !reply.ret)
+	{
+		if (mem_fd != -1)
+			close(mem_fd);
+		return NULL;
+	}
+
+	if (mem_fd != -1)
+	{
+		virt = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+		close(mem_fd);
+	}
+
+	if (virt == MAP_FAILED)
+	{
+		broker_call(VE_BROKER_FREE, reply.arg[0], 0, NULL);
+		return NULL;
+	}
+
+	// first_memchunk stays empty, the broker does the bookkeeping
+	c = malloc(sizeof(struct memchunk_t));
+	c->phys_addr = reply.arg[0];
+	c->size = size;
+	c->virt_addr = virt;
+
+	pthread_mutex_lock(&mem_mutex);
+	c->next = first_memchunk.next;
+	first_memchunk.next = c;
+	pthread_mutex_unlock(&mem_mutex);
+
+	return virt;
+}
+
+static void broker_free(void *ptr)
+{
+	struct memchunk_t *c, *prev = &first_memchunk;
+
+	pthread_mutex_lock(&mem_mutex);
+	for (c = first_memchunk.next; c != NULL; prev = c, c = c->next)
+		if (c->virt_addr == ptr)
+		{
+			prev->next = c->next;
+			break;
+		}
+	pthread_mutex_unlock(&mem_mutex);
+
+	if (!c)
+		return;
+
+	munmap(ptr, c->size);
+	broker_call(VE_BROKER_FREE, c->phys_addr, 0, NULL);
+	free(c);
+}
+
+/* register accesses through writel()/readl() while hooked, anything
+ * outside the register window is left alone
+ */
+void ve_mmio_write(int type, void *addr, uint32_t val)
+{
+	uintptr_t offset = (uintptr_t)addr - (uintptr_t)regs;
+
+	if (!regs || offset >= 0x1000)
+		return;
+
+	if (broker != -1)
+	{
+		pthread_mutex_lock(&broker_mutex);
+		if (batch_len == VE_BROKER_MAX_REGS)
+			broker_flush_regs();
+		batch[batch_len].offset = offset | (type == VE_TRACE_WRITEB ? VE_BROKER_BYTE : 0);
+		batch[batch_len].value = val;
+		batch_len++;
+		pthread_mutex_unlock(&broker_mutex);
+	}
+
+	if (ve_tracing)
+		trace_record(type, offset, val);
+}
+
+uint32_t ve_mmio_read(void *addr)
+{
+	uintptr_t offset = (uintptr_t)addr - (uintptr_t)regs;
+	struct ve_broker_reply reply;
+	uint32_t val;
+
+	if (!regs || offset >= 0x1000)
+		return *((volatile uint32_t *)addr);
+
+	if (broker != -1)
+	{
+		broker_call(VE_BROKER_READ, offset, 0, &reply);
+		val = reply.ret;
+	}
+	else
+		val = *((volatile uint32_t *)addr);
+
+	if (ve_tracing)
+		trace_record(VE_TRACE_READ, offset, val);
+
+	return val;
+}
+
+static int ve_ioctl(int request, void *arg)
+{
+	uint64_t start, duration;
+	int ret;
+
+	if (!ve_tracing)
+		return ioctl(fd, request, arg);
+
+	start = trace_now();
+	ret = ioctl(fd, request, arg);
+	duration = trace_now() - start;
+
+	trace_record(VE_TRACE_IOCTL, request, duration > UINT32_MAX ? UINT32_MAX : duration);
+
+	return ret;
+}
+
+int ve_open(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&ve_mutex);
+
+	if (is_open())
+	{
+		ref_count++;
+		ret = 1;
+		goto out;
+	}
+
 	struct ve_info ve;
+	const char *broker_path = getenv("CEDAR_VE_BROKER");
+
+	trace_init();
+
+	// shared with other processes, the broker has set it up
+	if (broker_path && *broker_path)
+	{
+		if (!broker_open(broker_path))
+			goto out;
+
+		engine = VE_ENGINE_NONE;
+		owner = NULL;
+		memset(shadow_valid, 0, sizeof(shadow_valid));
+		ref_count = 1;
+		ret = 1;
+		goto out;
+	}
 
 	fd = open(DEVICE, O_RDWR);
 	if (fd == -1)
-		return 0;
+		goto out;
 
-	if (ioctl(fd, IOCTL_GET_ENV_INFO, (void *)(&ve)) == -1)
+	if (ve_ioctl(IOCTL_GET_ENV_INFO, (void *)(&ve)) == -1)
 	{
 		close(fd);
 		fd = -1;
-		return 0;
+		goto out;
 	}
 
 	regs = mmap(NULL, 0x800, PROT_READ | PROT_WRITE, MAP_SHARED, fd, ve.registers);
 	first_memchunk.phys_addr = ve.reserved_mem - PAGE_OFFSET;
 	first_memchunk.size = ve.reserved_mem_size;
+	reserved_phys = first_memchunk.phys_addr;
+	reserved_size = first_memchunk.size;
 
-	ioctl(fd, IOCTL_ENGINE_REQ, 0);
-	ioctl(fd, IOCTL_ENABLE_VE, 0);
-	ioctl(fd, IOCTL_SET_VE_FREQ, 320);
-	ioctl(fd, IOCTL_RESET_VE, 0);
+	ve_ioctl(IOCTL_ENGINE_REQ, 0);
+	ve_ioctl(IOCTL_ENABLE_VE, 0);
+	ve_ioctl(IOCTL_SET_VE_FREQ, (void *)320);
+	ve_ioctl(IOCTL_RESET_VE, 0);
 
-	writel(0x00130007, regs + VE_CTRL);
+	writel(0x00130000 | VE_ENGINE_NONE, regs + VE_CTRL);
+	engine = VE_ENGINE_NONE;
+	owner = NULL;
+	memset(shadow_valid, 0, sizeof(shadow_valid));
 
 	version = readl(regs + VE_VERSION) >> 16;
 	printf("[VDPAU SUNXI] VE version 0x%04x opened.\n", version);
 
-	return 1;
+	ref_count = 1;
+	ret = 1;
+
+out:
+	pthread_mutex_unlock(&ve_mutex);
+	return ret;
 }
 
 void ve_close(void)
 {
-	if (fd == -1)
-		return;
+	pthread_mutex_lock(&ve_mutex);
+
+	if (!is_open() || --ref_count > 0)
+		goto out;
+
+	if (broker != -1)
+	{
+		broker_close();
+		trace_dump();
+		goto out;
+	}
 
-	ioctl(fd, IOCTL_DISABLE_VE, 0);
-	ioctl(fd, IOCTL_ENGINE_REL, 0);
+	ve_ioctl(IOCTL_DISABLE_VE, 0);
+	ve_ioctl(IOCTL_ENGINE_REL, 0);
 
 	munmap(regs, 0x800);
 
 	close(fd);
 	fd = -1;
+
+	trace_dump();
+
+out:
+	pthread_mutex_unlock(&ve_mutex);
 }
 
+/* open the VE once more and never close it, so that it stays set up for
+ * the rest of the process. Only the first call takes a reference.
+ */
+int ve_keep_open(void)
+{
+	static pthread_mutex_t keep_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static int kept = 0;
+	int ret;
+
+	pthread_mutex_lock(&keep_mutex);
+	if (!kept)
+		kept = ve_open();
+	ret = kept;
+	pthread_mutex_unlock(&keep_mutex);
+
+	return ret;
+}
+
+/* memory the CPU wrote, before the VE reads it */
 void ve_flush_cache(void *start, int len)
 {
-	if (fd == -1)
+	if (!is_open())
 		return;
 
+	// by physical address, the broker copies it to the VE memory
+	if (broker != -1)
+	{
+		broker_call(VE_BROKER_FLUSH, ve_virt2phys(start), len, NULL);
+		return;
+	}
+
 	struct cedarv_cache_range range =
 	{
 		.start = (int)start,
 		.end = (int)(start + len)
 	};
 
-	ioctl(fd, IOCTL_FLUSH_CACHE, (void*)(&range));
+	ve_ioctl(IOCTL_FLUSH_CACHE, (void*)(&range));
+}
+
+/* memory the VE wrote, before the CPU reads it */
+void ve_invalidate_cache(void *start, int len)
+{
+	struct ve_broker_reply reply;
+
+	if (!is_open())
+		return;
+
+	// the broker copies it back from the VE memory
+	if (broker != -1)
+	{
+		broker_call(VE_BROKER_INVALIDATE, ve_virt2phys(start), len, &reply);
+		return;
+	}
+
+	ve_flush_cache(start, len);
 }
 
 void *ve_get_regs(void)
 {
-	if (fd == -1)
+	if (!is_open())
 		return NULL;
 
 	return regs;
@@ -159,19 +634,126 @@ int ve_get_version(void)
 
 int ve_wait(int timeout)
 {
-	if (fd == -1)
+	struct ve_broker_reply reply;
+
+	if (!is_open())
 		return 0;
 
-	return ioctl(fd, IOCTL_WAIT_VE, timeout);
+	if (broker != -1)
+	{
+		broker_call(VE_BROKER_WAIT, timeout, 0, &reply);
+		return reply.ret;
+	}
+
+	return ve_ioctl(IOCTL_WAIT_VE, (void *)(long)timeout);
+}
+
+/* lock the VE for owner and select the engine. Returns 1 if someone else
+ * used the VE since owner's last ve_get(), in which case state that
+ * isn't covered by the register shadow (SRAM tables) has to be reloaded.
+ */
+int ve_get(int new_engine, const void *new_owner)
+{
+	struct ve_broker_reply reply;
+	int changed;
+
+	pthread_mutex_lock(&ve_mutex);
+
+	changed = (owner != new_owner);
+	owner = new_owner;
+
+	// waits for the other processes, which may have changed anything
+	if (broker != -1)
+	{
+		broker_call(VE_BROKER_LOCK, new_engine, 0, &reply);
+		if (reply.ret)
+		{
+			memset(shadow_valid, 0, sizeof(shadow_valid));
+			changed = 1;
+		}
+		engine = reply.arg[0];
+	}
+
+	if (new_engine != engine)
+	{
+		writel(0x00130000 | new_engine, regs + VE_CTRL);
+		engine = new_engine;
+		memset(shadow_valid, 0, sizeof(shadow_valid));
+		changed = 1;
+	}
+
+	if (ve_tracing)
+		trace_record(VE_TRACE_GET, new_engine, changed);
+
+	return changed;
+}
+
+void ve_put(void)
+{
+	if (broker != -1)
+		broker_call(VE_BROKER_UNLOCK, 0, 0, NULL);
+
+	if (ve_tracing)
+		trace_record(VE_TRACE_PUT, 0, 0);
+
+	pthread_mutex_unlock(&ve_mutex);
+}
+
+/* write a register programme, skipping registers that already hold
+ * the value. Must be called between ve_get() and ve_put().
+ */
+void ve_write_regs(const struct ve_reg *prog, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		ve_write_reg(prog[i].value, prog[i].offset);
+}
+
+void ve_write_reg(uint32_t val, uint32_t offset)
+{
+	uint32_t i = offset / 4;
+
+	if (shadow_valid[i] && shadow[i] == val)
+		return;
+
+	writel(val, regs + offset);
+	shadow[i] = val;
+	shadow_valid[i] = 1;
+}
+
+/* last value written, read back from the hardware only once */
+uint32_t ve_read_shadow(uint32_t offset)
+{
+	uint32_t i = offset / 4;
+
+	if (!shadow_valid[i])
+	{
+		shadow[i] = readl(regs + offset);
+		shadow_valid[i] = 1;
+	}
+
+	return shadow[i];
 }
 
 void *ve_malloc(int size)
 {
-	if (fd == -1)
+	if (!is_open())
 		return NULL;
 
-	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	size = ve_malloc_size(size);
+	if (broker != -1)
+	{
+		void *ptr = broker_malloc(size);
+
+		if (ve_tracing)
+			trace_record(VE_TRACE_MALLOC, 0, ptr ? size : 0);
+		return ptr;
+	}
+
 	struct memchunk_t *c, *best_chunk = NULL;
+
+	pthread_mutex_lock(&mem_mutex);
 	for (c = &first_memchunk; c != NULL; c = c->next)
 		if(c->virt_addr == NULL && c->size >= size)
 		{
@@ -183,7 +765,12 @@ void *ve_malloc(int size)
 		}
 
 	if (!best_chunk)
+	{
+		pthread_mutex_unlock(&mem_mutex);
+		if (ve_tracing)
+			trace_record(VE_TRACE_MALLOC, 0, 0);
 		return NULL;
+	}
 
 	int left_size = best_chunk->size - size;
 
@@ -200,23 +787,83 @@ void *ve_malloc(int size)
 		best_chunk->next = c;
 	}
 
+	pthread_mutex_unlock(&mem_mutex);
+	if (ve_tracing)
+		trace_record(VE_TRACE_MALLOC, 0, size);
 	return best_chunk->virt_addr;
 }
 
+/* memory actually taken by ve_malloc(size) */
+int ve_malloc_size(int size)
+{
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+void ve_get_mem_info(struct ve_mem_info *info)
+{
+	struct memchunk_t *c;
+	int free_size = 0;
+
+	memset(info, 0, sizeof(*info));
+
+	if (broker != -1)
+	{
+		struct ve_broker_reply reply;
+
+		broker_call(VE_BROKER_MEM_INFO, 0, 0, &reply);
+		info->total = reply.arg[0];
+		info->used = reply.arg[1];
+		info->largest_free = reply.arg[2];
+		info->fragmentation = reply.arg[3];
+		return;
+	}
+
+	pthread_mutex_lock(&mem_mutex);
+	for (c = &first_memchunk; c != NULL; c = c->next)
+	{
+		info->total += c->size;
+
+		if (c->virt_addr != NULL)
+			info->used += c->size;
+		else
+		{
+			free_size += c->size;
+			if (c->size > info->largest_free)
+				info->largest_free = c->size;
+		}
+	}
+	pthread_mutex_unlock(&mem_mutex);
+
+	if (free_size > 0)
+		info->fragmentation = 100 - (int)((int64_t)info->largest_free * 100 / free_size);
+}
+
 void ve_free(void *ptr)
 {
-	if (fd == -1)
+	if (!is_open())
 		return;
 
 	if (ptr == NULL)
 		return;
 
+	if (broker != -1)
+	{
+		if (ve_tracing)
+			trace_record(VE_TRACE_FREE, 0, 0);
+		broker_free(ptr);
+		return;
+	}
+
 	struct memchunk_t *c;
+
+	pthread_mutex_lock(&mem_mutex);
 	for (c = &first_memchunk; c != NULL; c = c->next)
 		if (c->virt_addr == ptr)
 		{
 			munmap(ptr, c->size);
 			c->virt_addr = NULL;
+			if (ve_tracing)
+				trace_record(VE_TRACE_FREE, 0, c->size);
 			break;
 		}
 
@@ -229,24 +876,47 @@ void ve_free(void *ptr)
 				c->next = n->next;
 				free(n);
 			}
+	pthread_mutex_unlock(&mem_mutex);
 }
 
 uint32_t ve_virt2phys(void *ptr)
 {
-	if (fd == -1)
+	if (!is_open())
 		return 0;
 
 	struct memchunk_t *c;
+	uint32_t phys = 0;
+
+	pthread_mutex_lock(&mem_mutex);
 	for (c = &first_memchunk; c != NULL; c = c->next)
 	{
 		if (c->virt_addr == NULL)
 			continue;
 
 		if (c->virt_addr == ptr)
-			return c->phys_addr;
+		{
+			phys = c->phys_addr;
+			break;
+		}
 		else if (ptr > c->virt_addr && ptr < (c->virt_addr + c->size))
-			return c->phys_addr + (ptr - c->virt_addr);
+		{
+			phys = c->phys_addr + (ptr - c->virt_addr);
+			break;
+		}
 	}
+	pthread_mutex_unlock(&mem_mutex);
+
+	return phys;
+}
+
+int ve_get_mem_fd(uint32_t *phys, int *size, uint32_t *offset)
+{
+	if (fd == -1)
+		return -1;
+
+	*phys = reserved_phys;
+	*size = reserved_size;
+	*offset = reserved_phys + PAGE_OFFSET;
 
-	return 0;
+	return fd;
 }
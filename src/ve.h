@@ -21,30 +21,77 @@
 #define __VE_H__
 
 #include <stdint.h>
+#include "vetrace.h"
+
+#define VE_ENGINE_MPEG			0x0
+#define VE_ENGINE_H264			0x1
+#define VE_ENGINE_NONE			0x7
+#define VE_ENGINE_AVC			0xb
+
+struct ve_mem_info
+{
+	int total;		// reserved memory size
+	int used;
+	int largest_free;	// biggest allocation that can succeed
+	int fragmentation;	// percent of free memory outside the largest free block
+};
+
+struct ve_reg
+{
+	uint32_t offset;
+	uint32_t value;
+};
 
 int ve_open(void);
 void ve_close(void);
+int ve_keep_open(void);
 void ve_flush_cache(void *start, int len);
+void ve_invalidate_cache(void *start, int len);
 void *ve_get_regs(void);
 int ve_get_version(void);
 int ve_wait(int timeout);
 
+int ve_get(int engine, const void *owner);
+void ve_put(void);
+void ve_write_regs(const struct ve_reg *prog, int count);
+void ve_write_reg(uint32_t val, uint32_t offset);
+uint32_t ve_read_shadow(uint32_t offset);
+
 void *ve_malloc(int size);
+int ve_malloc_size(int size);
+void ve_get_mem_info(struct ve_mem_info *info);
 void ve_free(void *ptr);
 uint32_t ve_virt2phys(void *ptr);
 
+/* for cedar-ve-broker, the fd to map the reserved memory from */
+int ve_get_mem_fd(uint32_t *phys, int *size, uint32_t *offset);
+
+/* set when register accesses are traced (see vetrace.h) or go through
+ * the broker (see vebroker.h)
+ */
+extern int ve_mmio_hooked;
+void ve_mmio_write(int type, void *addr, uint32_t val);
+uint32_t ve_mmio_read(void *addr);
+
 static inline void writeb(uint8_t val, void *addr)
 {
 	*((volatile uint8_t *)addr) = val;
+	if (ve_mmio_hooked)
+		ve_mmio_write(VE_TRACE_WRITEB, addr, val);
 }
 
 static inline void writel(uint32_t val, void *addr)
 {
 	*((volatile uint32_t *)addr) = val;
+	if (ve_mmio_hooked)
+		ve_mmio_write(VE_TRACE_WRITE, addr, val);
 }
 
 static inline uint32_t readl(void *addr)
 {
+	if (ve_mmio_hooked)
+		return ve_mmio_read(addr);
+
 	return *((volatile uint32_t *) addr);
 }
 
@@ -109,6 +156,10 @@ static inline uint32_t readl(void *addr)
 #define VE_ISP_INPUT_LUMA		0xa78
 #define VE_ISP_INPUT_CHROMA		0xa7c
 
+/* VE_ISP_INPUT_SIZE and VE_ISP_INPUT_STRIDE values, in macroblocks */
+#define VE_ISP_SIZE(mb_w, mb_h)		((mb_w) << 16 | (mb_h))
+#define VE_ISP_STRIDE(mb_w)		((mb_w) << 16)
+
 #define VE_AVC_PARAM			0xb04
 #define VE_AVC_QP			0xb08
 #define VE_AVC_MOTION_EST		0xb10
@@ -0,0 +1,81 @@
+/*
+ * VE broker protocol
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __VEBROKER_H__
+#define __VEBROKER_H__
+
+#include <stdint.h>
+
+/* cedar-ve-broker owns the VE and lets several processes share it. With
+ * CEDAR_VE_BROKER=<socket> in the environment ve.c becomes its client:
+ *
+ * - VE memory is allocated by the broker. Every allocation comes with a
+ *   shared memory file of its own, passed with the ALLOC reply, which
+ *   the client maps instead of the VE memory. The broker copies it to
+ *   the VE memory on ve_flush_cache() and back on ve_invalidate_cache(),
+ *   clients never get the device or each other's memory.
+ * - ve_get() and ve_put() lock and unlock the VE in the broker, which
+ *   grants it to the waiting client that has used it least so far.
+ * - Register writes are collected and sent in batches, a register read,
+ *   ve_wait() or ve_put() sends what is pending first.
+ *
+ * Every message is a struct ve_broker_msg, VE_BROKER_REGS is followed by
+ * count struct ve_reg. HELLO, LOCK, READ, WAIT, ALLOC, MEM_INFO and
+ * INVALIDATE are answered with a struct ve_broker_reply, the others are
+ * not.
+ */
+
+#define VE_BROKER_VERSION	2
+#define VE_BROKER_MAX_REGS	512
+
+// in struct ve_reg offsets of byte writes
+#define VE_BROKER_BYTE		0x80000000
+
+enum ve_broker_type
+{
+	VE_BROKER_HELLO = 1,	// arg[0] = weight; ret = version, arg[0] = VE version
+	VE_BROKER_LOCK,		// arg[0] = engine; ret = 1 if someone else used the VE since, arg[0] = current engine
+	VE_BROKER_UNLOCK,
+	VE_BROKER_REGS,		// count = number of writes
+	VE_BROKER_READ,		// arg[0] = offset; ret = value
+	VE_BROKER_WAIT,		// arg[0] = timeout; ret as ve_wait()
+	VE_BROKER_FLUSH,	// arg[0] = phys, arg[1] = length; copied to the VE memory
+	VE_BROKER_ALLOC,	// arg[0] = size; ret = 1 on success, arg[0] = phys, with the fd
+	VE_BROKER_FREE,		// arg[0] = phys
+	VE_BROKER_MEM_INFO,	// arg = total, used, largest free, fragmentation
+	VE_BROKER_INVALIDATE,	// arg[0] = phys, arg[1] = length; copied from the VE memory
+};
+
+struct ve_broker_msg
+{
+	uint32_t type;
+	uint32_t count;
+	uint32_t arg[2];
+};
+
+struct ve_broker_reply
+{
+	int32_t ret;
+	uint32_t arg[4];
+};
+
+#endif
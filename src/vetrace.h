@@ -0,0 +1,70 @@
+/*
+ * VE access trace format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef __VETRACE_H__
+#define __VETRACE_H__
+
+#include <stdint.h>
+
+/* With CEDAR_VE_TRACE=<file> in the environment, ve.c records every
+ * register access, ioctl and allocation in a ring of records and writes
+ * it to <file> when the VE is closed for the last time. The ring holds
+ * CEDAR_VE_TRACE_RECORDS records (default VE_TRACE_DEFAULT_RECORDS), the
+ * oldest ones are overwritten. The file is a struct ve_trace_header
+ * followed by the records, oldest first, in host byte order.
+ */
+
+#define VE_TRACE_MAGIC			0x52544556	// "VETR"
+#define VE_TRACE_VERSION		1
+#define VE_TRACE_DEFAULT_RECORDS	(1 << 20)
+
+enum ve_trace_type
+{
+	VE_TRACE_WRITE = 1,	// offset, value
+	VE_TRACE_WRITEB,	// offset, value
+	VE_TRACE_READ,		// offset, value read
+	VE_TRACE_IOCTL,		// offset = command, value = duration in ns
+	VE_TRACE_MALLOC,	// value = size, 0 if it failed
+	VE_TRACE_FREE,		// value = size
+	VE_TRACE_GET,		// offset = engine, value = 1 if the VE changed hands
+	VE_TRACE_PUT,
+};
+
+struct ve_trace_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;		// records in the file
+	uint32_t dropped;	// overwritten before the file was written
+};
+
+struct ve_trace_record
+{
+	uint64_t time;		// ns since tracing started, after the access
+	uint16_t type;
+	uint16_t offset;	// register offset or ioctl command
+	uint32_t value;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Encoder-like load on the VE from several processes
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* cedar-ve-bench [-d seconds] [-u] -s WxH[,WxH...]
+ *   forks one process per size, each encoding IDR frames of that size the
+ *   way cedar_h264enc does: upload and flush the input, ve_get(), the
+ *   register programme, trigger, ve_wait(), read the output length and
+ *   ve_put(). Run it with CEDAR_VE_BROKER set to share the VE through
+ *   cedar-ve-broker, without it only one process can have the VE.
+ *
+ *   Prints frames per second and the ve_get() latency, the time spent
+ *   waiting for the other processes, per process. -u leaves out the
+ *   input upload, so only the VE is measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "ve.h"
+
+#define MAX_STREAMS	16
+
+struct result
+{
+	int frames;
+	uint64_t elapsed;
+	uint64_t get_total;
+	uint64_t get_max;
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int encode(int width, int height, int seconds, int upload, struct result *r)
+{
+	int mb_w = (width + 15) / 16, mb_h = (height + 15) / 16;
+	int tile_w = (width + 31) & ~31, tile_h = (height + 31) & ~31;
+	int tile_w2 = (width / 2 + 31) & ~31, tile_h2 = (height / 2 + 31) & ~31;
+	int input_size = mb_w * 16 * mb_h * 16 * 3 / 2;
+	int output_size = 1 * 1024 * 1024;
+	uint64_t start, end, t;
+	uint8_t *input, *output, *rec, *small_luma, *mb_info;
+	uint32_t in_phys, out_phys, rec_phys;
+	void *regs;
+
+	if (!ve_open())
+		return 0;
+
+	// the buffers cedar_h264enc has per stream, sized the same way
+	regs = ve_get_regs();
+	input = ve_malloc(input_size);
+	output = ve_malloc(output_size);
+	rec = ve_malloc(tile_w * tile_h + tile_w * tile_h2);
+	small_luma = ve_malloc(tile_w2 * tile_h2);
+	mb_info = ve_malloc(((mb_w + 3) & ~3) * mb_h * 8);
+	if (!input || !output || !rec || !small_luma || !mb_info)
+		return 0;
+
+	in_phys = ve_virt2phys(input);
+	out_phys = ve_virt2phys(output);
+	rec_phys = ve_virt2phys(rec);
+
+	memset(r, 0, sizeof(*r));
+	start = now();
+	end = start + seconds * 1000000000ULL;
+
+	while ((t = now()) < end)
+	{
+		if (upload)
+		{
+			memset(input, r->frames, input_size);
+			ve_flush_cache(input, input_size);
+			t = now();
+		}
+
+		ve_get(VE_ENGINE_AVC, r);
+		t = now() - t;
+		r->get_total += t;
+		if (t > r->get_max)
+			r->get_max = t;
+
+		// what build_reg_prog() sets up, the shadow skips repeats
+		ve_write_reg(out_phys, VE_AVC_VLE_ADDR);
+		ve_write_reg(out_phys + output_size - 1, VE_AVC_VLE_END);
+		ve_write_reg(0x04000000, 0xb8c);
+		ve_write_reg(VE_ISP_STRIDE(mb_w), VE_ISP_INPUT_STRIDE);
+		ve_write_reg(VE_ISP_SIZE(mb_w, mb_h), VE_ISP_INPUT_SIZE);
+		ve_write_reg(in_phys, VE_ISP_INPUT_LUMA);
+		ve_write_reg(in_phys + mb_w * 16 * mb_h * 16, VE_ISP_INPUT_CHROMA);
+		ve_write_reg(ve_virt2phys(mb_info), VE_AVC_MB_INFO);
+		ve_write_reg(ve_read_shadow(VE_AVC_CTRL) | 0xf, VE_AVC_CTRL);
+		ve_write_reg(0x00000104, VE_AVC_MOTION_EST);
+
+		// and encode_frame() for an IDR frame of the main profile
+		ve_write_reg(0x00040000 | 30 << 8 | 30, VE_AVC_QP);
+		ve_write_reg(rec_phys, VE_AVC_REC_LUMA);
+		ve_write_reg(rec_phys + tile_w * tile_h, VE_AVC_REC_CHROMA);
+		ve_write_reg(ve_virt2phys(small_luma), VE_AVC_REC_SLUMA);
+
+		writel(0x0, regs + VE_AVC_VLE_OFFSET);
+		writel(0x7, regs + VE_AVC_STATUS);
+		ve_write_reg(0x1 << 8, VE_AVC_PARAM);
+		writel(0x8, regs + VE_AVC_TRIGGER);
+		ve_wait(1);
+		writel(readl(regs + VE_AVC_STATUS), regs + VE_AVC_STATUS);
+		readl(regs + VE_AVC_VLE_LENGTH);
+
+		ve_put();
+		r->frames++;
+	}
+
+	r->elapsed = now() - start;
+
+	ve_free(mb_info);
+	ve_free(small_luma);
+	ve_free(rec);
+	ve_free(output);
+	ve_free(input);
+	ve_close();
+
+	return 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-u] -s WxH[,WxH...]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int width[MAX_STREAMS], height[MAX_STREAMS];
+	int pipes[MAX_STREAMS][2];
+	int seconds = 5, upload = 1, count = 0;
+	struct result r;
+	char *p = NULL;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:us:")) != -1)
+		switch (opt)
+		{
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'u':
+			upload = 0;
+			break;
+		case 's':
+			p = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	for (; p && *p && count < MAX_STREAMS; count++)
+	{
+		if (sscanf(p, "%dx%d", &width[count], &height[count]) != 2
+				|| width[count] <= 0 || height[count] <= 0)
+			usage(argv[0]);
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+
+	if (count == 0 || seconds <= 0)
+		usage(argv[0]);
+
+	for (i = 0; i < count; i++)
+	{
+		if (pipe(pipes[i]) == -1)
+			return 1;
+
+		if (fork() == 0)
+		{
+			close(pipes[i][0]);
+			if (!encode(width[i], height[i], seconds, upload, &r))
+				_exit(1);
+			if (write(pipes[i][1], &r, sizeof(r)) != sizeof(r))
+				_exit(1);
+			_exit(0);
+		}
+
+		close(pipes[i][1]);
+	}
+
+	printf("  size         frames     fps  get avg/ms  get max/ms\n");
+	for (i = 0; i < count; i++)
+	{
+		char size[16];
+
+		snprintf(size, sizeof(size), "%dx%d", width[i], height[i]);
+		if (read(pipes[i][0], &r, sizeof(r)) != sizeof(r))
+		{
+			printf("  %-11s  failed\n", size);
+			continue;
+		}
+
+		printf("  %-11s %7d %7.1f %11.3f %11.3f\n", size, r.frames,
+			r.frames / (r.elapsed / 1e9),
+			r.frames ? r.get_total / 1e6 / r.frames : 0.0, r.get_max / 1e6);
+	}
+
+	while (wait(NULL) > 0)
+		;
+
+	return 0;
+}
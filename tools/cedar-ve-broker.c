@@ -0,0 +1,894 @@
+/*
+ * Share the VE between processes
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* cedar-ve-broker [-S] [-n ns_per_mb] [-m mem_mb] [-g group] <socket>
+ *   owns the VE and serves the processes started with
+ *   CEDAR_VE_BROKER=<socket>, see vebroker.h. Only processes of the same
+ *   user (and root) may connect, with -g also the members of group. The
+ *   clients get a shared memory file per allocation, never the device
+ *   or the VE memory itself. Note that a client holding the VE can still
+ *   point it at any physical address through the registers, only trusted
+ *   users should be let in. The VE goes to the waiting
+ *   client with the least VE time so far, divided by its weight
+ *   (CEDAR_VE_BROKER_WEIGHT, 1 by default), so a client encoding a small
+ *   stream isn't starved by a big one.
+ *
+ *   Per client statistics are printed on SIGUSR1, when a client leaves
+ *   and at exit: frames (VE lock and unlock), VE time and share, the
+ *   time spent queueing for the VE, register traffic and the bytes
+ *   copied between the clients' memory and the VE memory.
+ *
+ *   -S simulates the VE instead of opening it: encoder jobs take
+ *   ns_per_mb (default 1000) per macroblock and produce no picture, the
+ *   VE memory is mem_mb (default 64) megabytes of ordinary memory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "ve.h"
+#include "vebroker.h"
+
+#define MAX_CLIENTS	32
+#define BUF_SIZE	(2 * (sizeof(struct ve_broker_msg) + VE_BROKER_MAX_REGS * sizeof(struct ve_reg)))
+
+struct client
+{
+	int fd;
+	int id;
+	int pid;
+	int weight;
+	int waiting;		// LOCK not granted yet
+	uint64_t lock_time;	// LOCK arrived, or was granted while holding
+	uint64_t vruntime;	// VE time held / weight
+
+	uint64_t connect_time;
+	uint64_t frames;
+	uint64_t held;
+	uint64_t queued;
+	uint64_t queued_max;
+	uint64_t writes;
+	uint64_t reads;
+	uint64_t rejected;	// register accesses without holding the VE, foreign memory
+	uint64_t copied;	// bytes, both ways
+	uint32_t mem;
+
+	uint8_t buf[BUF_SIZE];
+	int len;
+};
+
+struct block
+{
+	uint32_t phys;
+	uint32_t size;
+	struct client *owner;	// NULL if free
+	uint8_t *copy;		// the owner's shared memory file
+	struct block *next;
+};
+
+static struct client *clients[MAX_CLIENTS];
+static struct client *holder = NULL;
+static int last_holder_id = 0;
+static int next_id = 0;
+static uint64_t min_vruntime = 0;
+static int engine = VE_ENGINE_NONE;
+
+static struct block *blocks = NULL;
+static uint32_t mem_phys;
+static int mem_size;
+static uint32_t mem_offset;
+static int mem_fd = -1;
+static uint8_t *mem;
+static int allocs = 0;
+
+// the VE, or a simulation of it
+static int simulate = 0;
+static void *regs;
+static uint32_t sim_regs[0x1000 / 4];
+static uint64_t sim_ns_per_mb = 1000;
+static uint64_t sim_job_end = 0;	// 0 when idle
+
+// -g, members may connect as well
+static int group_access = 0;
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump = 0;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		dump = 1;
+	else
+		quit = 1;
+}
+
+/* an unnamed shared memory file */
+static int shm_file(int size)
+{
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/cedar-ve-broker-%d-%d", getpid(), allocs++);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		return -1;
+
+	shm_unlink(name);
+	if (ftruncate(fd, size) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int sim_open(int size)
+{
+	mem_fd = shm_file(size);
+	if (mem_fd == -1)
+		return 0;
+
+	// any page aligned address will do, it's never given to hardware
+	mem_phys = 0x40000000;
+	mem_size = size;
+	mem_offset = 0;
+
+	regs = sim_regs;
+	sim_regs[VE_VERSION / 4] = 0x16230000;
+
+	return 1;
+}
+
+static void sim_write(uint32_t offset, uint32_t val)
+{
+	uint32_t *r = &sim_regs[offset / 4];
+
+	switch (offset)
+	{
+	case VE_AVC_STATUS:
+		*r &= ~val;
+		break;
+
+	case VE_AVC_TRIGGER:
+		if ((val & 0xf) == 0x8)
+		{
+			uint32_t size = sim_regs[VE_ISP_INPUT_SIZE / 4];
+			uint64_t mbs = (size >> 16) * (size & 0xffff);
+
+			sim_job_end = now() + mbs * sim_ns_per_mb;
+			// something plausible for the output size, 8 bytes per MB
+			sim_regs[VE_AVC_VLE_LENGTH / 4] += mbs * 64;
+		}
+		else if ((val & 0xf) == 0x1)
+			sim_regs[VE_AVC_VLE_LENGTH / 4] += (val >> 8) & 0x1f;
+		break;
+
+	case VE_AVC_VLE_OFFSET:
+		*r = val;
+		sim_regs[VE_AVC_VLE_LENGTH / 4] = val;
+		break;
+
+	default:
+		*r = val;
+	}
+}
+
+static int sim_wait(int timeout)
+{
+	struct timespec ts;
+	uint64_t t = now(), end = sim_job_end;
+	uint64_t deadline = t + timeout * 1000000000ULL;
+
+	if (end == 0)
+		return 0;
+
+	if (end > deadline)
+		end = deadline;
+
+	if (end > t)
+	{
+		ts.tv_sec = (end - t) / 1000000000ULL;
+		ts.tv_nsec = (end - t) % 1000000000ULL;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+
+	if (sim_job_end > deadline)
+		return 0;
+
+	sim_job_end = 0;
+	sim_regs[VE_AVC_STATUS / 4] |= 0x1;
+	return 1;
+}
+
+static void reg_write(uint32_t offset, uint32_t val)
+{
+	int byte = offset & VE_BROKER_BYTE;
+
+	offset &= 0xfff;
+
+	if (offset == VE_CTRL)
+		engine = val & 0xf;
+
+	if (simulate)
+	{
+		if (byte)
+		{
+			uint8_t *r = (uint8_t *)sim_regs + offset;
+
+			*r = val;
+			val = sim_regs[offset / 4];
+		}
+		sim_write(offset & ~3, val);
+	}
+	else if (byte)
+		writeb(val, regs + offset);
+	else
+		writel(val, regs + offset);
+}
+
+static uint32_t reg_read(uint32_t offset)
+{
+	offset &= 0xffc;
+
+	if (simulate)
+		return sim_regs[offset / 4];
+
+	return readl(regs + offset);
+}
+
+static int reg_wait(int timeout)
+{
+	if (simulate)
+		return sim_wait(timeout);
+
+	return ve_wait(timeout);
+}
+
+/* the block of c that holds phys to phys + len */
+static struct block *find_block(struct client *c, uint32_t phys, uint32_t len)
+{
+	struct block *b;
+
+	for (b = blocks; b != NULL; b = b->next)
+		if (b->owner == c && phys >= b->phys && phys - b->phys < b->size
+				&& len <= b->size - (phys - b->phys))
+			return b;
+
+	c->rejected++;
+	return NULL;
+}
+
+/* the client wrote its copy, the VE is going to read */
+static void flush(struct client *c, uint32_t phys, uint32_t len)
+{
+	struct block *b = find_block(c, phys, len);
+
+	if (!b)
+		return;
+
+	memcpy(mem + (phys - mem_phys), b->copy + (phys - b->phys), len);
+	c->copied += len;
+
+	if (!simulate)
+		ve_flush_cache(mem + (phys - mem_phys), len);
+}
+
+/* the VE wrote, the client is going to read its copy */
+static void invalidate(struct client *c, uint32_t phys, uint32_t len)
+{
+	struct block *b = find_block(c, phys, len);
+
+	if (!b)
+		return;
+
+	if (!simulate)
+		ve_flush_cache(mem + (phys - mem_phys), len);
+
+	memcpy(b->copy + (phys - b->phys), mem + (phys - mem_phys), len);
+	c->copied += len;
+}
+
+/* first fit, sizes are page multiples already. Returns the physical
+ * address and the client's shared memory file for it in fd.
+ */
+static uint32_t alloc(struct client *c, uint32_t size, int *fd)
+{
+	struct block *b, *n;
+	uint8_t *copy;
+
+	*fd = -1;
+	size = (size + 4095) & ~4095;
+	for (b = blocks; b != NULL; b = b->next)
+		if (!b->owner && b->size >= size)
+			break;
+
+	if (!b || size == 0)
+		return 0;
+
+	*fd = shm_file(size);
+	if (*fd == -1)
+		return 0;
+
+	copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (copy == MAP_FAILED)
+	{
+		close(*fd);
+		*fd = -1;
+		return 0;
+	}
+
+	if (b->size > size)
+	{
+		n = calloc(1, sizeof(*n));
+		n->phys = b->phys + size;
+		n->size = b->size - size;
+		n->next = b->next;
+		b->next = n;
+		b->size = size;
+	}
+
+	b->owner = c;
+	b->copy = copy;
+	c->mem += size;
+	return b->phys;
+}
+
+static void release(struct client *c, uint32_t phys, int all)
+{
+	struct block *b, *n;
+
+	for (b = blocks; b != NULL; b = b->next)
+		if (b->owner == c && (all || b->phys == phys))
+		{
+			munmap(b->copy, b->size);
+			b->copy = NULL;
+			b->owner = NULL;
+			c->mem -= b->size;
+		}
+
+	for (b = blocks; b != NULL; b = b->next)
+		while (!b->owner && b->next && !b->next->owner)
+		{
+			n = b->next;
+			b->size += n->size;
+			b->next = n->next;
+			free(n);
+		}
+}
+
+static void mem_info(struct ve_broker_reply *reply)
+{
+	struct block *b;
+	uint32_t free_size = 0;
+
+	for (b = blocks; b != NULL; b = b->next)
+	{
+		reply->arg[0] += b->size;
+		if (b->owner)
+			reply->arg[1] += b->size;
+		else
+		{
+			free_size += b->size;
+			if (b->size > reply->arg[2])
+				reply->arg[2] = b->size;
+		}
+	}
+
+	if (free_size > 0)
+		reply->arg[3] = 100 - (int)((int64_t)reply->arg[2] * 100 / free_size);
+}
+
+static void send_reply(struct client *c, struct ve_broker_reply *reply)
+{
+	int n, done = 0;
+
+	while (done < (int)sizeof(*reply))
+	{
+		n = write(c->fd, (uint8_t *)reply + done, sizeof(*reply) - done);
+		if (n <= 0 && errno != EINTR)
+			return;
+		if (n > 0)
+			done += n;
+	}
+}
+
+/* a reply with a file descriptor, which is closed here */
+static void send_reply_fd(struct client *c, struct ve_broker_reply *reply, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = reply, .iov_len = sizeof(*reply) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+
+	if (fd == -1)
+	{
+		send_reply(c, reply);
+		return;
+	}
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+	close(fd);
+}
+
+static void hello(struct client *c, uint32_t weight)
+{
+	struct ve_broker_reply reply = { .ret = VE_BROKER_VERSION,
+		.arg = { reg_read(VE_VERSION) >> 16 } };
+
+	c->weight = weight < 1 ? 1 : weight > 100 ? 100 : weight;
+
+	send_reply(c, &reply);
+}
+
+/* give the VE to the waiting client with the least weighted VE time */
+static void schedule(void)
+{
+	struct ve_broker_reply reply = { 0 };
+	struct client *next = NULL;
+	uint64_t t;
+	int i;
+
+	if (holder)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i] && clients[i]->waiting && (!next
+				|| clients[i]->vruntime < next->vruntime
+				|| (clients[i]->vruntime == next->vruntime
+					&& clients[i]->lock_time < next->lock_time)))
+			next = clients[i];
+
+	if (!next)
+		return;
+
+	t = now();
+	next->waiting = 0;
+	next->queued += t - next->lock_time;
+	if (t - next->lock_time > next->queued_max)
+		next->queued_max = t - next->lock_time;
+	next->lock_time = t;
+
+	if (next->vruntime > min_vruntime)
+		min_vruntime = next->vruntime;
+
+	holder = next;
+	reply.ret = (last_holder_id != next->id);
+	reply.arg[0] = engine;
+	last_holder_id = next->id;
+
+	send_reply(next, &reply);
+}
+
+static void unlock(struct client *c)
+{
+	uint64_t held = now() - c->lock_time;
+
+	c->frames++;
+	c->held += held;
+	c->vruntime += held / c->weight;
+	holder = NULL;
+}
+
+static void print_client(struct client *c, uint64_t t)
+{
+	double secs = (t - c->connect_time) / 1e9;
+	uint64_t grants = c->frames + (holder == c);
+
+	printf("%4d %7d %3d %8llu %7.1f %8.1f %5.1f%% %8.3f %8.3f %9llu %7llu %6llu %7u %8.1f\n",
+		c->id, c->pid, c->weight, (unsigned long long)c->frames,
+		secs > 0 ? c->frames / secs : 0.0, c->held / 1e6,
+		secs > 0 ? c->held / 1e7 / secs : 0.0,
+		grants ? c->queued / 1e6 / grants : 0.0, c->queued_max / 1e6,
+		(unsigned long long)c->writes, (unsigned long long)c->reads,
+		(unsigned long long)c->rejected, c->mem / 1024, c->copied / 1e6);
+}
+
+static void print_header(void)
+{
+	printf("  id     pid  wt   frames     fps  ve (ms)  share  q avg/ms  q max/ms    writes   reads reject  mem/KB  copy/MB\n");
+}
+
+static void print_stats(void)
+{
+	uint64_t t = now();
+	int i;
+
+	print_header();
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i])
+			print_client(clients[i], t);
+	fflush(stdout);
+}
+
+static void drop(int i)
+{
+	struct client *c = clients[i];
+
+	if (holder == c)
+		unlock(c);
+
+	printf("client %d (pid %d) left\n", c->id, c->pid);
+	print_header();
+	print_client(c, now());
+	fflush(stdout);
+
+	release(c, 0, 1);
+	close(c->fd);
+	free(c);
+	clients[i] = NULL;
+
+	schedule();
+}
+
+static int dispatch(struct client *c, struct ve_broker_msg *msg, struct ve_reg *prog)
+{
+	struct ve_broker_reply reply = { 0 };
+	uint32_t i;
+	int fd;
+
+	switch (msg->type)
+	{
+	case VE_BROKER_HELLO:
+		hello(c, msg->arg[0]);
+		break;
+
+	case VE_BROKER_LOCK:
+		if (holder == c)
+			return 0;
+		// an idle client doesn't bank VE time for later
+		if (c->vruntime < min_vruntime)
+			c->vruntime = min_vruntime;
+		c->waiting = 1;
+		c->lock_time = now();
+		schedule();
+		break;
+
+	case VE_BROKER_UNLOCK:
+		if (holder == c)
+		{
+			unlock(c);
+			schedule();
+		}
+		break;
+
+	case VE_BROKER_REGS:
+		if (holder != c)
+		{
+			c->rejected += msg->count;
+			break;
+		}
+		for (i = 0; i < msg->count; i++)
+			reg_write(prog[i].offset, prog[i].value);
+		c->writes += msg->count;
+		break;
+
+	case VE_BROKER_READ:
+		if (holder != c)
+			c->rejected++;
+		else
+		{
+			reply.ret = reg_read(msg->arg[0]);
+			c->reads++;
+		}
+		send_reply(c, &reply);
+		break;
+
+	case VE_BROKER_WAIT:
+		if (holder == c)
+			reply.ret = reg_wait(msg->arg[0]);
+		send_reply(c, &reply);
+		break;
+
+	case VE_BROKER_FLUSH:
+		flush(c, msg->arg[0], msg->arg[1]);
+		break;
+
+	case VE_BROKER_INVALIDATE:
+		invalidate(c, msg->arg[0], msg->arg[1]);
+		send_reply(c, &reply);
+		break;
+
+	case VE_BROKER_ALLOC:
+		reply.arg[0] = alloc(c, msg->arg[0], &fd);
+		reply.ret = (reply.arg[0] != 0);
+		send_reply_fd(c, &reply, fd);
+		break;
+
+	case VE_BROKER_FREE:
+		release(c, msg->arg[0], 0);
+		break;
+
+	case VE_BROKER_MEM_INFO:
+		mem_info(&reply);
+		send_reply(c, &reply);
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/* handle the complete messages, in order, stopping while waiting for the
+ * VE. Returns 0 if the client misbehaved.
+ */
+static int process(struct client *c)
+{
+	struct ve_broker_msg msg;
+	int size;
+
+	while (!c->waiting && c->len >= (int)sizeof(msg))
+	{
+		memcpy(&msg, c->buf, sizeof(msg));
+		if (msg.type == VE_BROKER_REGS && msg.count > VE_BROKER_MAX_REGS)
+			return 0;
+
+		size = sizeof(msg) + (msg.type == VE_BROKER_REGS ? msg.count * sizeof(struct ve_reg) : 0);
+		if (c->len < size)
+			break;
+
+		if (!dispatch(c, &msg, (struct ve_reg *)(c->buf + sizeof(msg))))
+			return 0;
+
+		memmove(c->buf, c->buf + size, c->len - size);
+		c->len -= size;
+	}
+
+	return 1;
+}
+
+static void accept_client(int s)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct client *c;
+	int i, fd;
+
+	fd = accept(s, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	// the socket's permissions let the group in, if any
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1
+			|| (cred.uid != geteuid() && cred.uid != 0 && !group_access))
+	{
+		fprintf(stderr, "refusing a client of user %d\n", (int)cred.uid);
+		close(fd);
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (!clients[i])
+			break;
+
+	if (i == MAX_CLIENTS)
+	{
+		fprintf(stderr, "too many clients\n");
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	c->fd = fd;
+	c->id = ++next_id;
+	c->weight = 1;
+	c->connect_time = now();
+	c->vruntime = min_vruntime;
+	c->pid = cred.pid;
+
+	clients[i] = c;
+}
+
+static int open_ve(int mb)
+{
+	if (simulate)
+		return sim_open(mb << 20);
+
+	if (!ve_open())
+		return 0;
+
+	regs = ve_get_regs();
+	mem_fd = ve_get_mem_fd(&mem_phys, &mem_size, &mem_offset);
+
+	return mem_fd != -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-S] [-n ns_per_mb] [-m mem_mb] [-g group] <socket>\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct client *polled[MAX_CLIENTS + 1];
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct group *group = NULL;
+	int mb = 64;
+	int opt, s, i, n, nfds;
+
+	while ((opt = getopt(argc, argv, "Sn:m:g:")) != -1)
+		switch (opt)
+		{
+		case 'S':
+			simulate = 1;
+			break;
+		case 'n':
+			sim_ns_per_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			mb = atoi(optarg);
+			break;
+		case 'g':
+			group = getgrnam(optarg);
+			if (!group)
+			{
+				fprintf(stderr, "no group %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc - 1 || mb <= 0)
+		usage(argv[0]);
+
+	// the broker itself talks to the VE directly
+	unsetenv("CEDAR_VE_BROKER");
+
+	if (!open_ve(mb))
+	{
+		fprintf(stderr, "can't open the VE\n");
+		return 1;
+	}
+
+	mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, mem_offset);
+	if (mem == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	blocks = calloc(1, sizeof(*blocks));
+	blocks->phys = mem_phys;
+	blocks->size = mem_size;
+
+	strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	// nobody else can connect until the socket has its group
+	umask(0177);
+	if (s == -1 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| (group && (chown(addr.sun_path, -1, group->gr_gid) == -1
+				|| chmod(addr.sun_path, 0660) == -1))
+			|| listen(s, 8) == -1)
+	{
+		perror(addr.sun_path);
+		return 1;
+	}
+	group_access = (group != NULL);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%s VE, %d KB of memory at 0x%08x, listening on %s\n",
+		simulate ? "simulated" : "real", mem_size / 1024, mem_phys, addr.sun_path);
+	fflush(stdout);
+
+	while (!quit)
+	{
+		if (dump)
+		{
+			dump = 0;
+			print_stats();
+		}
+
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		nfds = 1;
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i])
+			{
+				// nothing is read from a client while its buffer is full
+				fds[nfds].fd = clients[i]->fd;
+				fds[nfds].events = clients[i]->len < (int)BUF_SIZE ? POLLIN : 0;
+				polled[nfds++] = clients[i];
+			}
+
+		if (poll(fds, nfds, -1) == -1)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+			accept_client(s);
+
+		for (i = 1; i < nfds; i++)
+		{
+			struct client *c = polled[i];
+
+			if (!fds[i].revents)
+				continue;
+
+			n = read(c->fd, c->buf + c->len, BUF_SIZE - c->len);
+			if (n > 0)
+				c->len += n;
+
+			if (n <= 0 || !process(c))
+			{
+				for (n = 0; clients[n] != c; n++)
+					;
+				drop(n);
+			}
+		}
+
+		// a client granted the VE continues with what it sent after LOCK
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i] && !process(clients[i]))
+				drop(i);
+	}
+
+	print_stats();
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i])
+			drop(i);
+
+	unlink(addr.sun_path);
+	if (!simulate)
+		ve_close();
+
+	return 0;
+}
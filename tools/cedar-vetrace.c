@@ -0,0 +1,441 @@
+/*
+ * Summarise and replay VE access traces
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* cedar-vetrace summary [-q] <trace>
+ *   per frame (ve_get() to ve_put()) register access counts and where
+ *   the time went: cache flushes, waiting for the VE, other ioctls and
+ *   the rest, which is register programming and the CPU work between
+ *   the accesses. Events between two frames count towards the next one.
+ *
+ * cedar-vetrace replay [-t] [-p] [-n loops] <trace>
+ *   issues the recorded accesses against a register file in memory, so
+ *   the host side cost of a trace can be reproduced without a VE. -t
+ *   spins for the recorded ioctl durations, -p keeps the recorded
+ *   timeline, waiting where the device was slower than the replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "vetrace.h"
+
+/* ioctl commands, from ve.c */
+static const struct
+{
+	int cmd;
+	const char *name;
+} ioctls[] = {
+	{ 0x101, "GET_ENV_INFO" },
+	{ 0x102, "WAIT_VE" },
+	{ 0x103, "RESET_VE" },
+	{ 0x104, "ENABLE_VE" },
+	{ 0x105, "DISABLE_VE" },
+	{ 0x106, "SET_VE_FREQ" },
+	{ 0x206, "ENGINE_REQ" },
+	{ 0x207, "ENGINE_REL" },
+	{ 0x20b, "FLUSH_CACHE" },
+};
+
+#define IOCTL_WAIT_VE		0x102
+#define IOCTL_FLUSH_CACHE	0x20b
+
+#define NUM_OFFSETS		(0x1000 / 4)
+#define TOP_OFFSETS		16
+
+struct frame
+{
+	int engine;
+	uint64_t start;		// ve_get()
+	uint64_t span;		// ve_get() to ve_put()
+	int writes;
+	int reads;
+	int ioctls;
+	uint64_t flush;
+	uint64_t wait;
+	uint64_t other;		// other ioctls
+	uint64_t ioctl_in_span;
+};
+
+static const char *ioctl_name(int cmd)
+{
+	static char buf[16];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ioctls) / sizeof(ioctls[0]); i++)
+		if (ioctls[i].cmd == cmd)
+			return ioctls[i].name;
+
+	snprintf(buf, sizeof(buf), "0x%03x", cmd);
+	return buf;
+}
+
+static struct ve_trace_record *load(const char *path, struct ve_trace_header *header)
+{
+	struct ve_trace_record *records;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	if (fread(header, sizeof(*header), 1, f) != 1 || header->magic != VE_TRACE_MAGIC
+			|| header->version != VE_TRACE_VERSION
+			|| header->record_size != sizeof(struct ve_trace_record)) {
+		fprintf(stderr, "%s: not a VE trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	records = malloc((size_t)header->count * sizeof(*records) + 1);
+	if (!records || fread(records, sizeof(*records), header->count, f) != header->count) {
+		fprintf(stderr, "%s: truncated\n", path);
+		free(records);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	return records;
+}
+
+static double us(uint64_t ns)
+{
+	return ns / 1000.0;
+}
+
+static int summary(const struct ve_trace_header *header, const struct ve_trace_record *r, int quiet)
+{
+	static unsigned int offset_count[NUM_OFFSETS];
+	unsigned int ioctl_count[0x300] = { 0 };
+	uint64_t ioctl_time[0x300] = { 0 }, ioctl_max[0x300] = { 0 };
+	struct frame f, total;
+	int frames = 0, in_frame = 0, allocs = 0, frees = 0, i, j, top[TOP_OFFSETS];
+	int64_t mem = 0, mem_peak = 0;
+	unsigned int n;
+
+	memset(&f, 0, sizeof(f));
+	memset(&total, 0, sizeof(total));
+
+	printf("%u records, %u dropped, %.3f ms\n", header->count, header->dropped,
+		header->count ? (r[header->count - 1].time - r[0].time) / 1e6 : 0.0);
+
+	if (!quiet)
+		printf("\n%6s %6s %9s %6s %5s %6s %9s %9s %9s %9s\n", "frame", "engine", "span_us",
+			"writes", "reads", "ioctls", "flush_us", "wait_us", "other_us", "host_us");
+
+	for (n = 0; n < header->count; n++) {
+		switch (r[n].type) {
+		case VE_TRACE_WRITE:
+		case VE_TRACE_WRITEB:
+			f.writes++;
+			offset_count[(r[n].offset / 4) % NUM_OFFSETS]++;
+			break;
+
+		case VE_TRACE_READ:
+			f.reads++;
+			break;
+
+		case VE_TRACE_IOCTL:
+			f.ioctls++;
+			if (r[n].offset == IOCTL_FLUSH_CACHE)
+				f.flush += r[n].value;
+			else if (r[n].offset == IOCTL_WAIT_VE)
+				f.wait += r[n].value;
+			else
+				f.other += r[n].value;
+
+			if (in_frame)
+				f.ioctl_in_span += r[n].value;
+
+			if (r[n].offset < 0x300) {
+				ioctl_count[r[n].offset]++;
+				ioctl_time[r[n].offset] += r[n].value;
+				if (r[n].value > ioctl_max[r[n].offset])
+					ioctl_max[r[n].offset] = r[n].value;
+			}
+			break;
+
+		case VE_TRACE_MALLOC:
+			allocs++;
+			mem += r[n].value;
+			if (mem > mem_peak)
+				mem_peak = mem;
+			break;
+
+		case VE_TRACE_FREE:
+			frees++;
+			mem -= r[n].value;
+			break;
+
+		case VE_TRACE_GET:
+			f.engine = r[n].offset;
+			f.start = r[n].time;
+			in_frame = 1;
+			break;
+
+		case VE_TRACE_PUT:
+			if (!in_frame)
+				break;
+
+			f.span = r[n].time - f.start;
+			if (!quiet)
+				printf("%6d %6x %9.1f %6d %5d %6d %9.1f %9.1f %9.1f %9.1f\n", frames, f.engine,
+					us(f.span), f.writes, f.reads, f.ioctls, us(f.flush), us(f.wait),
+					us(f.other), us(f.span - f.ioctl_in_span));
+
+			total.span += f.span;
+			total.writes += f.writes;
+			total.reads += f.reads;
+			total.ioctls += f.ioctls;
+			total.flush += f.flush;
+			total.wait += f.wait;
+			total.other += f.other;
+			total.ioctl_in_span += f.ioctl_in_span;
+			frames++;
+
+			memset(&f, 0, sizeof(f));
+			in_frame = 0;
+			break;
+		}
+	}
+
+	if (frames) {
+		printf("\naverage over %d frames:\n", frames);
+		printf("  span %.1f us, %.1f writes, %.1f reads, %.1f ioctls\n", us(total.span) / frames,
+			(double)total.writes / frames, (double)total.reads / frames,
+			(double)total.ioctls / frames);
+		printf("  flush %.1f us, wait %.1f us, other ioctls %.1f us, host %.1f us\n",
+			us(total.flush) / frames, us(total.wait) / frames, us(total.other) / frames,
+			us(total.span - total.ioctl_in_span) / frames);
+	}
+
+	printf("\nioctls:\n");
+	for (i = 0; i < 0x300; i++)
+		if (ioctl_count[i])
+			printf("  %-12s %8u calls %12.1f us total %9.1f us avg %9.1f us max\n",
+				ioctl_name(i), ioctl_count[i], us(ioctl_time[i]),
+				us(ioctl_time[i]) / ioctl_count[i], us(ioctl_max[i]));
+
+	printf("\nmost written registers:\n");
+	for (i = 0; i < TOP_OFFSETS; i++) {
+		top[i] = -1;
+		for (j = 0; j < NUM_OFFSETS; j++)
+			if (offset_count[j] && (top[i] == -1 || offset_count[j] > offset_count[top[i]])) {
+				int k, taken = 0;
+
+				for (k = 0; k < i; k++)
+					taken |= top[k] == j;
+				if (!taken)
+					top[i] = j;
+			}
+
+		if (top[i] == -1)
+			break;
+
+		printf("  0x%03x %10u writes %9.1f per frame\n", top[i] * 4, offset_count[top[i]],
+			frames ? (double)offset_count[top[i]] / frames : 0.0);
+	}
+
+	printf("\nallocations: %d, frees: %d, peak %lld bytes\n", allocs, frees, (long long)mem_peak);
+
+	return 0;
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void spin_until(uint64_t t)
+{
+	while (now() < t)
+		;
+}
+
+/* the stand-in for the VE: a register file, malloc() for VE memory and
+ * a mutex for ve_get()/ve_put()
+ */
+static int replay(const struct ve_trace_header *header, const struct ve_trace_record *r,
+	int timed, int paced, int loops)
+{
+	static uint32_t regs[NUM_OFFSETS];
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static volatile uint32_t sink;
+	void **blocks;
+	int *block_size, num_blocks = 0, i, loop;
+	uint64_t start, late = 0, t;
+	unsigned int n;
+
+	blocks = calloc(header->count + 1, sizeof(*blocks));
+	block_size = calloc(header->count + 1, sizeof(*block_size));
+	if (!blocks || !block_size)
+		return 1;
+
+	start = now();
+	for (loop = 0; loop < loops; loop++) {
+		uint64_t loop_start = now();
+
+		for (n = 0; n < header->count; n++) {
+			volatile uint32_t *reg = &regs[(r[n].offset / 4) % NUM_OFFSETS];
+
+			if (paced) {
+				t = now() - loop_start;
+				if (t > r[n].time - r[0].time && t - (r[n].time - r[0].time) > late)
+					late = t - (r[n].time - r[0].time);
+				spin_until(loop_start + r[n].time - r[0].time);
+			}
+
+			switch (r[n].type) {
+			case VE_TRACE_WRITE:
+			case VE_TRACE_WRITEB:
+				*reg = r[n].value;
+				break;
+
+			case VE_TRACE_READ:
+				regs[(r[n].offset / 4) % NUM_OFFSETS] = r[n].value;
+				sink += *reg;
+				break;
+
+			case VE_TRACE_IOCTL:
+				if (timed && !paced)
+					spin_until(now() + r[n].value);
+				break;
+
+			case VE_TRACE_MALLOC:
+				if (r[n].value) {
+					blocks[num_blocks] = malloc(r[n].value);
+					block_size[num_blocks] = r[n].value;
+					if (blocks[num_blocks])
+						memset(blocks[num_blocks], 0, r[n].value);
+					num_blocks++;
+				}
+				break;
+
+			case VE_TRACE_FREE:
+				for (i = num_blocks - 1; i >= 0; i--)
+					if (block_size[i] == (int)r[n].value) {
+						free(blocks[i]);
+						blocks[i] = blocks[--num_blocks];
+						block_size[i] = block_size[num_blocks];
+						break;
+					}
+				break;
+
+			case VE_TRACE_GET:
+				pthread_mutex_lock(&lock);
+				break;
+
+			case VE_TRACE_PUT:
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+		}
+
+		// whatever the trace left allocated
+		while (num_blocks > 0)
+			free(blocks[--num_blocks]);
+	}
+
+	t = now() - start;
+	printf("replayed %u records %d times in %.3f ms, %.1f ns per record\n", header->count, loops,
+		t / 1e6, header->count ? (double)t / header->count / loops : 0.0);
+	if (header->count)
+		printf("recorded: %.3f ms\n", (r[header->count - 1].time - r[0].time) / 1e6);
+	if (paced)
+		printf("behind the recorded timeline by up to %.1f us\n", us(late));
+
+	free(blocks);
+	free(block_size);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: cedar-vetrace summary [-q] <trace>\n"
+		"       cedar-vetrace replay [-t] [-p] [-n loops] <trace>\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct ve_trace_header header;
+	struct ve_trace_record *records;
+	int quiet = 0, timed = 0, paced = 0, loops = 1, opt, ret = 1;
+	const char *cmd;
+
+	if (argc < 2)
+		usage();
+
+	cmd = argv[1];
+	argv++;
+	argc--;
+
+	while ((opt = getopt(argc, argv, "qtpn:")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
+			break;
+		case 't':
+			timed = 1;
+			break;
+		case 'p':
+			paced = 1;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			if (loops < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	records = load(argv[optind], &header);
+	if (!records)
+		return 1;
+
+	if (!strcmp(cmd, "summary"))
+		ret = summary(&header, records, quiet);
+	else if (!strcmp(cmd, "replay"))
+		ret = replay(&header, records, timed, paced, loops);
+	else
+		usage();
+
+	free(records);
+
+	return ret;
+}